@@ -2,28 +2,234 @@
 
 #include <models/tree.h>
 #include <models/plt.h>
+#include <resources.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <ctime>
+#include <deque>
 #include <set>
 #include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include <pecos/core/xmc/inference.hpp>
 #include <pecos/core/utils/scipy_loader.hpp>
+#include <third_party/nlohmann_json/json.hpp>
+
+struct BenchmarkOptions {
+	// Every combination of these values is benchmarked
+	std::vector<int> threads = {1};
+	std::vector<int> beam_sizes = {20};
+	std::vector<int> top_ks = {10};
+	std::vector<pecos::layer_type_t> layer_types = {pecos::LAYER_TYPE_HASH_CHUNKED};
+
+	// Latency mode runs every query on its own and reports wall clock percentiles
+	bool latency = false;
+	int warmup = 100; // Untimed queries run before measuring, per engine
+	int pin_cpu = -1; // CPU to pin the benchmark thread to in latency mode, -1 to not pin
+
+	// Per layer timings and hardware counters of single threaded runs
+	bool counters = false;
+
+	// Open loop mode issues queries with Poisson arrivals to a pool of `threads` workers
+	bool load = false;
+	std::vector<double> load_qps; // Offered rates, empty for fractions of the estimated capacity
+	double load_duration = 2.0; // Seconds of arrivals per rate
+	double knee_factor = 3.0; // The knee is the last rate with p99 within this factor of the lowest rate's p99
+	uint64_t load_seed = 1;
+
+	// PECOS is also run with its top layers replaced by an HNSW matcher, see pecos::hnsw_matcher_t
+	int matcher_depth = 0; // Layers covered by the matcher, 0 to skip these runs
+	int matcher_efs = 100;
+
+	// Machine readable output of every run, empty to skip
+	std::string json_path;
+	std::string csv_path;
+
+	// Compare mode fails the benchmark if a run regresses against the baseline results file
+	std::string baseline_path;
+	double max_throughput_drop = 5.0; // Percent
+	double max_p99_increase = 10.0; // Percent
+};
+
+// One cell of the benchmark grid
+struct RunParams {
+	pecos::layer_type_t layer_type;
+	int threads;
+	int beam_size;
+	int top_k;
+};
+
+const char* LayerTypeName(pecos::layer_type_t layer_type) {
+	switch (layer_type) {
+		case pecos::LAYER_TYPE_CSC: return "csc";
+		case pecos::LAYER_TYPE_HASH_CHUNKED: return "hash";
+		case pecos::LAYER_TYPE_BINARY_SEARCH_CHUNKED: return "binsearch";
+	}
+	return "unknown";
+}
 
-pecos::csr_t OnlyFirstRow(pecos::csr_t mat) {
+pecos::layer_type_t ParseLayerType(const std::string& name) {
+	if (name == "csc") {
+		return pecos::LAYER_TYPE_CSC;
+	} else if (name == "hash") {
+		return pecos::LAYER_TYPE_HASH_CHUNKED;
+	} else if (name == "binsearch") {
+		return pecos::LAYER_TYPE_BINARY_SEARCH_CHUNKED;
+	}
+	throw std::invalid_argument("unknown layer type " + name + ", expected csc, hash or binsearch");
+}
+
+std::vector<std::string> SplitList(const std::string& list) {
+	std::vector<std::string> items;
+	size_t begin = 0;
+	while (begin <= list.size()) {
+		size_t end = list.find(',', begin);
+		if (end == std::string::npos) {
+			end = list.size();
+		}
+		if (end > begin) {
+			items.emplace_back(list.substr(begin, end - begin));
+		}
+		begin = end + 1;
+	}
+	return items;
+}
+
+std::vector<double> ParseDoubleList(const std::string& list) {
+	std::vector<double> values;
+	for (auto& item : SplitList(list)) {
+		values.push_back(std::stod(item));
+	}
+	return values;
+}
+
+std::vector<int> ParseIntList(const std::string& list) {
+	std::vector<int> values;
+	for (auto& item : SplitList(list)) {
+		values.push_back(std::stoi(item));
+	}
+	return values;
+}
+
+// Wall clock latencies of individual queries
+class LatencyHistogram {
+public:
+	void Record(double ms) {
+		samples.push_back(ms);
+		sorted = false;
+	}
+
+	size_t Count() const {
+		return samples.size();
+	}
+
+	double Mean() const {
+		double sum = 0.0;
+		for (auto s : samples) {
+			sum += s;
+		}
+		return samples.empty() ? 0.0 : sum / samples.size();
+	}
+
+	// Nearest-rank percentile, p in [0, 100]
+	double Percentile(double p) {
+		if (samples.empty()) {
+			return 0.0;
+		}
+		Sort();
+		size_t rank = (size_t)std::ceil(p / 100.0 * samples.size());
+		return samples[std::min(samples.size() - 1, rank > 0 ? rank - 1 : 0)];
+	}
+
+	double Max() {
+		return Percentile(100.0);
+	}
+
+	void Merge(const LatencyHistogram& other) {
+		samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+		sorted = false;
+	}
+
+private:
+	std::vector<double> samples;
+	bool sorted = true;
+
+	void Sort() {
+		if (!sorted) {
+			std::sort(samples.begin(), samples.end());
+			sorted = true;
+		}
+	}
+};
+
+double ElapsedMs(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void PinToCpu(int cpu) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+		std::cout << "Could not pin to CPU " << cpu << ", running unpinned" << std::endl;
+	}
+#else
+	std::cout << "CPU pinning is not supported on this platform, running unpinned" << std::endl;
+#endif
+}
+
+// Copies rows [begin, end) into a new matrix
+pecos::csr_t ExtractRows(const pecos::csr_t& mat, int begin, int end) {
 	pecos::csr_t out;
 
-	auto nnz = mat.indptr[1];
+	auto start = mat.indptr[begin];
+	auto nnz = mat.indptr[end] - start;
 
-	out.allocate(1, mat.cols, nnz);
+	out.allocate(end - begin, mat.cols, nnz);
 
-	std::memcpy(out.indices, mat.indices, nnz * sizeof(pecos::csr_t::index_type));
-	std::memcpy(out.val, mat.val, nnz * sizeof(pecos::csr_t::value_type));
-	std::memcpy(out.indptr, mat.indptr, 2 * sizeof(pecos::csr_t::mem_index_type));
+	std::memcpy(out.indices, mat.indices + start, nnz * sizeof(pecos::csr_t::index_type));
+	std::memcpy(out.val, mat.val + start, nnz * sizeof(pecos::csr_t::value_type));
+	for (int row = begin; row <= end; ++row) {
+		out.indptr[row - begin] = mat.indptr[row] - start;
+	}
 
 	return out;
 }
 
+pecos::csr_t ExtractRow(const pecos::csr_t& mat, int row) {
+	return ExtractRows(mat, row, row + 1);
+}
+
+// Splits the queries into contiguous blocks, one per worker thread
+std::vector<pecos::csr_t> SplitRows(const pecos::csr_t& mat, int parts) {
+	parts = std::max(1, std::min<int>(parts, mat.rows));
+	std::vector<pecos::csr_t> blocks;
+	int block_rows = (mat.rows + parts - 1) / parts;
+	for (int begin = 0; begin < mat.rows; begin += block_rows) {
+		blocks.emplace_back(ExtractRows(mat, begin, std::min<int>(begin + block_rows, mat.rows)));
+	}
+	return blocks;
+}
+
+pecos::csr_t OnlyFirstRow(pecos::csr_t mat) {
+	return ExtractRow(mat, 0);
+}
+
 SRMatrix<Feature> PecosToNapkinXC(const pecos::csr_t& mat, double bias) {
 	SRMatrix<Feature> m;
 	
@@ -82,7 +288,9 @@ std::vector<std::vector<Prediction>> PecosPredictionToNapkinXC(const pecos::csr_
 	return result;
 }
 
-void ComputeRecallPrecision(
+// Missing predictions of queries with fewer than k of them count as wrong, precision at k is always out of k.
+// Returns the number of such queries.
+int ComputeRecallPrecision(
 	const std::vector<std::vector<Prediction>>& ground_truth, 
 	const std::vector<std::vector<Prediction>>& predictions,
 	int topK,
@@ -95,9 +303,13 @@ void ComputeRecallPrecision(
 	std::fill(recall.begin(), recall.end(), 0.0);
 	std::fill(precision.begin(), precision.end(), 0.0);
 
+	int short_rows = 0;
 	for (int i = 0; i < ground_truth.size(); ++i) {
 		auto& truth = ground_truth[i];
 		auto& prediction = predictions[i];
+		if (prediction.size() < (size_t)topK) {
+			++short_rows;
+		}
 
 		std::set<int> truth_labels;
 
@@ -109,7 +321,7 @@ void ComputeRecallPrecision(
 			std::set<int> pred_labels;
 			std::set<int> pred_truth_labels;
 
-			for (int j = 0; j < k; ++j) {
+			for (size_t j = 0; j < std::min<size_t>(k, prediction.size()); ++j) {
 				pred_labels.emplace(prediction[j].label);
 			}
 
@@ -118,7 +330,7 @@ void ComputeRecallPrecision(
 				std::inserter(pred_truth_labels, pred_truth_labels.begin()));
 
 			recall[k-1] += (double)pred_truth_labels.size() / (double)truth_labels.size();
-			precision[k-1] += (double)pred_truth_labels.size() / (double)pred_labels.size();
+			precision[k-1] += (double)pred_truth_labels.size() / (double)k;
 		}
 	}
 
@@ -129,138 +341,1282 @@ void ComputeRecallPrecision(
 	for (auto& p : precision) {
 		p /= (double)ground_truth.size();
 	}
+	return short_rows;
 }
 
-void TestDataSet(const std::filesystem::path& path) {
+// The beam keeps beam_size nodes per layer, so a topK above beam_size times the branching of the
+// last layer cannot be filled
+void WarnShortPredictions(int short_rows, int rows, const RunParams& params) {
+	if (short_rows > 0) {
+		std::cout << "Warning: " << short_rows << " of " << rows << " queries have fewer than topK "
+			<< params.top_k << " predictions with beam size " << params.beam_size
+			<< ", the missing ones count as wrong" << std::endl;
+	}
+}
 
-	// Verify that we have both a napkin and pecos model
-	auto pecos_path = path / "model";
-	auto napkin_path = path / "napkin-model";
+LatencyHistogram MeasurePecosLatency(pecos::HierarchicalMLModel& model,
+	const pecos::csr_t& X, const RunParams& params, const BenchmarkOptions& options) {
 
-	if (!std::filesystem::exists(pecos_path) || !std::filesystem::is_directory(pecos_path)) {
-		std::cout << path << " does not have a PECOS model. Skipping..." << std::endl;
-		return;
+	// Split the queries up front so that copying is not timed
+	std::vector<pecos::csr_t> queries;
+	queries.reserve(X.rows);
+	for (int row = 0; row < X.rows; ++row) {
+		queries.emplace_back(ExtractRow(X, row));
 	}
 
-	if (!std::filesystem::exists(napkin_path) || !std::filesystem::is_directory(napkin_path)) {
-		std::cout << path << " does not have a Napkin-XC model. Skipping..." << std::endl;
-		return;
+	auto run_query = [&](int row) {
+		pecos::csr_t Y_pred;
+		model.predict<pecos::csr_t, pecos::csr_t>(queries[row], Y_pred,
+			params.beam_size, "sigmoid", params.top_k, 1);
+		Y_pred.free_underlying_memory();
+	};
+
+	for (int i = 0; i < options.warmup && X.rows > 0; ++i) {
+		run_query(i % X.rows);
 	}
 
-	pecos::csr_t X;
-	pecos::csr_t Y;
+	LatencyHistogram histogram;
+	for (int row = 0; row < X.rows; ++row) {
+		auto start = std::chrono::steady_clock::now();
+		run_query(row);
+		histogram.Record(ElapsedMs(start));
+	}
 
-	std::vector<std::vector<Prediction>> pecos_predictions;
-	std::vector<std::vector<Prediction>> napkin_predictions;
+	for (auto& query : queries) {
+		query.free_underlying_memory();
+	}
 
-	int top_k = 10;
-	int beam_size = 20; 
+	return histogram;
+}
 
-	{
-		std::cout << "Loading " << path / "X.tst.tfidf.npz" << "..." << std::endl;
-		pecos::ScipyCsrF32Npz X_npz(path / "X.tst.tfidf.npz");
-		std::cout << "Loading " << path / "Y.tst.npz" << "..." << std::endl;
-		pecos::ScipyCsrF32Npz Y_npz(path / "Y.tst.npz");
-		X = pecos::csr_npz_to_csr_t_deep_copy(X_npz);
-		Y = pecos::csr_npz_to_csr_t_deep_copy(Y_npz);
+// Times the single data point beam search on the rows of X_f in place, so neither copying
+// nor the batch setup of predictBatch is part of a query's latency
+LatencyHistogram MeasureNapkinLatency(BatchPLT& model, SRMatrix<Feature>& X_f,
+	Args args, const BenchmarkOptions& options) {
+
+	auto run_query = [&](int row) {
+		std::vector<Prediction> prediction;
+		model.predictWithBeamSearch(prediction, X_f[row], args);
+	};
+
+	for (int i = 0; i < options.warmup && X_f.rows() > 0; ++i) {
+		run_query(i % X_f.rows());
+	}
+
+	LatencyHistogram histogram;
+	for (int row = 0; row < X_f.rows(); ++row) {
+		auto start = std::chrono::steady_clock::now();
+		run_query(row);
+		histogram.Record(ElapsedMs(start));
+	}
+
+	return histogram;
+}
+
+// Latency of one offered rate in open loop mode
+struct LoadPoint {
+	double offered_qps = 0.0;
+	double achieved_qps = 0.0; // Completed queries per second from the first arrival to the last completion
+	int queries = 0;
+	double latency_mean_ms = 0.0; // From the scheduled arrival to completion, includes queue wait
+	double latency_p50_ms = 0.0;
+	double latency_p90_ms = 0.0;
+	double latency_p99_ms = 0.0;
+	double latency_p999_ms = 0.0;
+	double latency_max_ms = 0.0;
+	double queue_wait_mean_ms = 0.0;
+	double queue_wait_p99_ms = 0.0;
+};
+
+// Issues queries at Poisson arrival times onto `workers` threads that call run_query(row).
+// Arrivals do not wait for completions, so queueing shows up in the latency. Latency is taken from the
+// scheduled arrival time rather than the time the query was handed over, so a late generator does not
+// hide delay (coordinated omission).
+template <class QueryFn>
+LoadPoint RunOpenLoop(QueryFn run_query, int rows, double qps, double duration, int workers, uint64_t seed) {
+	typedef std::chrono::steady_clock clock;
+
+	// Arrival offsets are drawn up front so the generator only sleeps and enqueues
+	std::mt19937_64 rng(seed);
+	std::exponential_distribution<double> inter_arrival(qps);
+	std::vector<double> arrivals;
+	for (double t = inter_arrival(rng); t < duration; t += inter_arrival(rng)) {
+		arrivals.push_back(t);
 	}
 
+	struct Arrival {
+		int row;
+		clock::time_point scheduled;
+	};
+	std::deque<Arrival> queue;
+	std::mutex mutex;
+	std::condition_variable ready;
+	bool closed = false;
+
+	std::vector<LatencyHistogram> latencies(workers);
+	std::vector<LatencyHistogram> waits(workers);
+	std::vector<clock::time_point> last_completion(workers);
+
+	auto worker = [&](int id) {
+		while (true) {
+			Arrival arrival;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [&] { return closed || !queue.empty(); });
+				if (queue.empty()) {
+					return;
+				}
+				arrival = queue.front();
+				queue.pop_front();
+			}
+			auto start = clock::now();
+			run_query(arrival.row);
+			auto end = clock::now();
+			waits[id].Record(std::chrono::duration<double, std::milli>(start - arrival.scheduled).count());
+			latencies[id].Record(std::chrono::duration<double, std::milli>(end - arrival.scheduled).count());
+			last_completion[id] = end;
+		}
+	};
+
+	auto begin = clock::now();
+	std::vector<std::thread> pool;
+	for (int i = 0; i < workers; ++i) {
+		last_completion[i] = begin;
+		pool.emplace_back(worker, i);
+	}
+
+	for (size_t i = 0; i < arrivals.size(); ++i) {
+		auto scheduled = begin + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(arrivals[i]));
+		std::this_thread::sleep_until(scheduled);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queue.push_back({static_cast<int>(i % rows), scheduled});
+		}
+		ready.notify_one();
+	}
 	{
-		std::cout << "Loading PECOS model " << pecos_path << "..." << std::endl;
-		pecos::HierarchicalMLModel model(pecos_path, pecos::LAYER_TYPE_HASH_CHUNKED);
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+	}
+	ready.notify_all();
+	for (auto& thread : pool) {
+		thread.join();
+	}
 
-		std::cout << "Running PECOS Prediction..." << std::endl;
-		pecos::csr_t Y_pred;
+	LatencyHistogram latency;
+	LatencyHistogram wait;
+	auto end = begin;
+	for (int i = 0; i < workers; ++i) {
+		latency.Merge(latencies[i]);
+		wait.Merge(waits[i]);
+		end = std::max(end, last_completion[i]);
+	}
+
+	LoadPoint point;
+	point.offered_qps = qps;
+	point.queries = arrivals.size();
+	double elapsed = std::chrono::duration<double>(end - begin).count();
+	point.achieved_qps = elapsed > 0.0 ? point.queries / elapsed : 0.0;
+	point.latency_mean_ms = latency.Mean();
+	point.latency_p50_ms = latency.Percentile(50.0);
+	point.latency_p90_ms = latency.Percentile(90.0);
+	point.latency_p99_ms = latency.Percentile(99.0);
+	point.latency_p999_ms = latency.Percentile(99.9);
+	point.latency_max_ms = latency.Max();
+	point.queue_wait_mean_ms = wait.Mean();
+	point.queue_wait_p99_ms = wait.Percentile(99.0);
+	return point;
+}
+
+// Runs the warmup queries on this thread and returns the queries per second `workers` threads
+// could sustain at that mean service time
+template <class QueryFn>
+double EstimateCapacity(QueryFn run_query, int rows, int workers, const BenchmarkOptions& options) {
+	int warmup = std::max(options.warmup, 10);
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < warmup; ++i) {
+		run_query(i % rows);
+	}
+	double service_ms = ElapsedMs(start) / warmup;
+	return service_ms > 0.0 ? workers * 1000.0 / service_ms : 0.0;
+}
+
+// Sweeps the offered rate over options.load_qps, or over fractions of the estimated capacity
+template <class QueryFn>
+std::vector<LoadPoint> SweepOpenLoop(QueryFn run_query, int rows, int workers, const BenchmarkOptions& options) {
+	std::vector<LoadPoint> points;
+	if (rows == 0) {
+		return points;
+	}
+
+	double capacity = EstimateCapacity(run_query, rows, workers, options);
+	auto rates = options.load_qps;
+	if (rates.empty()) {
+		for (double fraction : {0.1, 0.3, 0.5, 0.7, 0.8, 0.9, 1.0, 1.2}) {
+			rates.push_back(fraction * capacity);
+		}
+	}
 
-		std::clock_t c_start = std::clock();
-		model.predict<pecos::csr_t, pecos::csr_t>(X, Y_pred, beam_size, "sigmoid", top_k, 1);
-		std::clock_t c_end = std::clock();
+	for (size_t i = 0; i < rates.size(); ++i) {
+		if (rates[i] <= 0.0) {
+			continue;
+		}
+		points.emplace_back(RunOpenLoop(run_query, rows, rates[i], options.load_duration, workers,
+			options.load_seed + i));
+	}
+	return points;
+}
 
-		long double time_elapsed_ms = 1000.0 * (c_end-c_start) / CLOCKS_PER_SEC;
-		std::cout << "CPU time per query: " << time_elapsed_ms / (double)X.rows << " ms\n";
+std::vector<LoadPoint> MeasurePecosLoad(pecos::HierarchicalMLModel& model,
+	const pecos::csr_t& X, const RunParams& params, const BenchmarkOptions& options) {
 
-		pecos_predictions = PecosPredictionToNapkinXC(Y_pred);
+	std::vector<pecos::csr_t> queries;
+	queries.reserve(X.rows);
+	for (int row = 0; row < X.rows; ++row) {
+		queries.emplace_back(ExtractRow(X, row));
+	}
+
+	auto run_query = [&](int row) {
+		pecos::csr_t Y_pred;
+		model.predict<pecos::csr_t, pecos::csr_t>(queries[row], Y_pred,
+			params.beam_size, "sigmoid", params.top_k, 1);
 		Y_pred.free_underlying_memory();
+	};
+	auto points = SweepOpenLoop(run_query, X.rows, params.threads, options);
+
+	for (auto& query : queries) {
+		query.free_underlying_memory();
+	}
+	return points;
+}
+
+// Batch beam search converts bases between representations in place, so workers use the
+// single data point beam search, which leaves the model untouched
+std::vector<LoadPoint> MeasureNapkinLoad(BatchPLT& model, SRMatrix<Feature>& X_f,
+	Args args, const RunParams& params, const BenchmarkOptions& options) {
+	args.topK = params.top_k;
+	args.beamSearchWidth = params.beam_size;
+
+	auto run_query = [&](int row) {
+		std::vector<Prediction> prediction;
+		model.predictWithBeamSearch(prediction, X_f[row], args);
+	};
+	return SweepOpenLoop(run_query, X_f.rows(), params.threads, options);
+}
+
+// The highest offered rate that is still served: p99 within knee_factor of the lowest rate's p99
+// and at least 95% of the offered rate achieved. Single noisy rates below it are ignored.
+// Returns -1 if no rate qualifies.
+int FindKnee(const std::vector<LoadPoint>& points, double knee_factor) {
+	int knee = -1;
+	if (points.empty()) {
+		return knee;
+	}
+	double base_p99 = points.front().latency_p99_ms;
+	for (size_t i = 0; i < points.size(); ++i) {
+		if (points[i].latency_p99_ms <= knee_factor * base_p99 &&
+			points[i].achieved_qps >= 0.95 * points[i].offered_qps) {
+			knee = i;
+		}
+	}
+	return knee;
+}
+
+// Timings and accuracy of one engine on one cell of the benchmark grid
+struct RunResult {
+	std::string dataset;
+	std::string engine;
+	std::string layer_type; // "-" for NapkinXC
+	RunParams params;
+	int queries = 0;
+	double wall_time_ms = 0.0;
+	double cpu_time_ms = 0.0;
+	double throughput = 0.0; // Queries per second of wall clock time
+	bool has_latency = false;
+	double latency_mean_ms = 0.0;
+	double latency_p50_ms = 0.0;
+	double latency_p90_ms = 0.0;
+	double latency_p99_ms = 0.0;
+	double latency_p999_ms = 0.0;
+	double latency_max_ms = 0.0;
+	double rss_mb = 0.0; // Resident memory of the process after the run
+	double peak_rss_mb = 0.0; // Peak during the run where the peak can be reset, otherwise since start
+	std::vector<double> precision;
+	std::vector<double> recall;
+	nlohmann::json counters; // Per layer breakdown, see LayerCountersToJson, null if not collected
+	nlohmann::json memory; // Model structures and load RSS of the layout, see ModelMemoryToJson
+	std::vector<LoadPoint> load; // Open loop sweep, empty if not run
+	int load_knee = -1; // Index of the knee in load, see FindKnee
+	nlohmann::json matcher; // Beam recall of the HNSW matcher against the exact top layers, null without one
+
+	// Runs with equal keys are compared against each other in compare mode
+	std::string Key() const {
+		return dataset + "/" + engine + "/" + layer_type +
+			"/threads=" + std::to_string(params.threads) +
+			"/beam=" + std::to_string(params.beam_size) +
+			"/topK=" + std::to_string(params.top_k);
+	}
+
+	void SetLatency(LatencyHistogram& histogram) {
+		has_latency = true;
+		latency_mean_ms = histogram.Mean();
+		latency_p50_ms = histogram.Percentile(50.0);
+		latency_p90_ms = histogram.Percentile(90.0);
+		latency_p99_ms = histogram.Percentile(99.0);
+		latency_p999_ms = histogram.Percentile(99.9);
+		latency_max_ms = histogram.Max();
+	}
+};
+
+// Per query values of every layer in one layout for both engines:
+// {"available", "wall_time_ms_per_query", "counters_per_query", "layers": [{"layer", "wall_time_ms_per_query", "counters_per_query"}]}
+// The totals are sums over the layers, which leaves out the work counting done between them.
+nlohmann::json LayerCountersToJson(const pecos::prediction_instrumentation_t& instrumentation, bool available) {
+	nlohmann::json layers = nlohmann::json::array();
+	double wall_time_ms = 0.0;
+	pecos::perf_counter_values_t total;
+	for (size_t i = 0; i < instrumentation.layers.size(); ++i) {
+		auto& layer = instrumentation.layers[i];
+		double queries = std::max<double>(layer.queries, 1.0);
+		layers.push_back({
+			{"layer", i},
+			{"wall_time_ms_per_query", layer.wall_time_ms / queries},
+			{"counters_per_query", layer.counters.to_json(queries)}
+		});
+		wall_time_ms += layer.wall_time_ms;
+		total += layer.counters;
+	}
+	double queries = std::max<double>(instrumentation.queries, 1.0);
+	return {
+		{"available", available},
+		{"wall_time_ms_per_query", wall_time_ms / queries},
+		{"counters_per_query", total.to_json(queries)},
+		{"layers", layers}
+	};
+}
+
+nlohmann::json LayerCountersToJson(const std::vector<PLTLevelStats>& levels, bool available) {
+	nlohmann::json layers = nlohmann::json::array();
+	double wall_time_ms = 0.0;
+	unsigned long long rows = 0;
+	PerfCounterValues total;
+	for (auto& level : levels) {
+		double level_rows = std::max<double>(level.rows, 1.0);
+		layers.push_back({
+			{"layer", level.level},
+			{"wall_time_ms_per_query", level.wallTimeMs / level_rows},
+			{"counters_per_query", level.counters.to_json(level_rows)}
+		});
+		wall_time_ms += level.wallTimeMs;
+		rows = std::max(rows, level.rows);
+		total += level.counters;
+	}
+	double queries = std::max<double>(rows, 1.0);
+	return {
+		{"available", available},
+		{"wall_time_ms_per_query", wall_time_ms / queries},
+		{"counters_per_query", total.to_json(queries)},
+		{"layers", layers}
+	};
+}
 
+void PrintLayerCounters(const nlohmann::json& counters) {
+	static const std::vector<std::pair<const char*, const char*>> columns = {
+		{"cycles", "cycles"}, {"instructions", "instr"}, {"ipc", "IPC"}, {"l1d_misses", "L1D miss"},
+		{"llc_misses", "LLC miss"}, {"branch_misses", "br miss"}, {"dtlb_misses", "dTLB miss"}
+	};
+
+	if (!counters.at("available")) {
+		std::cout << "Hardware counters are unavailable (perf_event_open failed), showing timings only" << std::endl;
+	}
+	std::cout << std::setw(8) << "layer" << std::setw(12) << "us/query";
+	for (auto& column : columns) {
+		std::cout << std::setw(12) << column.second;
+	}
+	std::cout << std::endl;
+
+	auto print_row = [&](const std::string& name, const nlohmann::json& row) {
+		std::cout << std::setw(8) << name
+			<< std::setw(12) << 1000.0 * row.at("wall_time_ms_per_query").get<double>();
+		auto& values = row.at("counters_per_query");
+		for (auto& column : columns) {
+			if (values.contains(column.first)) {
+				std::cout << std::setw(12) << values[column.first].get<double>();
+			} else {
+				std::cout << std::setw(12) << "-";
+			}
+		}
 		std::cout << std::endl;
+	};
+	for (auto& layer : counters.at("layers")) {
+		print_row(std::to_string(layer.at("layer").get<int>()), layer);
 	}
+	print_row("total", counters);
+}
 
-	{
-		std::cout << "Loading NapkinXC model " << napkin_path << "..." << std::endl;
-		auto current_dir = std::filesystem::current_path();
+void SetTimings(RunResult& result, int queries,
+	std::chrono::steady_clock::time_point wall_start, std::clock_t cpu_start) {
+	result.queries = queries;
+	result.wall_time_ms = ElapsedMs(wall_start);
+	result.cpu_time_ms = 1000.0 * (std::clock() - cpu_start) / CLOCKS_PER_SEC;
+	result.throughput = result.wall_time_ms > 0.0 ? 1000.0 * queries / result.wall_time_ms : 0.0;
 
-		std::filesystem::current_path(napkin_path);
+	auto resources = getResources();
+	result.rss_mb = resources.currentRealMem / 1024.0;
+	result.peak_rss_mb = resources.peakRealMem / 1024.0;
+}
 
-		Args args;
-		args.loadFromFile("args.bin");
+const double kBytesPerMb = 1024.0 * 1024.0;
 
-		BatchPLT model_;
-		model_.load(args, args.output);
+// Resident memory around loading one model
+struct LoadMemory {
+	double rss_before_mb = 0.0;
+	double rss_after_mb = 0.0;
+	double peak_rss_mb = 0.0; // Peak while loading, or since start if the peak cannot be reset
+};
 
-		SRMatrix<Feature> X_f = PecosToNapkinXC(X, 1.0);
+LoadMemory StartLoadMemory() {
+	LoadMemory memory;
+	resetPeakRealMem();
+	memory.rss_before_mb = getResources().currentRealMem / 1024.0;
+	return memory;
+}
 
-		std::cout << "Running NapkinXC Prediction..." << std::endl;
+void FinishLoadMemory(LoadMemory& memory) {
+	auto resources = getResources();
+	memory.rss_after_mb = resources.currentRealMem / 1024.0;
+	memory.peak_rss_mb = resources.peakRealMem / 1024.0;
+}
 
-		args.topK = top_k;
-		args.beamSearchWidth = beam_size;
-		args.threads = 1;
-		args.treeSearchType = TreeSearchType::beam;
+nlohmann::json ModelMemoryToJson(const std::vector<pecos::layer_memory_t>& layers, const LoadMemory& load) {
+	nlohmann::json j_layers = nlohmann::json::array();
+	pecos::layer_memory_t total;
+	for (auto& layer : layers) {
+		j_layers.push_back(layer.to_json());
+		total += layer;
+	}
+	return {
+		{"model_bytes", total.total()},
+		{"structures", total.to_json()},
+		{"layers", j_layers},
+		{"rss_before_load_mb", load.rss_before_mb},
+		{"rss_after_load_mb", load.rss_after_mb},
+		{"peak_rss_load_mb", load.peak_rss_mb}
+	};
+}
 
-		std::clock_t c_start = std::clock();
-		napkin_predictions = model_.predictBatch(X_f, args);
-		std::clock_t c_end = std::clock();
+nlohmann::json ModelMemoryToJson(const PLTMemoryUsage& usage, const LoadMemory& load) {
+	return {
+		{"model_bytes", usage.total()},
+		{"structures", nlohmann::json::parse(usage.toJson())},
+		{"rss_before_load_mb", load.rss_before_mb},
+		{"rss_after_load_mb", load.rss_after_mb},
+		{"peak_rss_load_mb", load.peak_rss_mb}
+	};
+}
 
-		for (auto& pred : napkin_predictions) {
-			pred.resize(std::min<int>(pred.size(), args.topK));
-		}
+void PrintLoadMemory(const nlohmann::json& memory) {
+	double before = memory.at("rss_before_load_mb");
+	double after = memory.at("rss_after_load_mb");
+	std::cout << "Model structures: " << memory.at("model_bytes").get<uint64_t>() / kBytesPerMb << " MB"
+		<< ", RSS before load: " << before << " MB"
+		<< ", after load: " << after << " MB (+" << after - before << " MB)"
+		<< ", peak during load: " << memory.at("peak_rss_load_mb").get<double>() << " MB" << std::endl;
+}
 
-		long double time_elapsed_ms = 1000.0 * (c_end-c_start) / CLOCKS_PER_SEC;
-		std::cout << "CPU time per query: " << time_elapsed_ms  / (double)X.rows << " ms\n";
+void PrintPecosMemory(const std::vector<pecos::layer_memory_t>& layers, const nlohmann::json& memory) {
+	static const std::vector<std::string> columns = {
+		"chunk_entries", "chunk_headers", "row_hash", "row_idx", "row_ptr", "values", "codes", "permutation", "total"
+	};
 
-		std::filesystem::current_path(current_dir);
+	auto flags = std::cout.flags();
+	auto precision = std::cout.precision();
+	std::cout << std::fixed << std::setprecision(3);
+
+	std::cout << "Memory per layer (MB):" << std::endl;
+	std::cout << std::setw(8) << "layer";
+	for (auto& column : columns) {
+		std::cout << std::setw(15) << column;
+	}
+	std::cout << std::endl;
 
+	auto print_row = [&](const std::string& name, const nlohmann::json& row) {
+		std::cout << std::setw(8) << name;
+		for (auto& column : columns) {
+			std::cout << std::setw(15) << row.at(column).get<uint64_t>() / kBytesPerMb;
+		}
 		std::cout << std::endl;
+	};
+	for (size_t i = 0; i < layers.size(); ++i) {
+		print_row(std::to_string(i), layers[i].to_json());
 	}
+	print_row("total", memory.at("structures"));
+	PrintLoadMemory(memory);
+	std::cout << std::endl;
 
-	std::vector<double> pecos_recall;
-	std::vector<double> pecos_precision;
+	std::cout.flags(flags);
+	std::cout.precision(precision);
+}
 
-	std::vector<double> napkin_recall;
-	std::vector<double> napkin_precision;
+void PrintNapkinMemory(const PLTMemoryUsage& usage, const nlohmann::json& memory) {
+	auto flags = std::cout.flags();
+	auto precision = std::cout.precision();
+	std::cout << std::fixed << std::setprecision(3);
+
+	std::cout << "Memory per tree level (MB):" << std::endl;
+	std::cout << std::setw(8) << "level" << std::setw(10) << "nodes" << std::setw(15) << "tree_nodes"
+		<< std::setw(15) << "bases" << std::setw(15) << "node_vectors" << std::setw(15) << "total" << std::endl;
+	for (auto& level : usage.levels) {
+		std::cout << std::setw(8) << level.level << std::setw(10) << level.nodes
+			<< std::setw(15) << level.treeNodes / kBytesPerMb << std::setw(15) << level.bases / kBytesPerMb
+			<< std::setw(15) << level.nodeVectors / kBytesPerMb << std::setw(15) << level.total() / kBytesPerMb << std::endl;
+	}
+	std::cout << "Tree index: " << usage.treeIndex / kBytesPerMb << " MB";
+	if (usage.lazyBases > 0) {
+		std::cout << ", lazily loaded bases: " << usage.lazyBases / kBytesPerMb << " MB";
+	}
+	std::cout << std::endl;
+	PrintLoadMemory(memory);
+	std::cout << std::endl;
 
-	auto truth = PecosPredictionToNapkinXC(Y);
+	std::cout.flags(flags);
+	std::cout.precision(precision);
+}
 
-	ComputeRecallPrecision(truth, pecos_predictions, top_k, pecos_recall, pecos_precision);
-	ComputeRecallPrecision(truth, napkin_predictions, top_k, napkin_recall, napkin_precision);
+// PECOS batch prediction has no threading of its own, so the queries are split
+// into contiguous blocks that are predicted concurrently on the shared model.
+RunResult RunPecos(pecos::HierarchicalMLModel& model, const pecos::csr_t& X,
+	const std::vector<std::vector<Prediction>>& truth,
+	const RunParams& params, const BenchmarkOptions& options) {
 
-	auto printPrecisionRecall = [top_k](const std::string& header, 
-		const std::vector<double>& precision,
-		const std::vector<double>& recall) {
-		std::cout << "=========== " << header << " =============" << std::endl;
-		std::cout << std::setw(10) << "prec@k";
-		for (int i = 0; i < top_k; ++i) {
-			std::cout << std::setw(10) << precision[i];
+	RunResult result;
+	result.engine = model.get_matcher() ? "PECOS+HNSW" : "PECOS";
+	result.layer_type = LayerTypeName(params.layer_type);
+	result.params = params;
+
+	auto blocks = SplitRows(X, params.threads);
+	std::vector<pecos::csr_t> block_predictions(blocks.size());
+
+	auto predict_block = [&](size_t i) {
+		model.predict<pecos::csr_t, pecos::csr_t>(blocks[i], block_predictions[i],
+			params.beam_size, "sigmoid", params.top_k, 1);
+	};
+
+	// Instrumentation is not thread safe and the counters follow the calling thread,
+	// so they only cover runs predicting on this thread. Their cost is outside the timed regions.
+	bool collect_counters = options.counters && blocks.size() == 1;
+	bool counters_available = false;
+	if (collect_counters) {
+		counters_available = model.enable_hardware_counters();
+		model.reset_instrumentation();
+	}
+
+	resetPeakRealMem();
+	auto wall_start = std::chrono::steady_clock::now();
+	std::clock_t cpu_start = std::clock();
+	if (blocks.size() == 1) {
+		predict_block(0);
+	} else {
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i < blocks.size(); ++i) {
+			workers.emplace_back(predict_block, i);
 		}
-		std::cout << std::endl;
-		std::cout << std::setw(10) << "recall@k";
-		for (int i = 0; i < top_k; ++i) {
-			std::cout << std::setw(10) << recall[i];
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+	SetTimings(result, X.rows, wall_start, cpu_start);
+
+	if (collect_counters) {
+		result.counters = LayerCountersToJson(model.get_instrumentation(), counters_available);
+		model.enable_instrumentation(false);
+	}
+
+	std::vector<std::vector<Prediction>> predictions;
+	predictions.reserve(X.rows);
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		for (auto& row : PecosPredictionToNapkinXC(block_predictions[i])) {
+			predictions.emplace_back(std::move(row));
+		}
+		block_predictions[i].free_underlying_memory();
+		blocks[i].free_underlying_memory();
+	}
+
+	int short_rows = ComputeRecallPrecision(truth, predictions, params.top_k, result.recall, result.precision);
+	WarnShortPredictions(short_rows, X.rows, params);
+
+	if (model.get_matcher()) {
+		result.matcher = model.evaluate_matcher(X, params.beam_size, "sigmoid", params.threads).to_json();
+	}
+
+	if (options.latency) {
+		auto histogram = MeasurePecosLatency(model, X, params, options);
+		result.SetLatency(histogram);
+	}
+
+	if (options.load) {
+		result.load = MeasurePecosLoad(model, X, params, options);
+		result.load_knee = FindKnee(result.load, options.knee_factor);
+	}
+
+	return result;
+}
+
+// NapkinXC beam search has no threading of its own, args.threads only applies to its exact search.
+// As for PECOS the queries are split into contiguous blocks, each predicted by its own thread with
+// the single data point beam search; the batch version converts bases in place and is not thread safe.
+RunResult RunNapkin(BatchPLT& model, SRMatrix<Feature>& X_f, Args args,
+	const std::vector<std::vector<Prediction>>& truth,
+	const RunParams& params, const BenchmarkOptions& options) {
+
+	RunResult result;
+	result.engine = "NapkinXC";
+	result.layer_type = "-";
+	result.params = params;
+
+	args.topK = params.top_k;
+	args.beamSearchWidth = params.beam_size;
+	args.threads = 1;
+	args.treeSearchType = TreeSearchType::beam;
+
+	int rows = X_f.rows();
+	int parts = std::max(1, std::min<int>(params.threads, rows));
+	int block_rows = (rows + parts - 1) / parts;
+	std::vector<std::vector<Prediction>> predictions(rows);
+
+	auto predict_block = [&](int begin) {
+		int end = std::min(begin + block_rows, rows);
+		for (int row = begin; row < end; ++row) {
+			model.predictWithBeamSearch(predictions[row], X_f[row], args);
+		}
+	};
+
+	resetPeakRealMem();
+	auto wall_start = std::chrono::steady_clock::now();
+	std::clock_t cpu_start = std::clock();
+	if (parts == 1) {
+		predict_block(0);
+	} else {
+		std::vector<std::thread> workers;
+		for (int begin = 0; begin < rows; begin += block_rows) {
+			workers.emplace_back(predict_block, begin);
+		}
+		for (auto& worker : workers) {
+			worker.join();
+		}
+	}
+	SetTimings(result, rows, wall_start, cpu_start);
+
+	// Level statistics are only kept by the batch beam search, which is run once more
+	// on this thread for them, outside the timed region
+	if (options.counters && parts == 1) {
+		bool counters_available = model.enableLevelCounters();
+		model.predictBatch(X_f, args);
+		result.counters = LayerCountersToJson(model.getLevelStats(), counters_available);
+		model.enableLevelCounters(false);
+		model.enableLevelStats(false);
+	}
+
+	for (auto& pred : predictions) {
+		pred.resize(std::min<int>(pred.size(), args.topK));
+	}
+
+	int short_rows = ComputeRecallPrecision(truth, predictions, params.top_k, result.recall, result.precision);
+	WarnShortPredictions(short_rows, rows, params);
+
+	if (options.latency) {
+		auto histogram = MeasureNapkinLatency(model, X_f, args, options);
+		result.SetLatency(histogram);
+	}
+
+	if (options.load) {
+		result.load = MeasureNapkinLoad(model, X_f, args, params, options);
+		result.load_knee = FindKnee(result.load, options.knee_factor);
+	}
+
+	return result;
+}
+
+void PrintLoadPoints(const RunResult& result) {
+	std::cout << "Open loop, " << result.params.threads << " workers (latency from scheduled arrival, ms):" << std::endl;
+	std::cout << std::setw(12) << "offered/s" << std::setw(12) << "achieved/s" << std::setw(9) << "queries"
+		<< std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p90"
+		<< std::setw(10) << "p99" << std::setw(10) << "p99.9" << std::setw(10) << "max"
+		<< std::setw(12) << "wait mean" << std::setw(10) << "wait p99" << std::endl;
+	for (size_t i = 0; i < result.load.size(); ++i) {
+		auto& point = result.load[i];
+		std::cout << std::setw(12) << point.offered_qps << std::setw(12) << point.achieved_qps
+			<< std::setw(9) << point.queries
+			<< std::setw(10) << point.latency_mean_ms << std::setw(10) << point.latency_p50_ms
+			<< std::setw(10) << point.latency_p90_ms << std::setw(10) << point.latency_p99_ms
+			<< std::setw(10) << point.latency_p999_ms << std::setw(10) << point.latency_max_ms
+			<< std::setw(12) << point.queue_wait_mean_ms << std::setw(10) << point.queue_wait_p99_ms
+			<< (static_cast<int>(i) == result.load_knee ? "  <- knee" : "") << std::endl;
+	}
+	if (result.load_knee < 0) {
+		std::cout << "No rate was served within the knee criteria, lower --qps" << std::endl;
+	}
+}
+
+void PrintRunResult(const RunResult& result) {
+	std::cout << "=========== " << result.engine
+		<< " (layer " << result.layer_type
+		<< ", threads " << result.params.threads
+		<< ", beam " << result.params.beam_size
+		<< ", topK " << result.params.top_k << ") =============" << std::endl;
+	std::cout << "Wall time per query: " << result.wall_time_ms / result.queries << " ms, "
+		<< "CPU time per query: " << result.cpu_time_ms / result.queries << " ms, "
+		<< "throughput: " << result.throughput << " queries/s" << std::endl;
+	std::cout << std::setw(10) << "prec@k";
+	for (auto p : result.precision) {
+		std::cout << std::setw(10) << p;
+	}
+	std::cout << std::endl;
+	std::cout << std::setw(10) << "recall@k";
+	for (auto r : result.recall) {
+		std::cout << std::setw(10) << r;
+	}
+	std::cout << std::endl;
+	if (result.has_latency) {
+		std::cout << "Latency (ms): mean " << result.latency_mean_ms
+			<< ", p50 " << result.latency_p50_ms
+			<< ", p90 " << result.latency_p90_ms
+			<< ", p99 " << result.latency_p99_ms
+			<< ", p99.9 " << result.latency_p999_ms
+			<< ", max " << result.latency_max_ms << std::endl;
+	}
+	if (!result.matcher.is_null()) {
+		std::cout << "Matcher over " << result.matcher.at("depth") << " layer(s): recall@beam "
+			<< result.matcher.at("recall").get<double>() << " against the exact layers, "
+			<< result.matcher.at("matcher_wall_ms").get<double>() << " ms vs "
+			<< result.matcher.at("exact_wall_ms").get<double>() << " ms" << std::endl;
+	}
+	if (!result.counters.is_null()) {
+		PrintLayerCounters(result.counters);
+	}
+	if (!result.load.empty()) {
+		PrintLoadPoints(result);
+	}
+	std::cout << std::endl;
+}
+
+// Summary of the grid. Speedup is relative to the same engine, layer, beam and topK
+// at the first thread count of the sweep.
+void PrintResultsTable(const std::vector<RunResult>& results) {
+	std::cout << std::setw(10) << "engine" << std::setw(11) << "layer"
+		<< std::setw(9) << "threads" << std::setw(6) << "beam" << std::setw(6) << "topK"
+		<< std::setw(12) << "queries/s" << std::setw(9) << "speedup"
+		<< std::setw(11) << "p99 ms" << std::setw(10) << "P@1"
+		<< std::setw(10) << "P@topK" << std::setw(10) << "R@topK" << std::endl;
+
+	for (auto& result : results) {
+		double speedup = 0.0;
+		for (auto& base : results) {
+			if (base.engine == result.engine && base.layer_type == result.layer_type &&
+				base.params.beam_size == result.params.beam_size &&
+				base.params.top_k == result.params.top_k && base.throughput > 0.0) {
+				speedup = result.throughput / base.throughput;
+				break;
+			}
+		}
+
+		std::cout << std::setw(10) << result.engine << std::setw(11) << result.layer_type
+			<< std::setw(9) << result.params.threads << std::setw(6) << result.params.beam_size
+			<< std::setw(6) << result.params.top_k
+			<< std::setw(12) << result.throughput << std::setw(9) << speedup;
+		if (result.has_latency) {
+			std::cout << std::setw(11) << result.latency_p99_ms;
+		} else {
+			std::cout << std::setw(11) << "-";
 		}
-		std::cout << std::endl << std::endl;
+		std::cout << std::setw(10) << (result.precision.empty() ? 0.0 : result.precision.front())
+			<< std::setw(10) << (result.precision.empty() ? 0.0 : result.precision.back())
+			<< std::setw(10) << (result.recall.empty() ? 0.0 : result.recall.back()) << std::endl;
+	}
+	std::cout << std::endl;
+}
+
+nlohmann::json RunResultToJson(const RunResult& result) {
+	nlohmann::json j = {
+		{"dataset", result.dataset},
+		{"engine", result.engine},
+		{"layer_type", result.layer_type},
+		{"threads", result.params.threads},
+		{"beam_size", result.params.beam_size},
+		{"top_k", result.params.top_k},
+		{"queries", result.queries},
+		{"wall_time_ms", result.wall_time_ms},
+		{"cpu_time_ms", result.cpu_time_ms},
+		{"throughput_qps", result.throughput},
+		{"rss_mb", result.rss_mb},
+		{"peak_rss_mb", result.peak_rss_mb},
+		{"precision", result.precision},
+		{"recall", result.recall}
 	};
+	if (result.has_latency) {
+		j["latency_ms"] = {
+			{"mean", result.latency_mean_ms},
+			{"p50", result.latency_p50_ms},
+			{"p90", result.latency_p90_ms},
+			{"p99", result.latency_p99_ms},
+			{"p99.9", result.latency_p999_ms},
+			{"max", result.latency_max_ms}
+		};
+	}
+	if (!result.counters.is_null()) {
+		j["counters"] = result.counters;
+	}
+	if (!result.memory.is_null()) {
+		j["memory"] = result.memory;
+	}
+	if (!result.matcher.is_null()) {
+		j["matcher"] = result.matcher;
+	}
+	if (!result.load.empty()) {
+		nlohmann::json points = nlohmann::json::array();
+		for (auto& point : result.load) {
+			points.push_back({
+				{"offered_qps", point.offered_qps},
+				{"achieved_qps", point.achieved_qps},
+				{"queries", point.queries},
+				{"latency_ms", {
+					{"mean", point.latency_mean_ms},
+					{"p50", point.latency_p50_ms},
+					{"p90", point.latency_p90_ms},
+					{"p99", point.latency_p99_ms},
+					{"p99.9", point.latency_p999_ms},
+					{"max", point.latency_max_ms}
+				}},
+				{"queue_wait_ms", {
+					{"mean", point.queue_wait_mean_ms},
+					{"p99", point.queue_wait_p99_ms}
+				}}
+			});
+		}
+		j["load"] = {
+			{"points", points},
+			{"knee_qps", result.load_knee >= 0 ? result.load[result.load_knee].offered_qps : 0.0}
+		};
+	}
+	return j;
+}
 
-	printPrecisionRecall("PECOS", pecos_precision, pecos_recall);
-	printPrecisionRecall("NapkinXC", napkin_precision, napkin_recall);
+RunResult RunResultFromJson(const nlohmann::json& j) {
+	RunResult result;
+	result.dataset = j.at("dataset");
+	result.engine = j.at("engine");
+	result.layer_type = j.at("layer_type");
+	result.params.threads = j.at("threads");
+	result.params.beam_size = j.at("beam_size");
+	result.params.top_k = j.at("top_k");
+	result.queries = j.at("queries");
+	result.wall_time_ms = j.at("wall_time_ms");
+	result.cpu_time_ms = j.at("cpu_time_ms");
+	result.throughput = j.at("throughput_qps");
+	result.rss_mb = j.value("rss_mb", 0.0);
+	result.peak_rss_mb = j.value("peak_rss_mb", 0.0);
+	result.precision = j.value("precision", std::vector<double>());
+	result.recall = j.value("recall", std::vector<double>());
+	if (j.contains("latency_ms")) {
+		auto& latency = j["latency_ms"];
+		result.has_latency = true;
+		result.latency_mean_ms = latency.at("mean");
+		result.latency_p50_ms = latency.at("p50");
+		result.latency_p90_ms = latency.at("p90");
+		result.latency_p99_ms = latency.at("p99");
+		result.latency_p999_ms = latency.at("p99.9");
+		result.latency_max_ms = latency.at("max");
+	}
+	if (j.contains("counters")) {
+		result.counters = j["counters"];
+	}
+	if (j.contains("memory")) {
+		result.memory = j["memory"];
+	}
+	if (j.contains("matcher")) {
+		result.matcher = j["matcher"];
+	}
+	if (j.contains("load")) {
+		double knee_qps = j["load"].value("knee_qps", 0.0);
+		for (auto& p : j["load"].at("points")) {
+			LoadPoint point;
+			point.offered_qps = p.at("offered_qps");
+			point.achieved_qps = p.at("achieved_qps");
+			point.queries = p.at("queries");
+			auto& latency = p.at("latency_ms");
+			point.latency_mean_ms = latency.at("mean");
+			point.latency_p50_ms = latency.at("p50");
+			point.latency_p90_ms = latency.at("p90");
+			point.latency_p99_ms = latency.at("p99");
+			point.latency_p999_ms = latency.at("p99.9");
+			point.latency_max_ms = latency.at("max");
+			point.queue_wait_mean_ms = p.at("queue_wait_ms").at("mean");
+			point.queue_wait_p99_ms = p.at("queue_wait_ms").at("p99");
+			if (point.offered_qps == knee_qps) {
+				result.load_knee = result.load.size();
+			}
+			result.load.push_back(point);
+		}
+	}
+	return result;
+}
 
-	X.free_underlying_memory();
-	Y.free_underlying_memory();
+void WriteJson(const std::string& path, const std::vector<RunResult>& results) {
+	nlohmann::json runs = nlohmann::json::array();
+	for (auto& result : results) {
+		runs.push_back(RunResultToJson(result));
+	}
+	std::ofstream out(path);
+	if (!out) {
+		throw std::runtime_error("cannot write " + path);
+	}
+	out << nlohmann::json({{"runs", runs}}).dump(4) << std::endl;
+}
+
+std::vector<RunResult> ReadJson(const std::string& path) {
+	std::ifstream in(path);
+	if (!in) {
+		throw std::runtime_error("cannot read " + path);
+	}
+	nlohmann::json j;
+	in >> j;
+
+	std::vector<RunResult> results;
+	for (auto& run : j.at("runs")) {
+		results.emplace_back(RunResultFromJson(run));
+	}
+	return results;
+}
+
+// One row per run, precision and recall are reported at k = 1 and k = topK
+void WriteCsv(const std::string& path, const std::vector<RunResult>& results) {
+	std::ofstream out(path);
+	if (!out) {
+		throw std::runtime_error("cannot write " + path);
+	}
+	out << "dataset,engine,layer_type,threads,beam_size,top_k,queries,wall_time_ms,cpu_time_ms,"
+		<< "throughput_qps,latency_mean_ms,latency_p50_ms,latency_p90_ms,latency_p99_ms,"
+		<< "latency_p999_ms,latency_max_ms,rss_mb,peak_rss_mb,precision_at_1,precision_at_k,"
+		<< "recall_at_1,recall_at_k\n";
+	for (auto& r : results) {
+		out << r.dataset << "," << r.engine << "," << r.layer_type << ","
+			<< r.params.threads << "," << r.params.beam_size << "," << r.params.top_k << ","
+			<< r.queries << "," << r.wall_time_ms << "," << r.cpu_time_ms << "," << r.throughput << ",";
+		if (r.has_latency) {
+			out << r.latency_mean_ms << "," << r.latency_p50_ms << "," << r.latency_p90_ms << ","
+				<< r.latency_p99_ms << "," << r.latency_p999_ms << "," << r.latency_max_ms << ",";
+		} else {
+			out << ",,,,,,";
+		}
+		out << r.rss_mb << "," << r.peak_rss_mb << ","
+			<< (r.precision.empty() ? 0.0 : r.precision.front()) << ","
+			<< (r.precision.empty() ? 0.0 : r.precision.back()) << ","
+			<< (r.recall.empty() ? 0.0 : r.recall.front()) << ","
+			<< (r.recall.empty() ? 0.0 : r.recall.back()) << "\n";
+	}
+}
+
+// Returns the number of runs that regressed past the thresholds of the options.
+// Runs missing from either side are reported but do not count as regressions.
+int CompareWithBaseline(const std::vector<RunResult>& results,
+	const std::vector<RunResult>& baseline, const BenchmarkOptions& options) {
+
+	std::map<std::string, const RunResult*> baseline_runs;
+	for (auto& run : baseline) {
+		baseline_runs[run.Key()] = &run;
+	}
+
+	int regressions = 0;
+	std::cout << "=========== Comparison with " << options.baseline_path << " =============" << std::endl;
+	for (auto& result : results) {
+		auto it = baseline_runs.find(result.Key());
+		if (it == baseline_runs.end()) {
+			std::cout << "NEW         " << result.Key() << std::endl;
+			continue;
+		}
+		auto& base = *it->second;
+
+		double throughput_change = base.throughput > 0.0 ?
+			100.0 * (result.throughput - base.throughput) / base.throughput : 0.0;
+		bool regressed = throughput_change < -options.max_throughput_drop;
+
+		std::ostringstream details;
+		details << "throughput " << std::showpos << throughput_change << "%";
+		if (result.has_latency && base.has_latency && base.latency_p99_ms > 0.0) {
+			double p99_change = 100.0 * (result.latency_p99_ms - base.latency_p99_ms) / base.latency_p99_ms;
+			regressed = regressed || p99_change > options.max_p99_increase;
+			details << ", p99 " << p99_change << "%";
+		}
+
+		regressions += regressed;
+		std::cout << (regressed ? "REGRESSION  " : "OK          ") << result.Key()
+			<< " (" << details.str() << ")" << std::endl;
+		baseline_runs.erase(it);
+	}
+	for (auto& missing : baseline_runs) {
+		std::cout << "MISSING     " << missing.first << std::endl;
+	}
+	std::cout << regressions << " regression(s), thresholds: throughput -" << options.max_throughput_drop
+		<< "%, p99 +" << options.max_p99_increase << "%" << std::endl << std::endl;
+
+	return regressions;
+}
+
+std::vector<RunResult> TestDataSet(const std::filesystem::path& path, const BenchmarkOptions& options) {
+
+	// Verify that we have both a napkin and pecos model
+	auto pecos_path = path / "model";
+	auto napkin_path = path / "napkin-model";
+
+	if (!std::filesystem::exists(pecos_path) || !std::filesystem::is_directory(pecos_path)) {
+		std::cout << path << " does not have a PECOS model. Skipping..." << std::endl;
+		return {};
+	}
+
+	if (!std::filesystem::exists(napkin_path) || !std::filesystem::is_directory(napkin_path)) {
+		std::cout << path << " does not have a Napkin-XC model. Skipping..." << std::endl;
+		return {};
+	}
+
+	// X and Y are views into the mapped npz files, which must outlive them
+	std::cout << "Loading " << path / "X.tst.tfidf.npz" << "..." << std::endl;
+	pecos::ScipyCsrF32Npz X_npz(path / "X.tst.tfidf.npz", true);
+	std::cout << "Loading " << path / "Y.tst.npz" << "..." << std::endl;
+	pecos::ScipyCsrF32Npz Y_npz(path / "Y.tst.npz", true);
+	// scipy's int32 indptr is widened into a copy, anything larger means the arrays were not usable in place
+	for (auto [name, npz] : {std::make_pair("X", &X_npz), std::make_pair("Y", &Y_npz)}) {
+		if (npz->copied_bytes() > 0) {
+			std::cout << name << ": " << npz->copied_bytes() << " bytes copied out of the mapping"
+				<< (npz->is_zero_copy() ? " (indptr only)" : "") << std::endl;
+		}
+	}
+	pecos::csr_t X = pecos::csr_npz_to_csr_t_view(X_npz);
+	pecos::csr_t Y = pecos::csr_npz_to_csr_t_view(Y_npz);
+
+	auto truth = PecosPredictionToNapkinXC(Y);
+	std::vector<RunResult> results;
+
+	int max_threads = *std::max_element(options.threads.begin(), options.threads.end());
+
+	// The matcher reads the weights from the model folder, so one serves every layer type
+	std::shared_ptr<pecos::hnsw_matcher_t> matcher;
+	if (options.matcher_depth > 0) {
+		std::cout << "Building HNSW matcher over the top " << options.matcher_depth << " layer(s)..." << std::endl;
+		auto build_start = std::chrono::steady_clock::now();
+		matcher = std::make_shared<pecos::hnsw_matcher_t>(pecos_path.string(), options.matcher_depth,
+			16, 200, options.matcher_efs, max_threads);
+		std::cout << "Built in " << ElapsedMs(build_start) << " ms" << std::endl;
+	}
+
+	for (auto layer_type : options.layer_types) {
+		std::cout << "Loading PECOS model " << pecos_path << " (layer " << LayerTypeName(layer_type) << ")..." << std::endl;
+		auto load_memory = StartLoadMemory();
+		pecos::HierarchicalMLModel model(pecos_path, layer_type, max_threads);
+		FinishLoadMemory(load_memory);
+
+		auto layers_memory = model.get_memory_usage();
+		auto memory = ModelMemoryToJson(layers_memory, load_memory);
+		PrintPecosMemory(layers_memory, memory);
+
+		for (auto threads : options.threads) {
+			for (auto beam_size : options.beam_sizes) {
+				for (auto top_k : options.top_ks) {
+					RunParams params{layer_type, threads, beam_size, top_k};
+					results.emplace_back(RunPecos(model, X, truth, params, options));
+					results.back().dataset = path.filename().string();
+					results.back().memory = memory;
+					PrintRunResult(results.back());
+
+					if (matcher) {
+						model.set_matcher(matcher);
+						results.emplace_back(RunPecos(model, X, truth, params, options));
+						results.back().dataset = path.filename().string();
+						results.back().memory = memory;
+						PrintRunResult(results.back());
+						model.set_matcher(nullptr);
+					}
+				}
+			}
+		}
+	}
+
+	{
+		std::cout << "Loading NapkinXC model " << napkin_path << "..." << std::endl;
+		auto current_dir = std::filesystem::current_path();
+
+		std::filesystem::current_path(napkin_path);
+
+		Args args;
+		args.loadFromFile("args.bin");
+
+		auto load_memory = StartLoadMemory();
+		BatchPLT model_;
+		model_.load(args, args.output);
+		FinishLoadMemory(load_memory);
+
+		std::filesystem::current_path(current_dir);
+
+		auto usage = model_.getMemoryUsage();
+		auto memory = ModelMemoryToJson(usage, load_memory);
+		PrintNapkinMemory(usage, memory);
+
+		SRMatrix<Feature> X_f = PecosToNapkinXC(X, 1.0);
+
+		for (auto threads : options.threads) {
+			for (auto beam_size : options.beam_sizes) {
+				for (auto top_k : options.top_ks) {
+					RunParams params{options.layer_types.front(), threads, beam_size, top_k};
+					results.emplace_back(RunNapkin(model_, X_f, args, truth, params, options));
+					results.back().dataset = path.filename().string();
+					results.back().memory = memory;
+					PrintRunResult(results.back());
+				}
+			}
+		}
+	}
+
+	PrintResultsTable(results);
+	return results;
+}
+
+void PrintUsage() {
+	std::cout << "Usage: ModelBenchmark [options] [data_dir...]\n"
+		<< "Options taking <list> accept comma separated values, every combination is benchmarked.\n"
+		<< "  --topK <list>       Number of predicted labels (default 10)\n"
+		<< "  --beamSize <list>   Beam size of both engines (default 20)\n"
+		<< "  --threads <list>    Threads used by batch prediction (default 1)\n"
+		<< "  --layerType <list>  PECOS layer types: csc, hash, binsearch (default hash)\n"
+		<< "  --sweep             Use the default sweep grid for every list not given explicitly\n"
+		<< "  --latency           Also time every query on its own and report percentiles\n"
+		<< "  --warmup <int>      Untimed queries before latency measurement (default 100)\n"
+		<< "  --pin <int>         Pin the benchmark to the given CPU, meant for single threaded runs\n"
+		<< "  --counters          Report per layer time and hardware counters per query (perf_event_open),\n"
+		<< "                      only for single threaded runs; counters are skipped when unavailable\n"
+		<< "  --load              Open loop mode: Poisson arrivals at each --qps rate onto a pool of --threads\n"
+		<< "                      workers, latency includes queue wait; reports the knee of the latency curve\n"
+		<< "  --qps <list>        Offered rates of the open loop sweep (default 10% to 120% of estimated capacity)\n"
+		<< "  --loadDuration <s>  Seconds of arrivals per rate (default 2)\n"
+		<< "  --kneeFactor <x>    Knee criterion: p99 within x times the p99 of the lowest rate (default 3)\n"
+		<< "  --hnswMatcher <int> Also run PECOS with its top <int> layers replaced by an HNSW matcher over their\n"
+		<< "                      cluster weights, and report the recall of its beam against the exact layers\n"
+		<< "  --matcherEfS <int>  Candidates of the matcher's graph search (default 100)\n"
+		<< "  --json <file>       Write every run to a JSON results file\n"
+		<< "  --csv <file>        Write every run to a CSV file\n"
+		<< "  --compare <file>    Compare with a JSON results file, exit with 2 on regressions\n"
+		<< "  --maxThroughputDrop <percent>  Allowed throughput drop in compare mode (default 5)\n"
+		<< "  --maxP99Increase <percent>     Allowed p99 latency increase in compare mode (default 10)\n";
 }
 
 int main(int argc, char *argv[]) {
 
 	std::vector<std::filesystem::path> data_dirs;
+	BenchmarkOptions options;
+	bool sweep = false;
+	bool threads_given = false;
+	bool beam_sizes_given = false;
+	bool top_ks_given = false;
+	bool layer_types_given = false;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (arg == "--help" || arg == "-h") {
+			PrintUsage();
+			return 0;
+		} else if (arg == "--latency") {
+			options.latency = true;
+		} else if (arg == "--counters") {
+			options.counters = true;
+		} else if (arg == "--load") {
+			options.load = true;
+		} else if (arg == "--qps" && has_value) {
+			options.load_qps = ParseDoubleList(argv[++i]);
+		} else if (arg == "--loadDuration" && has_value) {
+			options.load_duration = std::stod(argv[++i]);
+		} else if (arg == "--kneeFactor" && has_value) {
+			options.knee_factor = std::stod(argv[++i]);
+		} else if (arg == "--sweep") {
+			sweep = true;
+		} else if (arg == "--topK" && has_value) {
+			options.top_ks = ParseIntList(argv[++i]);
+			top_ks_given = true;
+		} else if (arg == "--beamSize" && has_value) {
+			options.beam_sizes = ParseIntList(argv[++i]);
+			beam_sizes_given = true;
+		} else if (arg == "--threads" && has_value) {
+			options.threads = ParseIntList(argv[++i]);
+			threads_given = true;
+		} else if (arg == "--layerType" && has_value) {
+			options.layer_types.clear();
+			for (auto& name : SplitList(argv[++i])) {
+				options.layer_types.push_back(ParseLayerType(name));
+			}
+			layer_types_given = true;
+		} else if (arg == "--warmup" && has_value) {
+			options.warmup = std::stoi(argv[++i]);
+		} else if (arg == "--pin" && has_value) {
+			options.pin_cpu = std::stoi(argv[++i]);
+		} else if (arg == "--hnswMatcher" && has_value) {
+			options.matcher_depth = std::stoi(argv[++i]);
+		} else if (arg == "--matcherEfS" && has_value) {
+			options.matcher_efs = std::stoi(argv[++i]);
+		} else if (arg == "--json" && has_value) {
+			options.json_path = argv[++i];
+		} else if (arg == "--csv" && has_value) {
+			options.csv_path = argv[++i];
+		} else if (arg == "--compare" && has_value) {
+			options.baseline_path = argv[++i];
+		} else if (arg == "--maxThroughputDrop" && has_value) {
+			options.max_throughput_drop = std::stod(argv[++i]);
+		} else if (arg == "--maxP99Increase" && has_value) {
+			options.max_p99_increase = std::stod(argv[++i]);
+		} else if (arg.rfind("--", 0) == 0) {
+			std::cout << "Unknown or incomplete option " << arg << std::endl;
+			PrintUsage();
+			return 1;
+		} else {
+			data_dirs.emplace_back(arg);
+		}
+	}
+
+	if (sweep) {
+		if (!threads_given) {
+			options.threads = {1};
+			int max_threads = std::max(1u, std::thread::hardware_concurrency());
+			for (int t = 2; t <= max_threads; t *= 2) {
+				options.threads.push_back(t);
+			}
+		}
+		if (!beam_sizes_given) {
+			options.beam_sizes = {5, 10, 20, 50};
+		}
+		if (!top_ks_given) {
+			options.top_ks = {1, 5, 10};
+		}
+		if (!layer_types_given) {
+			options.layer_types = {pecos::LAYER_TYPE_CSC,
+				pecos::LAYER_TYPE_HASH_CHUNKED, pecos::LAYER_TYPE_BINARY_SEARCH_CHUNKED};
+		}
+	}
+
+	if (options.threads.empty() || options.beam_sizes.empty() ||
+		options.top_ks.empty() || options.layer_types.empty()) {
+		std::cout << "Every benchmark list needs at least one value" << std::endl;
+		return 1;
+	}
+	for (const auto& values : {options.beam_sizes, options.top_ks}) {
+		if (*std::min_element(values.begin(), values.end()) < 1) {
+			std::cout << "Beam sizes and topK values must be positive" << std::endl;
+			return 1;
+		}
+	}
+
+	if (options.pin_cpu >= 0) {
+		PinToCpu(options.pin_cpu);
+	}
 
-	if (argc < 2) {
+	if (data_dirs.empty()) {
 		auto path = std::filesystem::path(DATA_DIR);
 
 		for (auto entry : std::filesystem::directory_iterator(path)) {
@@ -268,15 +1624,34 @@ int main(int argc, char *argv[]) {
 				data_dirs.emplace_back(entry.path());
 			}
 		}
-	} else {
-		for (int i = 1; i < argc; ++i) {
-			data_dirs.emplace_back(argv[i]);
-		}
 	}
 
+	// Read the baseline first so that a bad path fails before the benchmark runs
+	std::vector<RunResult> baseline;
+	if (!options.baseline_path.empty()) {
+		baseline = ReadJson(options.baseline_path);
+	}
+
+	std::vector<RunResult> results;
 	for (auto dir : data_dirs) {
 		if (std::filesystem::exists(dir) && std::filesystem::is_directory(dir)) {
-			TestDataSet(dir);
+			for (auto& result : TestDataSet(dir, options)) {
+				results.emplace_back(std::move(result));
+			}
 		}
 	}
+
+	if (!options.json_path.empty()) {
+		WriteJson(options.json_path, results);
+		std::cout << "Results written to " << options.json_path << std::endl;
+	}
+	if (!options.csv_path.empty()) {
+		WriteCsv(options.csv_path, results);
+		std::cout << "Results written to " << options.csv_path << std::endl;
+	}
+
+	if (!options.baseline_path.empty() && CompareWithBaseline(results, baseline, options) > 0) {
+		return 2;
+	}
+	return 0;
 }
\ No newline at end of file
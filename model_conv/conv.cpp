@@ -160,13 +160,17 @@ void ConvertModel(std::filesystem::path path, std::filesystem::path out_path) {
 		std::cout << "Saving NapkinXC model to " << _model_dir_out << "..." << std::endl;
 
 		int size = bases.size();
+		BasesIndex index;
 		_os_bases.write((char*)&size, sizeof(size));
 		for (int i = 0; i < bases.size(); ++i) {
 			Base* base = bases[i];
+			index.add(_os_bases.tellp());
 			base->save(_os_bases, false);
 			delete base;
 		}
+		index.add(_os_bases.tellp());
 		_os_bases.close();
+		index.saveFor(_model_dir_out / "weights.bin");
 
 		tree->save(_os_tree);
 		delete tree;
@@ -0,0 +1,580 @@
+#include <iostream>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <third_party/nlohmann_json/json.hpp>
+
+// Writes a synthetic PECOS model and a matching test set:
+//
+//   <out>/model/param.json                 HierarchicalMLModel
+//   <out>/model/<d>.model/param.json       MLModel of layer d
+//   <out>/model/<d>.model/W.npz            (features + 1) x clusters CSC weights, last row is the bias
+//   <out>/model/<d>.model/C.npz            clusters x parent clusters CSC indicator
+//   <out>/X.tst.tfidf.npz                  queries x features CSR
+//   <out>/Y.tst.npz                        queries x labels CSR
+//
+// The tree is balanced and contiguous: node p of a layer owns children [p * branching, (p + 1) * branching)
+// of the next layer. Every random draw is a hash of the seed and the position of the value being drawn,
+// so the output only depends on the options and any column can be generated without its neighbours.
+
+struct GeneratorOptions {
+	std::filesystem::path out;
+	uint64_t labels = 10000;
+	uint64_t branching = 16;
+	int depth = 0; // 0 builds layers until the top one has at most branching clusters
+	uint64_t features = 100000;
+	double w_density = 0.001; // Fraction of features that are nonzero in every column of W
+	uint64_t queries = 1000;
+	double query_nnz = 50.0; // Mean number of nonzero features per query
+	std::string query_nnz_dist = "fixed"; // fixed, uniform or lognormal
+	double query_noise = 0.2; // Fraction of query features unrelated to the query's labels
+	int labels_per_query = 3;
+	int only_topk = 20;
+	std::string post_processor = "l3-hinge";
+	uint64_t seed = 0;
+};
+
+// Stream ids keep the draws of unrelated quantities independent
+enum RandomStream : uint64_t {
+	STREAM_LEAF_FEATURE = 1,
+	STREAM_LEAF_VALUE,
+	STREAM_NODE_LEAF,
+	STREAM_NODE_SLOT,
+	STREAM_NODE_VALUE,
+	STREAM_QUERY_LABEL,
+	STREAM_QUERY_NNZ,
+	STREAM_QUERY_FEATURE,
+	STREAM_QUERY_VALUE
+};
+
+uint64_t SplitMix64(uint64_t x) {
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+uint64_t Hash(uint64_t seed, uint64_t stream, uint64_t a, uint64_t b = 0, uint64_t c = 0) {
+	uint64_t h = SplitMix64(seed ^ SplitMix64(stream));
+	h = SplitMix64(h ^ a);
+	h = SplitMix64(h ^ b);
+	return SplitMix64(h ^ c);
+}
+
+// Uniform in (0, 1]
+double HashUnit(uint64_t seed, uint64_t stream, uint64_t a, uint64_t b = 0, uint64_t c = 0) {
+	return ((Hash(seed, stream, a, b, c) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+uint32_t Crc32(const char* data, size_t size, uint32_t crc = 0) {
+	static uint32_t table[256];
+	static bool initialized = false;
+	if (!initialized) {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k) {
+				c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+			}
+			table[i] = c;
+		}
+		initialized = true;
+	}
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i) {
+		crc = table[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+// A numpy array serialized in the .npy format, header followed by the raw little endian content
+struct NpyBuffer {
+	std::string header;
+	const char* content;
+	size_t content_size;
+};
+
+// An empty shape writes a 1-d array of all values, "()" a scalar
+template <typename T>
+NpyBuffer MakeNpy(const std::string& descr, const std::vector<T>& values, std::string shape = "") {
+	if (shape.empty()) {
+		shape = "(" + std::to_string(values.size()) + ",)";
+	}
+	std::string dict = "{'descr': '" + descr + "', 'fortran_order': False, 'shape': " + shape + ", }";
+	// Magic, version, header length, dict and newline, padded to 64 bytes as numpy does
+	size_t unpadded = 10 + dict.size() + 1;
+	dict.append((64 - unpadded % 64) % 64, ' ');
+	dict.push_back('\n');
+
+	std::string header = "\x93NUMPY";
+	header.push_back((char)1);
+	header.push_back((char)0);
+	uint16_t header_len = dict.size();
+	header.append(reinterpret_cast<const char*>(&header_len), sizeof(header_len));
+	header += dict;
+
+	return {header, reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T)};
+}
+
+// Minimal writer of uncompressed zip archives, as written by numpy.savez.
+// Array contents are aligned to 64 bytes with an extra field, so that
+// ScipySparseNpz::load_mmap can use them in place.
+class NpzWriter {
+public:
+	NpzWriter(const std::filesystem::path& path) : path(path), out(path, std::ios::binary) {
+		if (!out) {
+			throw std::runtime_error("cannot write " + path.string());
+		}
+	}
+
+	void Add(const std::string& name, const NpyBuffer& npy) {
+		Entry entry;
+		entry.name = name;
+		entry.size = npy.header.size() + npy.content_size;
+		entry.crc = Crc32(npy.content, npy.content_size, Crc32(npy.header.data(), npy.header.size()));
+		entry.offset = out.tellp();
+
+		bool zip64 = entry.size >= 0xffffffffULL;
+		size_t fixed = 30 + name.size() + (zip64 ? 20 : 0);
+		size_t padding = (64 - (entry.offset + fixed + 4 + npy.header.size()) % 64) % 64;
+
+		Put<uint32_t>(0x04034b50);
+		Put<uint16_t>(zip64 ? 45 : 20);
+		Put<uint16_t>(0); // Flags
+		Put<uint16_t>(0); // Stored
+		Put<uint16_t>(0); // Time
+		Put<uint16_t>(0x21); // Date, 1980-01-01
+		Put<uint32_t>(entry.crc);
+		Put<uint32_t>(zip64 ? 0xffffffffU : (uint32_t)entry.size);
+		Put<uint32_t>(zip64 ? 0xffffffffU : (uint32_t)entry.size);
+		Put<uint16_t>(name.size());
+		Put<uint16_t>((zip64 ? 20 : 0) + 4 + padding);
+		out.write(name.data(), name.size());
+		if (zip64) {
+			Put<uint16_t>(0x0001);
+			Put<uint16_t>(16);
+			Put<uint64_t>(entry.size);
+			Put<uint64_t>(entry.size);
+		}
+		Put<uint16_t>(0xd935); // Alignment padding, ignored by readers
+		Put<uint16_t>(padding);
+		out.write(std::string(padding, '\0').data(), padding);
+
+		out.write(npy.header.data(), npy.header.size());
+		out.write(npy.content, npy.content_size);
+		entries.push_back(entry);
+	}
+
+	void Close() {
+		uint64_t directory_offset = out.tellp();
+		for (auto& entry : entries) {
+			bool zip64 = entry.size >= 0xffffffffULL || entry.offset >= 0xffffffffULL;
+			Put<uint32_t>(0x02014b50);
+			Put<uint16_t>(zip64 ? 45 : 20); // Made by
+			Put<uint16_t>(zip64 ? 45 : 20); // Needed
+			Put<uint16_t>(0);
+			Put<uint16_t>(0);
+			Put<uint16_t>(0);
+			Put<uint16_t>(0x21);
+			Put<uint32_t>(entry.crc);
+			Put<uint32_t>(zip64 ? 0xffffffffU : (uint32_t)entry.size);
+			Put<uint32_t>(zip64 ? 0xffffffffU : (uint32_t)entry.size);
+			Put<uint16_t>(entry.name.size());
+			Put<uint16_t>(zip64 ? 28 : 0);
+			Put<uint16_t>(0); // Comment
+			Put<uint16_t>(0); // Disk
+			Put<uint16_t>(0); // Internal attributes
+			Put<uint32_t>(0); // External attributes
+			Put<uint32_t>(zip64 ? 0xffffffffU : (uint32_t)entry.offset);
+			out.write(entry.name.data(), entry.name.size());
+			if (zip64) {
+				Put<uint16_t>(0x0001);
+				Put<uint16_t>(24);
+				Put<uint64_t>(entry.size);
+				Put<uint64_t>(entry.size);
+				Put<uint64_t>(entry.offset);
+			}
+		}
+		uint64_t directory_end = out.tellp();
+		uint64_t directory_size = directory_end - directory_offset;
+
+		bool zip64 = directory_offset >= 0xffffffffULL;
+		if (zip64) {
+			Put<uint32_t>(0x06064b50);
+			Put<uint64_t>(44);
+			Put<uint16_t>(45);
+			Put<uint16_t>(45);
+			Put<uint32_t>(0);
+			Put<uint32_t>(0);
+			Put<uint64_t>(entries.size());
+			Put<uint64_t>(entries.size());
+			Put<uint64_t>(directory_size);
+			Put<uint64_t>(directory_offset);
+			Put<uint32_t>(0x07064b50);
+			Put<uint32_t>(0);
+			Put<uint64_t>(directory_end);
+			Put<uint32_t>(1);
+		}
+		Put<uint32_t>(0x06054b50);
+		Put<uint16_t>(0);
+		Put<uint16_t>(0);
+		Put<uint16_t>(entries.size());
+		Put<uint16_t>(entries.size());
+		Put<uint32_t>(directory_size);
+		Put<uint32_t>(zip64 ? 0xffffffffU : (uint32_t)directory_offset);
+		Put<uint16_t>(0);
+		out.close();
+
+		if (!out) {
+			throw std::runtime_error("failed writing " + path.string());
+		}
+	}
+
+private:
+	struct Entry {
+		std::string name;
+		uint64_t size;
+		uint64_t offset;
+		uint32_t crc;
+	};
+
+	std::filesystem::path path;
+	std::ofstream out;
+	std::vector<Entry> entries;
+
+	// Zip fields are little endian, as is every platform this project builds on
+	template <typename T>
+	void Put(T value) {
+		out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+};
+
+// A sparse matrix in the compressed layout scipy uses for both CSR and CSC
+struct CompressedMatrix {
+	uint64_t rows = 0;
+	uint64_t cols = 0;
+	std::vector<uint64_t> indptr;
+	std::vector<int32_t> indices;
+	std::vector<float> data;
+
+	CompressedMatrix(uint64_t rows, uint64_t cols, uint64_t major_dim) : rows(rows), cols(cols) {
+		indptr.reserve(major_dim + 1);
+		indptr.push_back(0);
+	}
+
+	// Entries of one row (CSR) or column (CSC), duplicates are summed
+	void AppendMajor(std::vector<std::pair<int32_t, float>>& entries) {
+		std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) { return a.first < b.first; });
+		for (size_t i = 0; i < entries.size(); ++i) {
+			if (i > 0 && entries[i].first == entries[i - 1].first) {
+				data.back() += entries[i].second;
+			} else {
+				indices.push_back(entries[i].first);
+				data.push_back(entries[i].second);
+			}
+		}
+		indptr.push_back(indices.size());
+	}
+
+	void Save(const std::filesystem::path& path, bool is_csr) const {
+		std::vector<char> format = is_csr ? std::vector<char>{'c', 's', 'r'} : std::vector<char>{'c', 's', 'c'};
+		std::vector<int64_t> shape = {(int64_t)rows, (int64_t)cols};
+
+		NpzWriter npz(path);
+		npz.Add("indices.npy", MakeNpy("<i4", indices));
+		npz.Add("indptr.npy", MakeNpy("<i8", indptr));
+		npz.Add("format.npy", MakeNpy("|S3", format, "()"));
+		npz.Add("shape.npy", MakeNpy("<i8", shape));
+		npz.Add("data.npy", MakeNpy("<f4", data));
+		npz.Close();
+	}
+};
+
+class SyntheticModel {
+public:
+	SyntheticModel(const GeneratorOptions& options) : options(options) {
+		if (options.labels == 0 || options.features == 0 || options.branching < 2) {
+			throw std::invalid_argument("labels and features must be positive and branching at least 2");
+		}
+
+		// Layer sizes from the leaves up, then keep the requested number of layers
+		std::vector<uint64_t> sizes = {options.labels};
+		while (sizes.back() > options.branching) {
+			sizes.push_back((sizes.back() + options.branching - 1) / options.branching);
+		}
+		if (options.depth > 0) {
+			if ((size_t)options.depth > sizes.size()) {
+				throw std::invalid_argument("depth is larger than the tree built from labels and branching");
+			}
+			sizes.resize(options.depth);
+		}
+		layer_sizes.assign(sizes.rbegin(), sizes.rend());
+
+		nnz_per_column = std::max<uint64_t>(1, (uint64_t)std::llround(options.w_density * options.features));
+	}
+
+	int Depth() const {
+		return layer_sizes.size();
+	}
+
+	uint64_t LayerSize(int d) const {
+		return layer_sizes[d];
+	}
+
+	// Number of leaves under one node of layer d
+	uint64_t LeavesPerNode(int d) const {
+		uint64_t leaves = 1;
+		for (int i = d + 1; i < Depth(); ++i) {
+			leaves *= options.branching;
+			if (leaves >= options.labels) {
+				return options.labels;
+			}
+		}
+		return leaves;
+	}
+
+	uint64_t LeafFeature(uint64_t label, uint64_t slot) const {
+		return Hash(options.seed, STREAM_LEAF_FEATURE, label, slot) % options.features;
+	}
+
+	// Leaves have random features. Internal nodes sample the features of their leaves,
+	// so the scores of a branch are correlated with the scores of its labels.
+	std::vector<std::pair<int32_t, float>> Column(int d, uint64_t node) const {
+		std::vector<std::pair<int32_t, float>> entries;
+		entries.reserve(nnz_per_column);
+
+		if (d == Depth() - 1) {
+			for (uint64_t slot = 0; slot < nnz_per_column; ++slot) {
+				entries.emplace_back(LeafFeature(node, slot),
+					HashUnit(options.seed, STREAM_LEAF_VALUE, node, slot));
+			}
+		} else {
+			uint64_t leaves = LeavesPerNode(d);
+			uint64_t first = node * leaves;
+			uint64_t count = std::min(leaves, options.labels - first);
+			for (uint64_t k = 0; k < nnz_per_column; ++k) {
+				uint64_t leaf = first + Hash(options.seed, STREAM_NODE_LEAF, d, node, k) % count;
+				uint64_t slot = Hash(options.seed, STREAM_NODE_SLOT, d, node, k) % nnz_per_column;
+				entries.emplace_back(LeafFeature(leaf, slot),
+					HashUnit(options.seed, STREAM_NODE_VALUE, d, node, k));
+			}
+		}
+		return entries;
+	}
+
+	CompressedMatrix Weights(int d) const {
+		CompressedMatrix W(options.features + 1, LayerSize(d), LayerSize(d));
+		W.indices.reserve(LayerSize(d) * nnz_per_column);
+		W.data.reserve(LayerSize(d) * nnz_per_column);
+		for (uint64_t node = 0; node < LayerSize(d); ++node) {
+			auto entries = Column(d, node);
+			W.AppendMajor(entries);
+		}
+		return W;
+	}
+
+	// Child x parent indicator, the root layer has a single parent
+	CompressedMatrix Clusters(int d) const {
+		uint64_t parents = (d == 0) ? 1 : LayerSize(d - 1);
+		CompressedMatrix C(LayerSize(d), parents, parents);
+		for (uint64_t parent = 0; parent < parents; ++parent) {
+			std::vector<std::pair<int32_t, float>> entries;
+			uint64_t first = (d == 0) ? 0 : parent * options.branching;
+			uint64_t last = (d == 0) ? LayerSize(d) : std::min(first + options.branching, LayerSize(d));
+			for (uint64_t child = first; child < last; ++child) {
+				entries.emplace_back(child, 1.0f);
+			}
+			C.AppendMajor(entries);
+		}
+		return C;
+	}
+
+	uint64_t QueryNnz(uint64_t query) const {
+		double u = HashUnit(options.seed, STREAM_QUERY_NNZ, query);
+		double nnz = options.query_nnz;
+		if (options.query_nnz_dist == "uniform") {
+			nnz = 1.0 + u * (2.0 * options.query_nnz - 2.0);
+		} else if (options.query_nnz_dist == "lognormal") {
+			// Box-Muller with sigma 1, shifted so that the mean stays query_nnz
+			double v = HashUnit(options.seed, STREAM_QUERY_NNZ, query, 1);
+			double z = std::sqrt(-2.0 * std::log(u)) * std::cos(2.0 * 3.14159265358979323846 * v);
+			nnz = options.query_nnz * std::exp(z - 0.5);
+		}
+		return std::max<uint64_t>(1, std::min<uint64_t>(options.features, (uint64_t)std::llround(nnz)));
+	}
+
+	// Queries mix features of their labels with uniform noise, rows are L2 normalized like tf-idf
+	void Queries(CompressedMatrix& X, CompressedMatrix& Y) const {
+		for (uint64_t query = 0; query < options.queries; ++query) {
+			std::vector<std::pair<int32_t, float>> labels;
+			for (int i = 0; i < options.labels_per_query; ++i) {
+				labels.emplace_back(Hash(options.seed, STREAM_QUERY_LABEL, query, i) % options.labels, 1.0f);
+			}
+			Y.AppendMajor(labels);
+			for (uint64_t i = Y.indptr[query]; i < Y.indptr[query + 1]; ++i) {
+				Y.data[i] = 1.0f;
+			}
+
+			std::vector<std::pair<int32_t, float>> features;
+			uint64_t nnz = QueryNnz(query);
+			uint64_t label_count = Y.indptr[query + 1] - Y.indptr[query];
+			for (uint64_t k = 0; k < nnz; ++k) {
+				uint64_t h = Hash(options.seed, STREAM_QUERY_FEATURE, query, k);
+				bool noise = HashUnit(options.seed, STREAM_QUERY_FEATURE, query, k, 1) <= options.query_noise;
+				uint64_t feature;
+				if (noise || label_count == 0) {
+					feature = h % options.features;
+				} else {
+					uint64_t label = Y.indices[Y.indptr[query] + h % label_count];
+					feature = LeafFeature(label, (h >> 32) % nnz_per_column);
+				}
+				features.emplace_back(feature, HashUnit(options.seed, STREAM_QUERY_VALUE, query, k));
+			}
+			X.AppendMajor(features);
+
+			double norm = 0.0;
+			for (uint64_t i = X.indptr[query]; i < X.indptr[query + 1]; ++i) {
+				norm += (double)X.data[i] * X.data[i];
+			}
+			norm = std::sqrt(norm);
+			for (uint64_t i = X.indptr[query]; i < X.indptr[query + 1]; ++i) {
+				X.data[i] /= norm;
+			}
+		}
+	}
+
+private:
+	GeneratorOptions options;
+	std::vector<uint64_t> layer_sizes;
+	uint64_t nnz_per_column;
+};
+
+void WriteJson(const std::filesystem::path& path, const nlohmann::json& j) {
+	std::ofstream out(path);
+	if (!out) {
+		throw std::runtime_error("cannot write " + path.string());
+	}
+	out << j.dump(4) << std::endl;
+}
+
+void Generate(const GeneratorOptions& options) {
+	SyntheticModel model(options);
+	auto model_path = options.out / "model";
+	std::filesystem::create_directories(model_path);
+
+	WriteJson(model_path / "param.json", {
+		{"model", "HierarchicalMLModel"},
+		{"depth", model.Depth()},
+		{"is_predict_only", true}
+	});
+
+	for (int d = 0; d < model.Depth(); ++d) {
+		auto layer_path = model_path / (std::to_string(d) + ".model");
+		std::filesystem::create_directories(layer_path);
+		std::cout << "Writing layer " << d << " with " << model.LayerSize(d) << " clusters to " << layer_path << "..." << std::endl;
+
+		WriteJson(layer_path / "param.json", {
+			{"model", "MLModel"},
+			{"bias", 1.0},
+			{"pred_kwargs", {
+				{"beam_size", 10},
+				{"only_topk", options.only_topk},
+				{"post_processor", options.post_processor}
+			}}
+		});
+		model.Weights(d).Save(layer_path / "W.npz", false);
+		model.Clusters(d).Save(layer_path / "C.npz", false);
+	}
+
+	std::cout << "Writing " << options.queries << " queries to " << options.out << "..." << std::endl;
+	CompressedMatrix X(options.queries, options.features, options.queries);
+	CompressedMatrix Y(options.queries, options.labels, options.queries);
+	model.Queries(X, Y);
+	X.Save(options.out / "X.tst.tfidf.npz", true);
+	Y.Save(options.out / "Y.tst.npz", true);
+}
+
+void PrintUsage() {
+	GeneratorOptions defaults;
+	std::cout << "Usage: ModelGenerator --out <dir> [options]\n"
+		<< "  --labels <int>          Number of labels (default " << defaults.labels << ")\n"
+		<< "  --branching <int>       Children per tree node (default " << defaults.branching << ")\n"
+		<< "  --depth <int>           Number of layers, 0 for a full tree (default 0)\n"
+		<< "  --features <int>        Feature dimension (default " << defaults.features << ")\n"
+		<< "  --wDensity <float>      Fraction of nonzero features per weight column (default " << defaults.w_density << ")\n"
+		<< "  --queries <int>         Number of test queries (default " << defaults.queries << ")\n"
+		<< "  --queryNnz <float>      Mean nonzero features per query (default " << defaults.query_nnz << ")\n"
+		<< "  --queryNnzDist <name>   fixed, uniform or lognormal (default " << defaults.query_nnz_dist << ")\n"
+		<< "  --queryNoise <float>    Fraction of query features unrelated to its labels (default " << defaults.query_noise << ")\n"
+		<< "  --labelsPerQuery <int>  Relevant labels per query (default " << defaults.labels_per_query << ")\n"
+		<< "  --onlyTopk <int>        only_topk stored in the layers' param.json (default " << defaults.only_topk << ")\n"
+		<< "  --postProcessor <name>  post_processor stored in the layers' param.json (default " << defaults.post_processor << ")\n"
+		<< "  --seed <int>            Random seed, equal options and seeds give identical files (default 0)\n";
+}
+
+int main(int argc, char *argv[]) {
+
+	GeneratorOptions options;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (arg == "--help" || arg == "-h") {
+			PrintUsage();
+			return 0;
+		} else if (arg == "--out" && has_value) {
+			options.out = argv[++i];
+		} else if (arg == "--labels" && has_value) {
+			options.labels = std::stoull(argv[++i]);
+		} else if (arg == "--branching" && has_value) {
+			options.branching = std::stoull(argv[++i]);
+		} else if (arg == "--depth" && has_value) {
+			options.depth = std::stoi(argv[++i]);
+		} else if (arg == "--features" && has_value) {
+			options.features = std::stoull(argv[++i]);
+		} else if (arg == "--wDensity" && has_value) {
+			options.w_density = std::stod(argv[++i]);
+		} else if (arg == "--queries" && has_value) {
+			options.queries = std::stoull(argv[++i]);
+		} else if (arg == "--queryNnz" && has_value) {
+			options.query_nnz = std::stod(argv[++i]);
+		} else if (arg == "--queryNnzDist" && has_value) {
+			options.query_nnz_dist = argv[++i];
+		} else if (arg == "--queryNoise" && has_value) {
+			options.query_noise = std::stod(argv[++i]);
+		} else if (arg == "--labelsPerQuery" && has_value) {
+			options.labels_per_query = std::stoi(argv[++i]);
+		} else if (arg == "--onlyTopk" && has_value) {
+			options.only_topk = std::stoi(argv[++i]);
+		} else if (arg == "--postProcessor" && has_value) {
+			options.post_processor = argv[++i];
+		} else if (arg == "--seed" && has_value) {
+			options.seed = std::stoull(argv[++i]);
+		} else {
+			std::cout << "Unknown or incomplete option " << arg << std::endl;
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	if (options.out.empty()) {
+		PrintUsage();
+		return 1;
+	}
+
+	if (options.query_nnz_dist != "fixed" && options.query_nnz_dist != "uniform" &&
+		options.query_nnz_dist != "lognormal") {
+		std::cout << "Unknown query nnz distribution " << options.query_nnz_dist << std::endl;
+		return 1;
+	}
+
+	Generate(options);
+	std::cout << "Done. Convert the model with: ModelConv " << (options.out / "model") << std::endl;
+}
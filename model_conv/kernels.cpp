@@ -0,0 +1,520 @@
+#include <iostream>
+
+#include <models/tree.h>
+#include <types.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <pecos/core/xmc/inference.hpp>
+
+// Microbenchmarks of the inner kernels of both engines on synthetic inputs.
+//
+// Every kernel runs a batch of operations per call, calls are repeated until the
+// minimum time is reached and the median of several trials is reported.
+// bytes/op counts the data a kernel has to read or write to do one operation
+// (query values, weight entries and row pointers it touches, outputs it writes),
+// not what the caches end up transferring.
+
+struct KernelOptions {
+	uint32_t dim = 100000; // Feature dimension of queries and weights
+	uint32_t chunk_width = 16; // Columns per chunk, i.e. branching factor
+	uint32_t chunks = 2000;
+	double w_density = 0.001; // Fraction of nonzero rows per weight column
+	uint32_t query_nnz = 100;
+	uint32_t queries = 256;
+	uint32_t beam = 10; // Active parents per query for prolongate_predictions
+	uint32_t top_k = 10;
+	uint32_t sort_row_nnz = 160; // Entries per row given to sorted_csr
+	double min_time = 0.2; // Seconds per trial
+	int trials = 5;
+	uint32_t seed = 0;
+	std::string filter; // Only run kernels whose name contains this
+};
+
+struct KernelStats {
+	std::string name;
+	double ns_per_op;
+	double bytes_per_op;
+};
+
+// Results are folded into this so that the compiler cannot drop the kernels
+volatile double g_sink = 0.0;
+
+class KernelHarness {
+public:
+	KernelHarness(const KernelOptions& options) : options(options) { }
+
+	bool Enabled(const std::string& name) const {
+		return options.filter.empty() || name.find(options.filter) != std::string::npos;
+	}
+
+	// run() performs ops_per_call operations. setup() and teardown() are called around every
+	// run() without being timed, for kernels that consume or produce data.
+	void Measure(const std::string& name, uint64_t ops_per_call, double bytes_per_op,
+		const std::function<void()>& run,
+		const std::function<void()>& setup = nullptr,
+		const std::function<void()>& teardown = nullptr) {
+
+		if (!Enabled(name)) {
+			return;
+		}
+
+		std::vector<double> trial_ns_per_op;
+		for (int trial = 0; trial < std::max(1, options.trials); ++trial) {
+			double elapsed_ns = 0.0;
+			uint64_t ops = 0;
+			while (elapsed_ns < options.min_time * 1e9) {
+				if (setup) {
+					setup();
+				}
+				auto start = std::chrono::steady_clock::now();
+				run();
+				elapsed_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+				if (teardown) {
+					teardown();
+				}
+				ops += ops_per_call;
+			}
+			trial_ns_per_op.push_back(elapsed_ns / ops);
+		}
+
+		std::sort(trial_ns_per_op.begin(), trial_ns_per_op.end());
+		results.push_back({name, trial_ns_per_op[trial_ns_per_op.size() / 2], bytes_per_op});
+		Print(results.back());
+	}
+
+	static void PrintHeader() {
+		std::cout << std::left << std::setw(40) << "kernel" << std::right
+			<< std::setw(14) << "ns/op" << std::setw(14) << "bytes/op" << std::setw(10) << "GB/s" << std::endl;
+	}
+
+	static void Print(const KernelStats& stats) {
+		std::cout << std::left << std::setw(40) << stats.name << std::right << std::fixed << std::setprecision(2)
+			<< std::setw(14) << stats.ns_per_op << std::setw(14) << stats.bytes_per_op
+			<< std::setw(10) << (stats.ns_per_op > 0.0 ? stats.bytes_per_op / stats.ns_per_op : 0.0)
+			<< std::defaultfloat << std::endl;
+	}
+
+private:
+	KernelOptions options;
+	std::vector<KernelStats> results;
+};
+
+std::vector<uint32_t> SampleIndices(std::mt19937& rng, uint32_t count, uint32_t range) {
+	std::vector<uint32_t> indices;
+	std::uniform_int_distribution<uint32_t> dist(0, range - 1);
+	indices.reserve(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		indices.push_back(dist(rng));
+	}
+	std::sort(indices.begin(), indices.end());
+	indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+	return indices;
+}
+
+// rows x cols matrix with about density * rows nonzeros per column, last row is a dense bias row
+pecos::csc_t RandomWeights(std::mt19937& rng, uint32_t rows, uint32_t cols, double density) {
+	std::uniform_real_distribution<float> values(-1.0f, 1.0f);
+	uint32_t nnz_per_col = std::max<uint32_t>(1, density * (rows - 1));
+
+	std::vector<uint64_t> col_ptr = {0};
+	std::vector<uint32_t> row_idx;
+	std::vector<float> val;
+	for (uint32_t col = 0; col < cols; ++col) {
+		for (auto row : SampleIndices(rng, nnz_per_col, rows - 1)) {
+			row_idx.push_back(row);
+			val.push_back(values(rng));
+		}
+		row_idx.push_back(rows - 1);
+		val.push_back(values(rng));
+		col_ptr.push_back(row_idx.size());
+	}
+
+	pecos::csc_t W;
+	W.rows = rows;
+	W.cols = cols;
+	W.col_ptr = new uint64_t[col_ptr.size()];
+	W.row_idx = new uint32_t[row_idx.size()];
+	W.val = new float[val.size()];
+	std::copy(col_ptr.begin(), col_ptr.end(), W.col_ptr);
+	std::copy(row_idx.begin(), row_idx.end(), W.row_idx);
+	std::copy(val.begin(), val.end(), W.val);
+	return W;
+}
+
+// rows x cols matrix with nnz_per_row sorted nonzeros per row
+pecos::csr_t RandomRows(std::mt19937& rng, uint32_t rows, uint32_t cols, uint32_t nnz_per_row) {
+	std::uniform_real_distribution<float> values(0.0f, 1.0f);
+	std::vector<std::vector<uint32_t>> indices(rows);
+	uint64_t nnz = 0;
+	for (auto& row : indices) {
+		row = SampleIndices(rng, nnz_per_row, cols);
+		nnz += row.size();
+	}
+
+	pecos::csr_t X;
+	X.allocate(rows, cols, nnz);
+	X.row_ptr[0] = 0;
+	for (uint32_t row = 0; row < rows; ++row) {
+		auto offset = X.row_ptr[row];
+		for (size_t i = 0; i < indices[row].size(); ++i) {
+			X.col_idx[offset + i] = indices[row][i];
+			X.val[offset + i] = values(rng);
+		}
+		X.row_ptr[row + 1] = offset + indices[row].size();
+	}
+	return X;
+}
+
+pecos::csr_t CopyCsr(const pecos::csr_t& X) {
+	pecos::csr_t copy;
+	copy.allocate(X.rows, X.cols, X.get_nnz());
+	std::copy(X.row_ptr, X.row_ptr + X.rows + 1, copy.row_ptr);
+	std::copy(X.col_idx, X.col_idx + X.get_nnz(), copy.col_idx);
+	std::copy(X.val, X.val + X.get_nnz(), copy.val);
+	return copy;
+}
+
+template <typename chunked_matrix_t>
+chunked_matrix_t MakeChunked(const pecos::csc_t& W, uint32_t chunk_width) {
+	std::vector<uint32_t> chunk_col_idx;
+	for (uint32_t col = 0; col < W.cols; col += chunk_width) {
+		chunk_col_idx.push_back(col);
+	}
+	chunk_col_idx.push_back(W.cols);
+
+	auto chunked = pecos::make_chunked_from_csc<chunked_matrix_t>(W, chunk_col_idx.data(), chunk_col_idx.size() - 1);
+	for (uint32_t i = 0; i < chunked.chunk_count; ++i) {
+		chunked.chunks[i].b_has_explicit_bias = chunked.check_bias_explicit(chunked.chunks[i]);
+	}
+	return chunked;
+}
+
+uint32_t ChunkRowCount(const pecos::hash_chunk_t& chunk) {
+	return chunk.row_hash.size();
+}
+
+uint32_t ChunkRowCount(const pecos::bin_search_chunk_t& chunk) {
+	return chunk.nnz_rows;
+}
+
+// One query x chunk product per operation, pairs cycle through all queries and chunks
+template <typename query_matrix_t, typename chunked_matrix_t>
+void BenchChunkOps(KernelHarness& harness, const std::string& name, const query_matrix_t& X,
+	const chunked_matrix_t& W, const KernelOptions& options) {
+
+	typedef typename query_matrix_t::row_vec_t query_row_t;
+	uint64_t ops = std::max<uint64_t>(X.rows, W.chunk_count);
+	std::vector<float> output(options.chunk_width);
+
+	double bytes = 0.0;
+	for (uint64_t op = 0; op < ops; ++op) {
+		auto xi = X.get_row(op % X.rows);
+		auto& chunk = W.chunks[op % W.chunk_count];
+		auto touched = pecos::count_chunk_nnz_touched(xi, chunk, W.rows - 1);
+		bytes += touched * sizeof(pecos::chunk_entry_t) + (chunk.col_end - chunk.col_begin) * sizeof(float);
+		if constexpr (std::is_same<query_row_t, pecos::csr_t::row_vec_t>::value) {
+			bytes += X.get_row(op % X.rows).get_nnz() * (sizeof(uint32_t) + sizeof(float));
+		}
+	}
+
+	harness.Measure(name, ops, bytes / ops, [&]() {
+		double sum = 0.0;
+		for (uint64_t op = 0; op < ops; ++op) {
+			auto& chunk = W.chunks[op % W.chunk_count];
+			std::fill(output.begin(), output.end(), 0.0f);
+			pecos::chunk_ops<query_row_t, chunked_matrix_t>::compute_chunk_inner_product_write_to_zeroed_block(
+				X.get_row(op % X.rows), chunk, W, output.data(), 1.0f, chunk.b_has_explicit_bias);
+			sum += output[0];
+		}
+		g_sink = g_sink + sum;
+	});
+}
+
+template <typename chunked_matrix_t>
+void BenchAddScaledChunkRow(KernelHarness& harness, const std::string& name, const chunked_matrix_t& W,
+	const KernelOptions& options) {
+
+	// Every nonzero row of every chunk once, in storage order
+	std::vector<std::pair<uint32_t, uint32_t>> rows;
+	double bytes = 0.0;
+	for (uint32_t c = 0; c < W.chunk_count; ++c) {
+		auto& chunk = W.chunks[c];
+		if (chunk.row_ptr == nullptr) {
+			continue;
+		}
+		for (uint32_t r = 0; r < ChunkRowCount(chunk); ++r) {
+			rows.emplace_back(c, r);
+			auto entries = chunk.row_ptr[r + 1] - chunk.row_ptr[r];
+			bytes += 2 * sizeof(uint64_t) + entries * (sizeof(pecos::chunk_entry_t) + 2 * sizeof(float));
+		}
+	}
+
+	std::vector<float> output(options.chunk_width);
+	harness.Measure(name, rows.size(), bytes / rows.size(), [&]() {
+		for (auto& row : rows) {
+			pecos::add_scaled_chunk_row_to_output_block(W, W.chunks[row.first], row.second, 0.5f, output.data());
+		}
+		g_sink = g_sink + output[0];
+	});
+}
+
+void RunPecosKernels(KernelHarness& harness, const KernelOptions& options, std::mt19937& rng) {
+	uint32_t cols = options.chunks * options.chunk_width;
+	auto W = RandomWeights(rng, options.dim + 1, cols, options.w_density);
+	auto X = RandomRows(rng, options.queries, options.dim, options.query_nnz);
+
+	std::vector<float> dense(static_cast<uint64_t>(options.queries) * options.dim);
+	for (uint32_t row = 0; row < X.rows; ++row) {
+		for (auto i = X.row_ptr[row]; i < X.row_ptr[row + 1]; ++i) {
+			dense[static_cast<uint64_t>(row) * options.dim + X.col_idx[i]] = X.val[i];
+		}
+	}
+	pecos::drm_t X_dense;
+	X_dense.rows = X.rows;
+	X_dense.cols = X.cols;
+	X_dense.val = dense.data();
+
+	{
+		auto W_hash = MakeChunked<pecos::hash_chunked_matrix_t>(W, options.chunk_width);
+		BenchChunkOps(harness, "chunk_ops<csr, hash>", X, W_hash, options);
+		BenchChunkOps(harness, "chunk_ops<drm, hash>", X_dense, W_hash, options);
+		BenchAddScaledChunkRow(harness, "add_scaled_chunk_row<hash>", W_hash, options);
+		W_hash.free_underlying_memory();
+	}
+	{
+		auto W_bin = MakeChunked<pecos::bin_search_chunked_matrix_t>(W, options.chunk_width);
+		BenchChunkOps(harness, "chunk_ops<csr, bin_search>", X, W_bin, options);
+		BenchChunkOps(harness, "chunk_ops<drm, bin_search>", X_dense, W_bin, options);
+		BenchAddScaledChunkRow(harness, "add_scaled_chunk_row<bin_search>", W_bin, options);
+		W_bin.free_underlying_memory();
+	}
+
+	// sorted_csr keeps the top k of every row in place, so it gets a fresh copy before each call
+	{
+		auto scores = RandomRows(rng, options.queries, cols, options.sort_row_nnz);
+		pecos::csr_t work;
+		double bytes = 2.0 * scores.get_nnz() / scores.rows * (sizeof(uint32_t) + sizeof(float));
+		harness.Measure("sorted_csr", scores.rows, bytes, [&]() {
+			pecos::sorted_csr(work, options.top_k);
+			g_sink = g_sink + work.val[0];
+		}, [&]() {
+			work = CopyCsr(scores);
+		}, [&]() {
+			work.free_underlying_memory();
+		});
+		scores.free_underlying_memory();
+	}
+
+	// One query row with beam active parents expanded to their children per operation
+	{
+		pecos::csc_t C;
+		C.rows = cols;
+		C.cols = options.chunks;
+		C.col_ptr = new uint64_t[options.chunks + 1];
+		C.row_idx = new uint32_t[cols];
+		C.val = new float[cols];
+		for (uint32_t c = 0; c <= options.chunks; ++c) {
+			C.col_ptr[c] = static_cast<uint64_t>(c) * options.chunk_width;
+		}
+		for (uint32_t i = 0; i < cols; ++i) {
+			C.row_idx[i] = i;
+			C.val[i] = 1.0f;
+		}
+
+		auto beam = RandomRows(rng, options.queries, options.chunks, options.beam);
+		pecos::csr_t labels;
+		double children = static_cast<double>(beam.get_nnz()) / beam.rows * options.chunk_width;
+		double bytes = beam.get_nnz() / (double)beam.rows * (sizeof(uint32_t) + sizeof(float) + 2 * sizeof(uint64_t))
+			+ children * (2 * sizeof(uint32_t) + sizeof(float));
+		harness.Measure("prolongate_predictions", beam.rows, bytes, [&]() {
+			labels = pecos::prolongate_predictions(beam, C);
+			g_sink = g_sink + labels.val[0];
+		}, nullptr, [&]() {
+			labels.free_underlying_memory();
+		});
+
+		beam.free_underlying_memory();
+		C.free_underlying_memory();
+	}
+
+	// Sparse queries times row major weights, one query row per operation
+	{
+		auto W_rows = RandomRows(rng, options.dim, cols, std::max<uint32_t>(1, options.w_density * cols));
+		pecos::csr_t Z;
+
+		// Count the output once, the product has the same sparsity pattern on every call
+		pecos::smat_x_smat(X, W_rows, Z, false, true, 1);
+		double products = 0.0;
+		for (uint64_t i = 0; i < X.get_nnz(); ++i) {
+			products += W_rows.nnz_of_row(X.col_idx[i]);
+		}
+		double bytes = (X.get_nnz() + products + Z.get_nnz()) * (sizeof(uint32_t) + sizeof(float)) / X.rows;
+		Z.free_underlying_memory();
+
+		harness.Measure("smat_x_smat<csr, csr>", X.rows, bytes, [&]() {
+			pecos::smat_x_smat(X, W_rows, Z, false, true, 1);
+			g_sink = g_sink + Z.get_nnz();
+		}, nullptr, [&]() {
+			Z.free_underlying_memory();
+		});
+		W_rows.free_underlying_memory();
+	}
+
+	X.free_underlying_memory();
+	W.free_underlying_memory();
+}
+
+// Feature arrays are terminated by index -1, as the rows of SRMatrix<Feature>
+std::vector<Feature> RandomFeatures(std::mt19937& rng, uint32_t nnz, uint32_t dim) {
+	std::uniform_real_distribution<double> values(0.0, 1.0);
+	std::vector<Feature> features;
+	for (auto index : SampleIndices(rng, nnz, dim)) {
+		Feature f;
+		f.index = index;
+		f.value = values(rng);
+		features.push_back(f);
+	}
+	Feature end;
+	end.index = -1;
+	end.value = 0;
+	features.push_back(end);
+	return features;
+}
+
+void BenchVectorDot(KernelHarness& harness, const std::string& name, AbstractVector<Weight>& w,
+	const std::vector<std::vector<Feature>>& queries, double bytes_per_op) {
+	harness.Measure(name, queries.size(), bytes_per_op, [&]() {
+		double sum = 0.0;
+		for (auto& query : queries) {
+			sum += w.dot(const_cast<Feature*>(query.data()));
+		}
+		g_sink = g_sink + sum;
+	});
+}
+
+void RunNapkinKernels(KernelHarness& harness, const KernelOptions& options, std::mt19937& rng) {
+	std::uniform_real_distribution<float> values(-1.0f, 1.0f);
+	auto nonzeros = SampleIndices(rng, std::max<uint32_t>(1, options.w_density * options.dim), options.dim);
+
+	Vector<Weight> dense(options.dim);
+	SparseVector<Weight> sparse(options.dim, nonzeros.size());
+	MapVector<Weight> map(options.dim, nonzeros.size());
+	for (auto i : nonzeros) {
+		auto v = values(rng);
+		dense.insertD(i, v);
+		sparse.insertD(i, v);
+		map.insertD(i, v);
+	}
+
+	std::vector<std::vector<Feature>> queries;
+	for (uint32_t q = 0; q < options.queries; ++q) {
+		queries.emplace_back(RandomFeatures(rng, options.query_nnz, options.dim));
+	}
+	double query_bytes = static_cast<double>(options.query_nnz) * sizeof(Feature);
+
+	// Dense and map lookups read one weight per query feature, the sparse merge reads both vectors
+	BenchVectorDot(harness, "Vector::dot(Feature*)", dense, queries, query_bytes + options.query_nnz * sizeof(Weight));
+	BenchVectorDot(harness, "SparseVector::dot(Feature*)", sparse, queries,
+		query_bytes + nonzeros.size() * sizeof(std::pair<int, Weight>));
+	BenchVectorDot(harness, "MapVector::dot(Feature*)", map, queries,
+		query_bytes + options.query_nnz * (sizeof(int) + sizeof(Weight)));
+
+	// Best-first tree search pattern: push children, keep the top k final ones, pop the best
+	{
+		std::vector<TreeNodeValue> pushes;
+		std::uniform_real_distribution<double> probs(0.0, 1.0);
+		for (uint32_t i = 0; i < 4096; ++i) {
+			pushes.emplace_back(nullptr, probs(rng));
+		}
+		harness.Measure("TopKQueue<TreeNodeValue> push+pop", pushes.size(), 2.0 * sizeof(TreeNodeValue), [&]() {
+			TopKQueue<TreeNodeValue> queue(options.top_k);
+			double sum = 0.0;
+			for (size_t i = 0; i < pushes.size(); ++i) {
+				queue.push(pushes[i], i % 2 == 0);
+				if (i % 4 == 3 && !queue.empty()) {
+					sum += queue.top().value;
+					queue.pop();
+				}
+			}
+			while (!queue.empty()) {
+				sum += queue.top().value;
+				queue.pop();
+			}
+			g_sink = g_sink + sum;
+		});
+	}
+}
+
+void PrintUsage() {
+	KernelOptions defaults;
+	std::cout << "Usage: KernelBenchmark [options]\n"
+		<< "  --dim <int>          Feature dimension (default " << defaults.dim << ")\n"
+		<< "  --chunkWidth <int>   Columns per chunk (default " << defaults.chunk_width << ")\n"
+		<< "  --chunks <int>       Number of chunks (default " << defaults.chunks << ")\n"
+		<< "  --wDensity <float>   Fraction of nonzero rows per weight column (default " << defaults.w_density << ")\n"
+		<< "  --queryNnz <int>     Nonzeros per query (default " << defaults.query_nnz << ")\n"
+		<< "  --queries <int>      Number of queries (default " << defaults.queries << ")\n"
+		<< "  --beam <int>         Active parents per query for prolongate_predictions (default " << defaults.beam << ")\n"
+		<< "  --topK <int>         k of sorted_csr and TopKQueue (default " << defaults.top_k << ")\n"
+		<< "  --minTime <seconds>  Minimum time per trial (default " << defaults.min_time << ")\n"
+		<< "  --trials <int>       Trials per kernel, the median is reported (default " << defaults.trials << ")\n"
+		<< "  --seed <int>         Seed of the synthetic inputs (default " << defaults.seed << ")\n"
+		<< "  --filter <text>      Only run kernels whose name contains the text\n";
+}
+
+int main(int argc, char *argv[]) {
+
+	KernelOptions options;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool has_value = i + 1 < argc;
+
+		if (arg == "--help" || arg == "-h") {
+			PrintUsage();
+			return 0;
+		} else if (arg == "--dim" && has_value) {
+			options.dim = std::stoul(argv[++i]);
+		} else if (arg == "--chunkWidth" && has_value) {
+			options.chunk_width = std::stoul(argv[++i]);
+		} else if (arg == "--chunks" && has_value) {
+			options.chunks = std::stoul(argv[++i]);
+		} else if (arg == "--wDensity" && has_value) {
+			options.w_density = std::stod(argv[++i]);
+		} else if (arg == "--queryNnz" && has_value) {
+			options.query_nnz = std::stoul(argv[++i]);
+		} else if (arg == "--queries" && has_value) {
+			options.queries = std::stoul(argv[++i]);
+		} else if (arg == "--beam" && has_value) {
+			options.beam = std::stoul(argv[++i]);
+		} else if (arg == "--topK" && has_value) {
+			options.top_k = std::stoul(argv[++i]);
+		} else if (arg == "--minTime" && has_value) {
+			options.min_time = std::stod(argv[++i]);
+		} else if (arg == "--trials" && has_value) {
+			options.trials = std::stoi(argv[++i]);
+		} else if (arg == "--seed" && has_value) {
+			options.seed = std::stoul(argv[++i]);
+		} else if (arg == "--filter" && has_value) {
+			options.filter = argv[++i];
+		} else {
+			std::cout << "Unknown or incomplete option " << arg << std::endl;
+			PrintUsage();
+			return 1;
+		}
+	}
+
+	std::mt19937 rng(options.seed);
+	KernelHarness harness(options);
+
+	KernelHarness::PrintHeader();
+	RunPecosKernels(harness, options, rng);
+	RunNapkinKernels(harness, options, rng);
+}
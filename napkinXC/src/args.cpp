@@ -44,6 +44,9 @@ Args::Args() {
     saveGrads = false;
     resume = false;
     loadAs = map;
+    lazyLoad = false;
+    lazyCacheMem = 1024ULL * 1024 * 1024;
+    lazyPinnedDepth = 3;
 
     // Input/output options
     input = "";
@@ -95,6 +98,10 @@ Args::Args() {
     // K-Means tree options
     kmeansEps = 0.0001;
     kmeansBalanced = true;
+    kmeansSample = 0;
+    kmeansMaxIter = 0;
+    kmeansCentroidFeatures = 0;
+    kmeansStats = false;
     kmeansWeightedFeatures = false;
 
     // Online PLT options
@@ -193,7 +200,12 @@ void Args::parseArgs(const std::vector<std::string>& args, bool keepArgs) {
                     loadAs = map;
                 else if (args.at(ai + 1) == "sparse")
                     loadAs = sparse;
-            }
+            } else if (args[ai] == "--lazyLoad")
+                lazyLoad = std::stoi(args.at(ai + 1)) != 0;
+            else if (args[ai] == "--lazyCacheMem")
+                lazyCacheMem = static_cast<unsigned long long>(std::stof(args.at(ai + 1)) * 1024 * 1024 * 1024);
+            else if (args[ai] == "--lazyPinnedDepth")
+                lazyPinnedDepth = std::stoi(args.at(ai + 1));
             // Input/output options
             else if (args[ai] == "-i" || args[ai] == "--input")
                 input = std::string(args.at(ai + 1));
@@ -371,6 +383,14 @@ void Args::parseArgs(const std::vector<std::string>& args, bool keepArgs) {
                 kmeansEps = std::stof(args.at(ai + 1));
             else if (args[ai] == "--kmeansBalanced")
                 kmeansBalanced = std::stoi(args.at(ai + 1)) != 0;
+            else if (args[ai] == "--kmeansSample")
+                kmeansSample = std::stoi(args.at(ai + 1));
+            else if (args[ai] == "--kmeansMaxIter")
+                kmeansMaxIter = std::stoi(args.at(ai + 1));
+            else if (args[ai] == "--kmeansCentroidFeatures")
+                kmeansCentroidFeatures = std::stoi(args.at(ai + 1));
+            else if (args[ai] == "--kmeansStats")
+                kmeansStats = std::stoi(args.at(ai + 1)) != 0;
             else if (args[ai] == "--kmeansWeightedFeatures")
                 kmeansWeightedFeatures = std::stoi(args.at(ai + 1)) != 0;
             else if (args[ai] == "--treeStructure") {
@@ -541,7 +561,9 @@ void Args::printArgs(std::string command) {
                 Log(CERR) << "\n  Tree type: " << treeTypeName << ", arity: " << arity;
                 if (treeType == hierarchicalKmeans)
                     Log(CERR) << ", k-means eps: " << kmeansEps << ", balanced: " << kmeansBalanced
-                              << ", weighted features: " << kmeansWeightedFeatures;
+                              << ", weighted features: " << kmeansWeightedFeatures << ", sample: " << kmeansSample
+                              << ", max iter: " << kmeansMaxIter << ", centroid features: " << kmeansCentroidFeatures
+                              << ", stats: " << kmeansStats;
                 if (treeType == hierarchicalKmeans || treeType == balancedInOrder || treeType == balancedRandom
                     || treeType == onlineBestScore || treeType == onlineRandom)
                     Log(CERR) << ", max leaves: " << maxLeaves;
@@ -562,6 +584,8 @@ void Args::printArgs(std::string command) {
                 Log(CERR) << ", beam search width: " << beamSearchWidth;
         }
         Log(CERR) << "\n  Base classifiers representation: " << representationName << " vector";
+        if (lazyLoad)
+            Log(CERR) << "\n  Lazy loading: cache size: " << formatMem(lazyCacheMem) << ", pinned depth: " << lazyPinnedDepth;
         if(thresholds.empty()) Log(CERR) << "\n  Top k: " << topK << ", threshold: " << threshold;
         else Log(CERR) << "\n  Thresholds: " << thresholds;
 
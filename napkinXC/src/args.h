@@ -117,6 +117,9 @@ public:
     bool saveGrads;
     bool resume;
     RepresentationType loadAs;
+    bool lazyLoad;
+    unsigned long long lazyCacheMem;
+    int lazyPinnedDepth;
 
     // Input/output options
     std::string input;
@@ -162,6 +165,10 @@ public:
     // K-Means tree options
     double kmeansEps;
     bool kmeansBalanced;
+    int kmeansSample;
+    int kmeansMaxIter;
+    int kmeansCentroidFeatures;
+    bool kmeansStats;
     bool kmeansWeightedFeatures;
 
     // Online tree options
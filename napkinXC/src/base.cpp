@@ -454,3 +454,50 @@ AbstractVector<Weight>* Base::vecTo(AbstractVector<Weight>* vec, RepresentationT
     else throw std::invalid_argument("Unknown representation type");
     return newVec;
 }
+
+std::string BasesIndex::indexFile(const std::string& weightsFile){
+    return weightsFile + ".index";
+}
+
+void BasesIndex::saveFor(const std::string& weightsFile){
+    saveToFile(indexFile(weightsFile));
+}
+
+bool BasesIndex::loadFor(const std::string& weightsFile){
+    offsets.clear();
+    std::ifstream in(indexFile(weightsFile));
+    if(!in.good()) return false;
+    load(in);
+    in.close();
+
+    // Check that the index describes this weights file: same number of bases and the same size
+    std::ifstream weightsIn(weightsFile, std::ios::ate);
+    unsigned long long fileSize = weightsIn.tellg();
+    int basesCount = -1;
+    weightsIn.seekg(0);
+    loadVar(weightsIn, basesCount);
+
+    if(offsets.empty() || basesCount < 0 || basesCount > size() || offsets.back() != fileSize){
+        Log(CERR) << "Warning: Index " << indexFile(weightsFile) << " does not match weights file, ignoring it!\n";
+        offsets.clear();
+        return false;
+    }
+
+    // Some models write more bases than declared in the header, readers only use the declared ones
+    offsets.resize(basesCount + 1);
+    return true;
+}
+
+void BasesIndex::save(std::ostream& out){
+    size_t count = offsets.size();
+    saveVar(out, count);
+    out.write((char*)offsets.data(), count * sizeof(unsigned long long));
+}
+
+void BasesIndex::load(std::istream& in){
+    size_t count = 0;
+    loadVar(in, count);
+    offsets.resize(count);
+    in.read((char*)offsets.data(), count * sizeof(unsigned long long));
+    if(!in) offsets.clear();
+}
@@ -116,3 +116,21 @@ public:
 
     AbstractVector<Weight>* vecTo(AbstractVector<Weight>*, RepresentationType type);
 };
+
+// Byte offsets of the bases serialized in a weights file, kept in a side file next to it (e.g. weights.bin.index),
+// so the weights file itself keeps its format and stays readable without the index.
+class BasesIndex: public FileHelper {
+public:
+    std::vector<unsigned long long> offsets; // Offsets of all the bases followed by the end of the last one
+
+    inline int size() { return offsets.empty() ? 0 : offsets.size() - 1; }
+    inline void add(unsigned long long offset) { offsets.push_back(offset); }
+
+    // Loads the index of the given weights file, returns false if there is none or it does not match the file
+    bool loadFor(const std::string& weightsFile);
+    void saveFor(const std::string& weightsFile);
+    static std::string indexFile(const std::string& weightsFile);
+
+    void save(std::ostream& out) override;
+    void load(std::istream& in) override;
+};
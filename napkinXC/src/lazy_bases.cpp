@@ -0,0 +1,139 @@
+/*
+ Copyright (c) 2021 by Marek Wydmuch
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#include "lazy_bases.h"
+#include "log.h"
+#include "misc.h"
+
+
+LazyBases::LazyBases(std::string infile, BasesIndex& index, unsigned long long memBudget, RepresentationType loadAs):
+    infile(infile), index(index), loadAs(loadAs), memBudget(memBudget),
+    memUsed(0), memPinned(0), ticks(0), misses(0), evictions(0) {
+    int size = index.size();
+    slots.resize(size);
+    slotsMem.resize(size, 0);
+    lastUse.reset(new std::atomic<unsigned long long>[size]());
+    pinned.resize(size, 0);
+}
+
+std::shared_ptr<Base> LazyBases::get(int i){
+    lastUse[i].store(++ticks, std::memory_order_relaxed);
+    auto base = std::atomic_load(&slots[i]);
+    if(base == nullptr) {
+        ++misses;
+        base = insert(i, read(i));
+    }
+    return base;
+}
+
+void LazyBases::pin(int i){
+    auto base = std::atomic_load(&slots[i]);
+    if(base == nullptr) insert(i, read(i));
+    std::lock_guard<std::mutex> lock(mtx);
+    if(!pinned[i]) {
+        pinned[i] = 1;
+        memPinned += slotsMem[i]; // Its heap entry is dropped when it reaches the top
+    }
+}
+
+unsigned long long LazyBases::mem(){
+    std::lock_guard<std::mutex> lock(mtx);
+    return memUsed;
+}
+
+unsigned long long LazyBases::pinnedMem(){
+    std::lock_guard<std::mutex> lock(mtx);
+    return memPinned;
+}
+
+std::shared_ptr<Base> LazyBases::read(int i){
+    std::unique_ptr<std::ifstream> in;
+    {
+        std::lock_guard<std::mutex> lock(streamsMtx);
+        if(!streams.empty()){
+            in = std::move(streams.back());
+            streams.pop_back();
+        }
+    }
+    if(in == nullptr) in.reset(new std::ifstream(infile));
+
+    // Representation is chosen at load time, the base is not converted once cached
+    auto base = std::make_shared<Base>();
+    in->clear();
+    in->seekg(index.offsets[i]);
+    base->load(*in, false, loadAs);
+
+    std::lock_guard<std::mutex> lock(streamsMtx);
+    streams.push_back(std::move(in));
+    return base;
+}
+
+std::shared_ptr<Base> LazyBases::insert(int i, std::shared_ptr<Base> base){
+    std::lock_guard<std::mutex> lock(mtx);
+
+    // Another thread could have loaded the same base in the meantime
+    auto cached = std::atomic_load(&slots[i]);
+    if(cached != nullptr) return cached;
+
+    slotsMem[i] = base->mem();
+    memUsed += slotsMem[i];
+    std::atomic_store(&slots[i], base);
+    lru.push({lastUse[i].load(std::memory_order_relaxed), i});
+    evict(i);
+    return base;
+}
+
+void LazyBases::evict(int keep){
+    // Unpinned bases share what is left of the budget after the pinned ones
+    unsigned long long budget = memBudget > memPinned ? memBudget - memPinned : 0;
+    bool keepPopped = false;
+    while(memUsed - memPinned > budget && !lru.empty()){
+        auto top = lru.top();
+        int j = top.second;
+        lru.pop();
+        if(pinned[j]) continue;
+        if(j == keep){ // The base just inserted is returned to the caller, even over the budget
+            keepPopped = true;
+            continue;
+        }
+        auto used = lastUse[j].load(std::memory_order_relaxed);
+        if(top.first < used){ // Used since the entry was pushed
+            lru.push({used, j});
+            continue;
+        }
+        std::atomic_store(&slots[j], std::shared_ptr<Base>());
+        memUsed -= slotsMem[j];
+        slotsMem[j] = 0;
+        ++evictions;
+    }
+    if(keepPopped) lru.push({lastUse[keep].load(std::memory_order_relaxed), keep});
+}
+
+void LazyBases::printInfo(){
+    std::lock_guard<std::mutex> lock(mtx);
+    int pinnedCount = 0;
+    for(auto p : pinned) pinnedCount += p;
+    Log(COUT) << "Lazy loaded bases stats:"
+              << "\n  Cache size: " << formatMem(memUsed) << " / " << formatMem(memBudget)
+              << "\n  Pinned bases: " << pinnedCount << " / " << slots.size() << ", " << formatMem(memPinned)
+              << "\n  Hits: " << ticks - misses << ", misses: " << misses << ", evictions: " << evictions << "\n";
+}
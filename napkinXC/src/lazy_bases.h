@@ -0,0 +1,90 @@
+/*
+ Copyright (c) 2021 by Marek Wydmuch
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base.h"
+
+// Bases of a model loaded on first use from a weights file with an offset index (see BasesIndex).
+// Loaded bases are kept in a LRU cache limited by a memory budget, pinned bases are never evicted
+// and their memory is taken out of the budget of the others.
+// Bases are handed out as shared pointers, so a base evicted while still in use stays valid until released.
+// Cache hits take no lock, they only stamp the base with a use tick. Misses read the base outside of the lock
+// and only take it to insert and evict, the least recently used base is found with a heap of the stamps.
+// Cached bases are shared between threads and must not be modified, e.g. converted to another representation.
+class LazyBases {
+public:
+    LazyBases(std::string infile, BasesIndex& index, unsigned long long memBudget, RepresentationType loadAs = map);
+
+    std::shared_ptr<Base> get(int i);
+    void pin(int i); // Loads base and excludes it from eviction
+
+    inline double predictProbability(int i, Feature* features){
+        return get(i)->predictProbability(features);
+    }
+
+    inline int size() { return slots.size(); }
+    unsigned long long mem();
+    unsigned long long pinnedMem();
+    void printInfo();
+
+private:
+    std::string infile;
+    BasesIndex index;
+    RepresentationType loadAs;
+
+    // Slots are read and written with std::atomic_load/atomic_store, written only under mtx
+    std::vector<std::shared_ptr<Base>> slots;
+    std::vector<unsigned long long> slotsMem;
+    std::unique_ptr<std::atomic<unsigned long long>[]> lastUse; // Tick of the last get
+    std::vector<char> pinned;
+
+    // Min-heap of (tick, slot), one entry per cached unpinned base. An entry is only refreshed
+    // when it reaches the top with a tick older than the last use of its base.
+    typedef std::pair<unsigned long long, int> HeapEntry;
+    std::priority_queue<HeapEntry, std::vector<HeapEntry>, std::greater<HeapEntry>> lru;
+
+    unsigned long long memBudget;
+    unsigned long long memUsed;
+    unsigned long long memPinned;
+    std::atomic<unsigned long long> ticks; // Number of gets so far
+    std::atomic<unsigned long long> misses;
+    unsigned long long evictions;
+    std::mutex mtx; // Guards inserting, evicting, the heap and the memory accounting
+
+    // Streams of the weights file not in use, so misses of different threads can read at the same time
+    std::vector<std::unique_ptr<std::ifstream>> streams;
+    std::mutex streamsMtx;
+
+    std::shared_ptr<Base> read(int i);
+    std::shared_ptr<Base> insert(int i, std::shared_ptr<Base> base);
+    void evict(int keep);
+};
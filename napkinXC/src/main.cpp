@@ -397,6 +397,13 @@ Args:
     --kmeansEps             Tolerance of termination criterion of the k-means clustering
                             used in hierarchical k-means tree building procedure (default = 0.001)
     --kmeansBalanced        Use balanced K-Means clustering (default = 1)
+    --kmeansSample          Fit the centroids of each node on at most this many random labels,
+                            then assign all labels in a single pass, 0 to fit on all labels (default = 0)
+    --kmeansMaxIter         Maximum number of k-means iterations per node, 0 for no limit (default = 0)
+    --kmeansCentroidFeatures  Number of the largest weights kept in each k-means centroid, stored sparse,
+                            0 to keep all in a dense table (default = 0)
+    --kmeansStats           Log the cluster sizes and the k-means objective of every tree level,
+                            costs an extra scoring pass per node (default = 0)
 
     Prediction:
     --topK                  Predict top-k labels (default = 5)
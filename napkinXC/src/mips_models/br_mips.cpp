@@ -48,28 +48,21 @@ void BRMIPS::predict(std::vector<Prediction>& prediction, Feature* features, Arg
 
 void BRMIPS::load(Args& args, std::string infile) {
     Log(CERR) << "Loading weights ...\n";
-    bases = loadBases(joinPath(infile, "weights.bin"));
+    bases = loadBases(joinPath(infile, "weights.bin"), args.resume, args.loadAs, args.threads);
     m = bases.size();
 
     size_t dim = 0;
-    bool sparse = false;
-    for (int i = 0; i < m; ++i) {
-        if(bases[i]->getWSize() > dim)
-            dim = bases[i]->getWSize();
-        if(bases[i]->getMapW() != nullptr){
-            sparse = true;
-            break;
-        }
-    }
+    for (int i = 0; i < m; ++i)
+        if(bases[i]->getW() != nullptr && bases[i]->getW()->size() > dim)
+            dim = bases[i]->getW()->size();
 
     mipsIndex = new MIPSIndex(dim, !args.mipsDense, args);
     Log(CERR) << "Adding " << m << " points with " << dim << " dims to MIPSIndex ...\n";
     for (int i = 0; i < m; ++i) {
         printProgress(i, m);
-        if(!bases[i]->isDummy()) {
-            if (!bases[i]->getFirstClass()) bases[i]->invertWeights();
-            if(bases[i]->getMapW() != nullptr) mipsIndex->addPoint(bases[i]->getMapW(), i);
-            else mipsIndex->addPoint(bases[i]->getW(), dim, i);
+        if(!bases[i]->isDummy() && bases[i]->getW() != nullptr) {
+            if (!bases[i]->getFirstClass()) bases[i]->getW()->invert();
+            mipsIndex->addPoint(bases[i]->getW(), i);
         }
     }
 
@@ -20,135 +20,126 @@
  SOFTWARE.
  */
 
+#include <algorithm>
+#include <cmath>
+
 #include "mips_index.h"
 
-using namespace similarity;
+using namespace pecos::ann;
 
 MIPSIndex::MIPSIndex(int dim, bool sparse, Args& args) : dim(dim), sparse(sparse) {
-    int seed = 0;
-
-    // Init library, specify a log file
-    if (LOG_OPTION == 1) initLibrary(seed, LIB_LOGFILE, "logfile.txt");
-    // No logging
-    if (LOG_OPTION == 2) initLibrary(seed, LIB_LOGNONE, NULL);
-    // Use STDERR
-    if (LOG_OPTION == 3) initLibrary(seed, LIB_LOGSTDERR, NULL);
-
-    methodType = "hnsw";
-    AnyParams empty;
-    if(sparse) spaceType = "negdotprod_sparse_fast";
-    else spaceType = "negdotprod";
-
-    space = SpaceFactoryRegistry<DATA_T>::Instance().CreateSpace(spaceType, empty);
+    efSearch = args.hnswEfSearch;
 }
 
-MIPSIndex::~MIPSIndex() {
-    for (auto d : data) delete d;
-    data.clear();
-    delete space;
-    delete index;
-}
-
-void MIPSIndex::addPoint(Weight* pointData, int size, int label) {
-    assert(dim == size);
-    if(sparse){
-        std::vector<SparseVectElem < DATA_T>> input;
-        for (int i = 0; i < size; ++i)
-            if(pointData[i] != 0) input.push_back(SparseVectElem<DATA_T>(i, pointData[i]));
-        std::sort(input.begin(), input.end());
+MIPSIndex::~MIPSIndex() {}
 
-        auto sparseSpace = reinterpret_cast<const SpaceSparseVector<DATA_T> *>(space);
-        data.push_back(sparseSpace->CreateObjFromVect(label, -1, input));
-    } else {
-        std::vector<DATA_T> input(dim, 0);
-        for (int i = 0; i < size; ++i) input[i] = pointData[i];
-        auto denseSpace = reinterpret_cast<const VectorSpace<DATA_T> *>(space);
-        data.push_back(denseSpace->CreateObjFromVect(label, -1, input));
-    }
-}
-
-void MIPSIndex::addPoint(UnorderedMap<int, Weight>* pointData, int label) {
+void MIPSIndex::addPoint(AbstractVector<Weight>* pointData, int label) {
     if(sparse) {
-        std::vector<SparseVectElem < DATA_T>> input;
-        for (const auto &d : *pointData) input.push_back(SparseVectElem<DATA_T>(d.first, d.second));
-        std::sort(input.begin(), input.end());
-
-        auto sparseSpace = reinterpret_cast<const SpaceSparseVector<DATA_T> *>(space);
-        data.push_back(sparseSpace->CreateObjFromVect(label, -1, input));
+        std::vector<SparseEntry> input;
+        input.reserve(pointData->nonZero());
+        pointData->forEachID([&](const int& i, Weight& w) {
+            if(w != 0) input.push_back({static_cast<index_type>(i), w});
+        });
+        std::sort(input.begin(), input.end(), [](const SparseEntry& a, const SparseEntry& b) { return a.idx < b.idx; });
+        sparsePoints.push_back(std::move(input));
     } else {
-        std::vector<DATA_T> input(dim, 0);
-        for (const auto &d : *pointData)
-            if(d.first < dim) input[d.first] = d.second;
-
-        auto denseSpace = reinterpret_cast<const VectorSpace<DATA_T>*>(space);
-        data.push_back(denseSpace->CreateObjFromVect(label, -1, input));
+        std::vector<float> input(dim, 0);
+        pointData->forEachID([&](const int& i, Weight& w) {
+            if(i < dim) input[i] = w;
+        });
+        densePoints.push_back(std::move(input));
     }
+    labels.push_back(label);
 }
 
 void MIPSIndex::createIndex(Args& args) {
     Log(CERR) << "Creating MIPS index in " << args.threads << " threads ...\n";
 
-    AnyParams indexParams({
-        "post=2",
-        "delaunay_type=2",
-        "M=" + std::to_string(args.hnswM),
-        "efConstruction=" + std::to_string(args.hnswEfConstruction),
-        "indexThreadQty=" + std::to_string(args.threads),
-    });
+    size_t n = labels.size();
+    if (n == 0) return;
+
+    // Level l is reached by a node with probability M^-l, a couple of levels above log_M(n) is enough
+    int maxLevel = static_cast<int>(std::ceil(std::log(static_cast<double>(n)) / std::log(static_cast<double>(args.hnswM)))) + 2;
 
-    index = MethodFactoryRegistry<DATA_T>::Instance().CreateMethod(true, methodType, spaceType, *space, data);
-    index->CreateIndex(indexParams);
+    if(sparse) {
+        // Sparse points are kept at their own length in the feature arena of the index
+        std::vector<uint64_t> indptr(n + 1, 0);
+        for (size_t i = 0; i < n; ++i) indptr[i + 1] = indptr[i] + sparsePoints[i].size();
+        std::vector<index_type> indices(indptr[n]);
+        std::vector<float> values(indptr[n]);
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = 0; j < sparsePoints[i].size(); ++j) {
+                indices[indptr[i] + j] = sparsePoints[i][j].idx;
+                values[indptr[i] + j] = sparsePoints[i][j].val;
+            }
+        }
+        sparsePoints.clear();
+        sparsePoints.shrink_to_fit();
+
+        pecos::csr_t X;
+        X.rows = n;
+        X.cols = dim;
+        X.indptr = indptr.data();
+        X.indices = indices.data();
+        X.val = values.data();
+
+        space.reset(new SparseInnerProductSpace());
+        index.reset(new HNSW<float>(space.get(), n, dim, args.hnswM, args.hnswEfConstruction));
+        index->train(X, maxLevel, args.threads);
+    } else {
+        std::vector<float> buffer(n * dim, 0);
+        for (size_t i = 0; i < n; ++i)
+            std::copy(densePoints[i].begin(), densePoints[i].end(), &buffer[i * dim]);
+        densePoints.clear();
+        densePoints.shrink_to_fit();
+
+        pecos::drm_t X;
+        X.rows = n;
+        X.cols = dim;
+        X.val = buffer.data();
+
+        space.reset(new InnerProductSpace(dim));
+        index.reset(new HNSW<float>(space.get(), n, dim, args.hnswM, args.hnswEfConstruction));
+        index->train(X, maxLevel, args.threads);
+    }
+
+    // Neighbors stored next to each other make the graph walk of every query more cache friendly
+    index->reorder(REORDER_BFS);
 
     setEfSearch(args.hnswEfSearch);
 }
 
 void MIPSIndex::setEfSearch(int ef){
-    AnyParams QueryTimeParams({"efSearch=" + std::to_string(ef),});
-
-    // Setting query-time parameters
-    index->SetQueryTimeParams(QueryTimeParams);
     efSearch = ef;
 }
 
 std::priority_queue<Prediction> MIPSIndex::predict(Feature* data, int k) {
-    if(efSearch < k) setEfSearch(k);
-
     std::priority_queue<Prediction> result;
+    if (!index) return result;
 
-    Object* query;
+    std::vector<float> query;
     if(sparse) {
         // Sparse query
-        std::vector<SparseVectElem < DATA_T>> input;
+        std::vector<SparseEntry> input;
+        for (Feature *f = data; f->index != -1; ++f)
+            if(f->value != 0) input.push_back({static_cast<index_type>(f->index), static_cast<float>(f->value)});
+        std::sort(input.begin(), input.end(), [](const SparseEntry& a, const SparseEntry& b) { return a.idx < b.idx; });
 
-        Feature *f = data;
-        while (f->index != -1) {
-            input.push_back(SparseVectElem<DATA_T>(f->index, f->value));
-            ++f;
-        }
-        //std::sort(output.begin(), output.end());
-
-        auto sparse = reinterpret_cast<const SpaceSparseVector<DATA_T>*>(space);
-        query = sparse->CreateObjFromVect(0, -1, input);
+        query.resize(SparseInnerProductSpace::get_feat_mem_dim(input.size()));
+        SparseInnerProductSpace::encode(input.data(), input.size(), query.data());
     } else {
         // Dense query
-        std::vector<DATA_T> input(dim, 0);
-
-        Feature *f = data;
-        while (f->index != -1) {
-            input[f->index] = f->value;
-            ++f;
-        }
-
-        auto dense = reinterpret_cast<VectorSpace<DATA_T>*>(space);
-        query = dense->CreateObjFromVect(0, -1, input);
+        query.resize(dim, 0);
+        for (Feature *f = data; f->index != -1; ++f)
+            if(f->index < dim) query[f->index] = f->value;
     }
 
-    KNNQuery<DATA_T> knn(*space, query, k);
-    index->Search(&knn, -1);
-    auto knnResult = knn.Result()->Clone();
-    while (!knnResult->Empty()) {
-        result.push({knnResult->TopObject()->id(), -knnResult->TopDistance()});
-        knnResult->Pop();
+    auto topk = index->predict_single(query.data(), efSearch, k);
+
+    // HNSW distance of the inner product spaces is 1 - <w, x>
+    while (!topk.empty()) {
+        result.push({labels[topk.top().second], 1.0 - topk.top().first});
+        topk.pop();
     }
 
     return result;
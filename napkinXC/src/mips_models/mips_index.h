@@ -22,52 +22,41 @@
 
 #pragma once
 
-#include "index.h"
-#include "init.h"
-#include "knnquery.h"
-#include "knnqueue.h"
-#include "methodfactory.h"
-#include "params.h"
-#include "rangequery.h"
-#include "space.h"
-#include "space/space_sparse_vector.h"
-#include "space/space_vector.h"
-#include "spacefactory.h"
+#include <memory>
+#include <queue>
+#include <vector>
+
+#include "ann/hnsw.h"
 
 #include "args.h"
 #include "base.h"
 #include "model.h"
 
-#include <iostream>
-#include <vector>
-
-#define LOG_OPTION 2
-#define DATA_T float
-
-using namespace similarity;
-
+// Maximum inner product search over label weight vectors, backed by PECOS HNSW
 class MIPSIndex {
 public:
     MIPSIndex(int dim, bool sparse, Args& args);
     ~MIPSIndex();
 
-    void addPoint(Weight* pointData, int size, int label);
-    void addPoint(UnorderedMap<int, Weight>* pointData, int label);
+    void addPoint(AbstractVector<Weight>* pointData, int label);
     void createIndex(Args& args);
 
     void setEfSearch(int ef);
     std::priority_queue<Prediction> predict(Feature* data, int k);
 
-    inline size_t getSize() { return data.size(); }
+    inline size_t getSize() { return labels.size(); }
 
 protected:
     bool sparse;
     int dim;
-    std::string methodType;
-    std::string spaceType;
-    Space<DATA_T>* space;
-    Index<DATA_T>* index;
-    ObjectVector data;
+
+    // Points added before createIndex, dense rows or sorted (index, value) pairs
+    std::vector<std::vector<float>> densePoints;
+    std::vector<std::vector<pecos::ann::SparseEntry>> sparsePoints;
+    std::vector<int> labels; // Label of each HNSW node
+
+    std::unique_ptr<pecos::ann::DistanceBase<float>> space;
+    std::unique_ptr<pecos::ann::HNSW<float>> index;
 
     int efSearch;
 };
@@ -20,6 +20,7 @@
  SOFTWARE.
  */
 
+#include <algorithm>
 #include <fstream>
 #include <iomanip>
 #include <mutex>
@@ -272,10 +273,11 @@ void Model::trainBatchThread(std::vector<std::promise<Base *>>& results, std::ve
         results[i].set_value(trainBase(problemsData[i], args));
 }
 
-void Model::saveResults(std::ofstream& out, std::vector<std::future<Base*>>& results, bool saveGrads) {
+void Model::saveResults(std::ofstream& out, std::vector<std::future<Base*>>& results, bool saveGrads, BasesIndex* index) {
     for (int i = 0; i < results.size(); ++i) {
         printProgress(i, results.size());
         Base* base = results[i].get();
+        if(index != nullptr) index->add(out.tellp());
         base->save(out, saveGrads);
         delete base;
     }
@@ -285,11 +287,14 @@ void Model::trainBases(std::string outfile, std::vector<ProblemData>& problemsDa
     std::ofstream out(outfile);
     int size = problemsData.size();
     out.write((char*)&size, sizeof(size));
-    trainBases(out, problemsData, args);
+    BasesIndex index;
+    trainBases(out, problemsData, args, &index);
+    index.add(out.tellp());
     out.close();
+    index.saveFor(outfile);
 }
 
-void Model::trainBases(std::ofstream& out, std::vector<ProblemData>& problemsData, Args& args) {
+void Model::trainBases(std::ofstream& out, std::vector<ProblemData>& problemsData, Args& args, BasesIndex* index) {
 
     size_t size = problemsData.size(); // This "batch" size
     Log(CERR) << "Starting training " << size << " base estimators in " << args.threads << " threads ...\n";
@@ -316,19 +321,32 @@ void Model::trainBases(std::ofstream& out, std::vector<ProblemData>& problemsDat
         */
 
         // Saving in the main thread
-        saveResults(out, results, args.saveGrads);
+        saveResults(out, results, args.saveGrads, index);
         tSet.joinAll();
     } else {
         for (int i = 0; i < size; ++i){
             Base* base = new Base();
             base->train(problemsData[i], args);
+            if(index != nullptr) index->add(out.tellp());
             base->save(out, args.saveGrads);
             delete base;
         }
     }
 }
 
-std::vector<Base*> Model::loadBases(std::string infile, bool resume, RepresentationType loadAs) {
+void Model::loadBasesThread(std::vector<Base*>& bases, std::string infile, BasesIndex& index, bool resume,
+                            RepresentationType loadAs, const int startBase, const int stopBase) {
+    std::ifstream in(infile);
+    in.seekg(index.offsets[startBase]);
+    for (int i = startBase; i < stopBase; ++i) {
+        if (startBase == 0) printProgress(i, stopBase);
+        bases[i] = new Base();
+        bases[i]->load(in, resume, loadAs);
+    }
+    in.close();
+}
+
+std::vector<Base*> Model::loadBases(std::string infile, bool resume, RepresentationType loadAs, int threads) {
     Log(CERR) << "Loading base estimators ...\n";
 
     double nonZeroSum = 0;
@@ -339,18 +357,43 @@ std::vector<Base*> Model::loadBases(std::string infile, bool resume, Representat
     std::ifstream in(infile);
     int size;
     in.read((char*)&size, sizeof(size));
-    bases.reserve(size);
-    for (int i = 0; i < size; ++i) {
-        printProgress(i, size);
-        auto b = new Base();
-        b->load(in, resume, loadAs);
 
+    BasesIndex index;
+    if (threads > 1 && size > 1 && index.loadFor(infile)) {
+        // Split the file into ranges of similar byte size, every thread reads its own range
+        in.close();
+        bases.resize(size);
+        threads = std::min(threads, size);
+        unsigned long long begin = index.offsets.front();
+        unsigned long long bytesPerThread = (index.offsets.back() - begin) / threads + 1;
+
+        ThreadSet tSet;
+        int startBase = 0;
+        for (int t = 0; t < threads && startBase < size; ++t) {
+            int stopBase = std::lower_bound(index.offsets.begin() + startBase, index.offsets.end() - 1,
+                                            begin + (t + 1) * bytesPerThread) - index.offsets.begin();
+            if (t == threads - 1) stopBase = size;
+            if (stopBase <= startBase) continue;
+            tSet.add(loadBasesThread, std::ref(bases), infile, std::ref(index), resume, loadAs, startBase, stopBase);
+            startBase = stopBase;
+        }
+        tSet.joinAll();
+    } else {
+        bases.reserve(size);
+        for (int i = 0; i < size; ++i) {
+            printProgress(i, size);
+            auto b = new Base();
+            b->load(in, resume, loadAs);
+            bases.push_back(b);
+        }
+        in.close();
+    }
+
+    for (auto b : bases) {
         if(b->getW() != nullptr) nonZeroSum += b->getW()->nonZero();
         memSize += b->mem();
         if(b->getType() != dense) ++sparse;
-        bases.push_back(b);
     }
-    in.close();
 
     Log(CERR) << "  Loaded bases: " << size
               << "\n  Bases size: " << formatMem(memSize) << "\n  Non zero weights / bases: " << nonZeroSum / size
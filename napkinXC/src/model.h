@@ -72,15 +72,18 @@ public:
     static Base* trainBase(ProblemData& problemsData, Args& args);
     static void trainBatchThread(std::vector<std::promise<Base *>>& results, std::vector<ProblemData>& problemsData, Args& args, int threadId, int threads);
     static void trainBases(std::string outfile, std::vector<ProblemData>& problemsData, Args& args);
-    static void trainBases(std::ofstream& out, std::vector<ProblemData>& problemsData, Args& args);
+    static void trainBases(std::ofstream& out, std::vector<ProblemData>& problemsData, Args& args, BasesIndex* index=nullptr);
 
-    static void saveResults(std::ofstream& out, std::vector<std::future<Base*>>& results, bool saveGrads=false);
-    static std::vector<Base*> loadBases(std::string infile, bool resume=false, RepresentationType loadAs=map);
+    static void saveResults(std::ofstream& out, std::vector<std::future<Base*>>& results, bool saveGrads=false, BasesIndex* index=nullptr);
+    static std::vector<Base*> loadBases(std::string infile, bool resume=false, RepresentationType loadAs=map, int threads=1);
 
 private:
     static void predictBatchThread(int threadId, Model* model, std::vector<std::vector<Prediction>>& predictions,
                                    SRMatrix<Feature>& features, Args& args, const int startRow, const int stopRow);
 
+    static void loadBasesThread(std::vector<Base*>& bases, std::string infile, BasesIndex& index, bool resume,
+                                RepresentationType loadAs, const int startBase, const int stopBase);
+
     static void macroOfoThread(int threadId, Model* model, std::vector<double>& as, std::vector<double>& bs,
                                SRMatrix<Feature>& features, SRMatrix<Label>& labels, Args& args,
                                const int startRow, const int stopRow);
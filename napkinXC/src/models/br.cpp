@@ -76,6 +76,7 @@ void BR::train(SRMatrix<Label>& labels, SRMatrix<Feature>& features, Args& args,
 
     std::ofstream out(joinPath(output, "weights.bin"));
     saveVar(out, lCols);
+    BasesIndex index;
 
     for (int p = 0; p < parts; ++p) {
         int rStart = p * range;
@@ -101,7 +102,7 @@ void BR::train(SRMatrix<Label>& labels, SRMatrix<Feature>& features, Args& args,
             for (int i = 0; i < range; ++i) binProblemData[i].invPs = labelsWeights[i + rStart];
         }
 
-        trainBases(out, binProblemData, args);
+        trainBases(out, binProblemData, args, &index);
 
         for (auto& l : binLabels) l.clear();
         binFeatures.clear();
@@ -109,7 +110,9 @@ void BR::train(SRMatrix<Label>& labels, SRMatrix<Feature>& features, Args& args,
         binProblemData.clear();
     }
 
+    index.add(out.tellp());
     out.close();
+    index.saveFor(joinPath(output, "weights.bin"));
 }
 
 void BR::predict(std::vector<Prediction>& prediction, Feature* features, Args& args) {
@@ -151,7 +154,7 @@ double BR::predictForLabel(Label label, Feature* features, Args& args) {
 
 void BR::load(Args& args, std::string infile) {
     Log(CERR) << "Loading weights ...\n";
-    bases = loadBases(joinPath(infile, "weights.bin"), args.resume, args.loadAs);
+    bases = loadBases(joinPath(infile, "weights.bin"), args.resume, args.loadAs, args.threads);
     m = bases.size();
 
     loaded = true;
@@ -21,122 +21,394 @@
  */
 
 #include <algorithm>
+#include <cassert>
 #include <climits>
 #include <cmath>
+#include <numeric>
 #include <random>
 
 #include "kmeans.h"
 #include "misc.h"
 
-// K-Means clustering with balanced option
-// Partition is returned via reference, calculated for cosine distance
-void kmeans(std::vector<Assignation>* partition, SRMatrix<Feature>& pointsFeatures, int centroids, double eps,
-            bool balanced, int seed) {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define KMEANS_AVX2
+#endif
 
-    int points = partition->size();
-    int features = pointsFeatures.cols();
+// Similarities of a sparse point to all centroids, weights holds the weights of the centroids interleaved by feature
+static void dotCentroids(const Feature* point, const double* weights, int centroids, double* similarities) {
+    for (int c = 0; c < centroids; ++c) similarities[c] = 0;
+    for (const Feature* f = point; f->index != -1; ++f) {
+        const double* w = weights + static_cast<size_t>(f->index) * centroids;
+        for (int c = 0; c < centroids; ++c) similarities[c] += f->value * w[c];
+    }
+}
 
-    // if(balanced) Log(CERR) << "Balanced K-Means ...\n  Partition: " << partition->size() << ", centroids: " <<
-    // centroids << "\n";
-    // else Log(CERR) << "K-Means ...\n  Partition: " << partition->size() << ", centroids: " << centroids << "\n";
+#ifdef KMEANS_AVX2
+// Same as dotCentroids, 4 (or 2) centroids at once
+__attribute__((target("avx2,fma"))) static void dotCentroidsAvx2(const Feature* point, const double* weights,
+                                                                  int centroids, double* similarities) {
+    int c = 0;
+    for (; c + 4 <= centroids; c += 4) {
+        __m256d sum = _mm256_setzero_pd();
+        for (const Feature* f = point; f->index != -1; ++f) {
+            __m256d w = _mm256_loadu_pd(weights + static_cast<size_t>(f->index) * centroids + c);
+            sum = _mm256_fmadd_pd(_mm256_set1_pd(f->value), w, sum);
+        }
+        _mm256_storeu_pd(similarities + c, sum);
+    }
+    for (; c + 2 <= centroids; c += 2) {
+        __m128d sum = _mm_setzero_pd();
+        for (const Feature* f = point; f->index != -1; ++f) {
+            __m128d w = _mm_loadu_pd(weights + static_cast<size_t>(f->index) * centroids + c);
+            sum = _mm_fmadd_pd(_mm_set1_pd(f->value), w, sum);
+        }
+        _mm_storeu_pd(similarities + c, sum);
+    }
+    for (; c < centroids; ++c) {
+        double val = 0;
+        for (const Feature* f = point; f->index != -1; ++f)
+            val += f->value * weights[static_cast<size_t>(f->index) * centroids + c];
+        similarities[c] = val;
+    }
+}
+#endif
 
-    int maxPartitionSize = points - centroids, maxWithOneMore = 0;
-    if (balanced) {
-        maxPartitionSize = points / centroids;
-        maxWithOneMore = points % centroids;
-        assert(centroids * maxPartitionSize + maxWithOneMore == partition->size());
+typedef void (*DotCentroidsFn)(const Feature* point, const double* weights, int centroids, double* similarities);
+
+static DotCentroidsFn getDotCentroidsFn() {
+#ifdef KMEANS_AVX2
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return dotCentroidsAvx2;
+#endif
+    return dotCentroids;
+}
+
+// Centroids stored by feature, weights[feature * centroids + centroid]. Only the rows of the features in used are
+// non-zero and only they are reset, so the table is allocated once per thread and not for every clustered node.
+struct CentroidsTable {
+    std::vector<double> weights;
+    std::vector<char> touched;
+    std::vector<int> used;
+    int centroids = 0;
+
+    void resize(int features, int newCentroids) {
+        clear();
+        centroids = newCentroids;
+        size_t size = static_cast<size_t>(features) * centroids;
+        if (weights.size() < size) weights.resize(size, 0);
+        if (touched.size() < static_cast<size_t>(features)) touched.resize(features, 0);
     }
 
-    // Init centroids
-    std::vector<std::vector<double>> centroidsFeatures(centroids);
+    inline double* row(int feature) { return weights.data() + static_cast<size_t>(feature) * centroids; }
 
-    std::default_random_engine rng(seed);
-    std::uniform_int_distribution<int> dist(0, points);
-    for (int i = 0; i < centroids; ++i) {
-        centroidsFeatures[i].resize(features, 0);
-        setVector(pointsFeatures[dist(rng)], centroidsFeatures[i]);
+    void add(const Feature* point, int centroid) {
+        for (const Feature* f = point; f->index != -1; ++f) {
+            if (!touched[f->index]) {
+                touched[f->index] = 1;
+                used.push_back(f->index);
+            }
+            row(f->index)[centroid] += f->value;
+        }
     }
 
-    double oldCos = INT_MIN, newCos = -1;
+    void finish() {}
 
-    std::vector<Similarities> similarities(points);
-    for (int i = 0; i < points; ++i)
-        similarities[i].values.resize(centroids);
+    inline void score(const Feature* point, double* similarities) {
+        static const DotCentroidsFn dot = getDotCentroidsFn();
+        dot(point, weights.data(), centroids, similarities);
+    }
 
-    while (newCos - oldCos >= eps) {
+    void clear() {
+        // Resetting the whole table is faster than resetting most of its rows one by one. The table may have been
+        // grown for fewer features with more centroids than the current ones, so the reset is capped at its size.
+        if (used.size() > touched.size() / 4) {
+            size_t size = std::min(weights.size(), touched.size() * centroids);
+            std::fill(weights.begin(), weights.begin() + size, 0);
+            std::fill(touched.begin(), touched.end(), 0);
+        } else {
+            for (int i : used) {
+                std::fill(row(i), row(i) + centroids, 0);
+                touched[i] = 0;
+            }
+        }
+        used.clear();
+    }
+};
 
-        oldCos = newCos;
-        newCos = 0;
+// Centroids that keep only their maxFeatures weights of the largest magnitude. They are interleaved like in
+// CentroidsTable, but with rows only for the features kept by any centroid, so the table has at most
+// maxFeatures x centroids rows. The sums are built one centroid at a time in a single dense column, memory does
+// not grow with features x centroids.
+struct SparseCentroidsTable {
+    std::vector<double> weights; // used.size() x centroids
+    std::vector<int> rowOf;      // Row of every feature, -1 if no centroid keeps it
+    std::vector<int> used;       // Features with a row
+    std::vector<std::vector<const Feature*>> members; // Points added to every centroid since the last clear
+    std::vector<double> sum;     // Sum of the centroid being built
+    std::vector<int> sumUsed;
+    std::vector<Feature> kept;
+    int centroids = 0;
+    int maxFeatures = 0;
 
-        if(centroids == 2){ // Faster version for 2-means
+    void resize(int features, int newCentroids, int newMaxFeatures) {
+        clear();
+        centroids = newCentroids;
+        maxFeatures = newMaxFeatures;
+        if (rowOf.size() < static_cast<size_t>(features)) {
+            rowOf.resize(features, -1);
+            sum.resize(features, 0);
+        }
+        members.resize(centroids);
+    }
 
-            // Calculate similarity to centroids
-            for (int i = 0; i < points; ++i) {
-                similarities[i].index = i;
-                for (int j = 0; j < centroids; ++j) {
-                    similarities[i].values[j].index = j;
-                    similarities[i].values[j].value = dotVectors(pointsFeatures[(*partition)[i].index], centroidsFeatures[j]);
+    inline double* row(int feature) { return weights.data() + static_cast<size_t>(rowOf[feature]) * centroids; }
+
+    void add(const Feature* point, int centroid) { members[centroid].push_back(point); }
+
+    // Sums the points of every centroid and keeps the maxFeatures weights of the largest magnitude
+    void finish() {
+        for (int c = 0; c < centroids; ++c) {
+            for (const Feature* point : members[c]) {
+                for (const Feature* f = point; f->index != -1; ++f) {
+                    if (sum[f->index] == 0) sumUsed.push_back(f->index); // Repeated if a sum returns to 0
+                    sum[f->index] += f->value;
                 }
-                similarities[i].sortby = similarities[i].values[0].value - similarities[i].values[1].value;
             }
+            members[c].clear();
 
-            // Assign points to centroids and calculate new loss
-            std::sort(similarities.begin(), similarities.end());
-
-            for (int i = 0; i < points; ++i) {
-                int cIndex;
-                if(balanced) cIndex = (i < maxPartitionSize) ? 1 : 0; // If balanced
-                else cIndex = (similarities[i].sortby <= 0) ? 1 : 0;
-                (*partition)[similarities[i].index].value = cIndex;
-                newCos += similarities[i].values[cIndex].value;
+            kept.clear();
+            for (int i : sumUsed) {
+                if (sum[i] != 0) kept.push_back({i, sum[i]});
+                sum[i] = 0;
+            }
+            sumUsed.clear();
+            if (kept.size() > static_cast<size_t>(maxFeatures)) {
+                std::nth_element(kept.begin(), kept.begin() + maxFeatures, kept.end(),
+                                 [](const Feature& a, const Feature& b) { return std::fabs(a.value) > std::fabs(b.value); });
+                kept.resize(maxFeatures);
             }
-        } else {
-            std::vector<int> centroidsSizes(centroids, 0);
 
-            for (int i = 0; i < points; ++i) {
-                similarities[i].index = i;
-                for (int j = 0; j < centroids; ++j) {
-                    similarities[i].values[j].index = j;
-                    similarities[i].values[j].value = dotVectors(pointsFeatures[(*partition)[i].index], centroidsFeatures[j]);
+            for (const auto& w : kept) {
+                if (rowOf[w.index] < 0) {
+                    rowOf[w.index] = used.size();
+                    used.push_back(w.index);
+                    weights.resize(weights.size() + centroids, 0);
                 }
-
-                std::sort(similarities[i].values.begin(), similarities[i].values.end(),
-                        [](const Feature& a, const Feature& b) -> bool
-                    {
-                        return a.value > b.value;
-                    });
-                similarities[i].sortby = similarities[i].values[0].value;
+                row(w.index)[c] = w.value;
             }
+        }
+    }
+
+    void clear() {
+        for (int i : used) rowOf[i] = -1;
+        used.clear();
+        weights.clear();
+        for (auto& m : members) m.clear();
+    }
+
+    inline void score(const Feature* point, double* similarities) {
+        for (int c = 0; c < centroids; ++c) similarities[c] = 0;
+        for (const Feature* f = point; f->index != -1; ++f) {
+            if (rowOf[f->index] < 0) continue;
+            const double* w = row(f->index);
+            for (int c = 0; c < centroids; ++c) similarities[c] += f->value * w[c];
+        }
+    }
+};
+
+// Sets each centroid to the (not normalized) sum of its points
+template <typename Table>
+static void updateCentroids(Table& table, std::vector<Assignation>& partition, SRMatrix<Feature>& pointsFeatures) {
+    table.clear();
+    for (auto& p : partition) table.add(pointsFeatures[p.index], p.value);
+    table.finish();
+}
+
+// Fills similarities (points x centroids), each point is read once for all the centroids
+template <typename Table>
+static void computeSimilarities(std::vector<double>& similarities, std::vector<Assignation>& partition,
+                                SRMatrix<Feature>& pointsFeatures, Table& table) {
+    int points = partition.size();
+    int centroids = table.centroids;
+    similarities.resize(static_cast<size_t>(points) * centroids);
 
-            // Assign points to centroids and calculate new loss
-            std::sort(similarities.rbegin(), similarities.rend());
+    for (int i = 0; i < points; ++i)
+        table.score(pointsFeatures[partition[i].index], similarities.data() + i * centroids);
+}
 
+// Assigns every point of the partition to one of the centroids, returns the average cosine similarity
+static double assignPoints(std::vector<Assignation>& partition, std::vector<double>& similarities, int centroids,
+                           bool balanced) {
+    int points = partition.size();
+
+    int maxPartitionSize = points - centroids, maxWithOneMore = 0;
+    if (balanced) {
+        maxPartitionSize = points / centroids;
+        maxWithOneMore = points % centroids;
+        assert(centroids * maxPartitionSize + maxWithOneMore == points);
+    }
+
+    double newCos = 0;
+
+    if(centroids == 2){ // Faster version for 2-means
+        // The points closest to the second centroid relative to the first one go to it
+        auto diff = [&](int i) { return similarities[2 * i] - similarities[2 * i + 1]; };
+
+        if (balanced) {
+            // Only the first maxPartitionSize points by difference need to be separated from the rest
+            std::vector<int> order(points);
+            std::iota(order.begin(), order.end(), 0);
+            std::nth_element(order.begin(), order.begin() + maxPartitionSize, order.end(),
+                             [&](int a, int b) { return diff(a) < diff(b) || (diff(a) == diff(b) && a < b); });
+            for (int r = 0; r < points; ++r) {
+                int i = order[r];
+                int cIndex = (r < maxPartitionSize) ? 1 : 0;
+                partition[i].value = cIndex;
+                newCos += similarities[2 * i + cIndex];
+            }
+        } else {
             for (int i = 0; i < points; ++i) {
-                for (int j = 0; j < centroids; ++j) {
-                    int cIndex = similarities[i].values[j].index;
-                    int lIndex = similarities[i].index;
+                int cIndex = (diff(i) <= 0) ? 1 : 0;
+                partition[i].value = cIndex;
+                newCos += similarities[2 * i + cIndex];
+            }
+        }
+    } else {
+        std::vector<int> centroidsSizes(centroids, 0);
 
-                    if (centroidsSizes[cIndex] < maxPartitionSize ||
-                        (centroidsSizes[cIndex] < maxPartitionSize + 1 && maxWithOneMore > 0)) {
+        // Centroids of every point from the most similar one, points by their best similarity
+        std::vector<int> order(points * centroids), pointsOrder(points);
+        for (int i = 0; i < points; ++i) {
+            int* o = order.data() + i * centroids;
+            double* sim = similarities.data() + i * centroids;
+            std::iota(o, o + centroids, 0);
+            std::sort(o, o + centroids, [&](int a, int b) { return sim[a] > sim[b]; });
+        }
+        auto best = [&](int i) { return similarities[i * centroids + order[i * centroids]]; };
+        std::iota(pointsOrder.begin(), pointsOrder.end(), 0);
+        std::sort(pointsOrder.begin(), pointsOrder.end(), [&](int a, int b) { return best(a) > best(b); });
+
+        // Assign points to centroids and calculate new loss
+        for (int i : pointsOrder) {
+            for (int j = 0; j < centroids; ++j) {
+                int cIndex = order[i * centroids + j];
 
-                        if (centroidsSizes[cIndex] == maxPartitionSize) --maxWithOneMore;
+                if (centroidsSizes[cIndex] < maxPartitionSize ||
+                    (centroidsSizes[cIndex] < maxPartitionSize + 1 && maxWithOneMore > 0)) {
 
-                        (*partition)[lIndex].value = cIndex;
-                        ++centroidsSizes[cIndex];
-                        newCos += similarities[i].values[j].value;
-                        break;
-                    }
+                    if (centroidsSizes[cIndex] == maxPartitionSize) --maxWithOneMore;
+
+                    partition[i].value = cIndex;
+                    ++centroidsSizes[cIndex];
+                    newCos += similarities[i * centroids + cIndex];
+                    break;
                 }
             }
         }
+    }
+
+    return newCos / points;
+}
+
+// Mean similarity of the points to their centroids, divided by the centroid norms (points are unit vectors)
+template <typename Table>
+static double meanCosine(std::vector<Assignation>& partition, std::vector<double>& similarities, Table& table) {
+    int centroids = table.centroids;
+    std::vector<double> norms(centroids, 0);
+    for (int i : table.used) {
+        double* w = table.row(i);
+        for (int c = 0; c < centroids; ++c) norms[c] += w[c] * w[c];
+    }
+    for (auto& n : norms) n = std::sqrt(n);
+
+    double sum = 0;
+    for (size_t i = 0; i < partition.size(); ++i) {
+        int c = partition[i].value;
+        if (norms[c] > 0) sum += similarities[i * centroids + c] / norms[c];
+    }
+    return partition.empty() ? 0 : sum / partition.size();
+}
 
-        newCos /= points;
+template <typename Table>
+static void fitKmeans(Table& table, std::vector<Assignation>* partition, SRMatrix<Feature>& pointsFeatures,
+                      int centroids, double eps, bool balanced, int seed, int sampleSize, int maxIter,
+                      KMeansObjective* objective) {
+
+    int points = partition->size();
+    std::default_random_engine rng(seed);
+
+    // Centroids are fitted on a random sample of the points, all points are then assigned in a single pass
+    std::vector<Assignation> sample;
+    std::vector<Assignation>* fitPartition = partition;
+    if (sampleSize > 0 && sampleSize >= centroids && sampleSize < points) {
+        sample = *partition;
+        for (int i = 0; i < sampleSize; ++i) {
+            std::uniform_int_distribution<int> pick(i, points - 1);
+            std::swap(sample[i], sample[pick(rng)]);
+        }
+        sample.resize(sampleSize);
+        fitPartition = &sample;
+    }
+
+    // Init centroids
+    std::uniform_int_distribution<int> dist(0, fitPartition->size() - 1);
+    for (int i = 0; i < centroids; ++i) table.add(pointsFeatures[(*fitPartition)[dist(rng)].index], i);
+    table.finish();
+
+    double oldCos = INT_MIN, newCos = -1;
+    std::vector<double> similarities;
+
+    for (int iter = 0; newCos - oldCos >= eps && (maxIter <= 0 || iter < maxIter); ++iter) {
+        oldCos = newCos;
+        computeSimilarities(similarities, *fitPartition, pointsFeatures, table);
+        newCos = assignPoints(*fitPartition, similarities, centroids, balanced);
 
         // Update centroids
-        for (auto& c : centroidsFeatures) std::fill(c.begin(), c.end(), 0);
-        for (auto& p : (*partition)) addVector(pointsFeatures[p.index], centroidsFeatures[p.value]);
-        for (auto& c : centroidsFeatures) unitNorm(c);
+        updateCentroids(table, *fitPartition, pointsFeatures);
+    }
+
+    // Objective of the fitted clusters
+    if (objective) {
+        objective->fitPoints = fitPartition->size();
+        computeSimilarities(similarities, *fitPartition, pointsFeatures, table);
+        objective->fit = meanCosine(*fitPartition, similarities, table);
+        objective->full = objective->fit;
+    }
+
+    if (fitPartition != partition) {
+        computeSimilarities(similarities, *partition, pointsFeatures, table);
+        assignPoints(*partition, similarities, centroids, balanced);
+
+        // Objective of the clusters of all points
+        if (objective) {
+            updateCentroids(table, *partition, pointsFeatures);
+            computeSimilarities(similarities, *partition, pointsFeatures, table);
+            objective->full = meanCosine(*partition, similarities, table);
+        }
     }
 
     //Log(CERR) << Final similarity: << newCos << "\n";
 }
+
+// K-Means clustering with balanced option
+// Partition is returned via reference, calculated for cosine distance
+void kmeans(std::vector<Assignation>* partition, SRMatrix<Feature>& pointsFeatures, int centroids, double eps,
+            bool balanced, int seed, int sampleSize, int maxIter, int centroidFeatures, KMeansObjective* objective) {
+
+    int features = pointsFeatures.cols();
+
+    // if(balanced) Log(CERR) << "Balanced K-Means ...\n  Partition: " << partition->size() << ", centroids: " <<
+    // centroids << "\n";
+    // else Log(CERR) << "K-Means ...\n  Partition: " << partition->size() << ", centroids: " << centroids << "\n";
+
+    // Tables are kept by the thread for the next nodes it clusters
+    if (centroidFeatures > 0) {
+        static thread_local SparseCentroidsTable table;
+        table.resize(features, centroids, centroidFeatures);
+        fitKmeans(table, partition, pointsFeatures, centroids, eps, balanced, seed, sampleSize, maxIter, objective);
+    } else {
+        static thread_local CentroidsTable table;
+        table.resize(features, centroids);
+        fitKmeans(table, partition, pointsFeatures, centroids, eps, balanced, seed, sampleSize, maxIter, objective);
+    }
+}
@@ -30,14 +30,18 @@
 // K-Means clustering with balanced option
 typedef IntFeature Assignation;
 
-struct Similarities {
-    int index;
-    std::vector<Feature> values;
-    double sortby;
-
-    bool operator<(const Similarities& r) const { return sortby < r.sortby; }
+// Mean cosine similarity of points to the centroids of their clusters
+struct KMeansObjective {
+    double fit = 0;  // Of the points the centroids were fitted on
+    double full = 0; // Of all the points after the final assignment, equal to fit without sampling
+    int fitPoints = 0;
 };
 
-// Partition is returned via reference, calculated for cosine distance
+// Partition is returned via reference, calculated for cosine distance.
+// If 0 < sampleSize < partition size, centroids are fitted on sampleSize random points and all points are
+// assigned once at the end. maxIter > 0 limits the number of iterations.
+// centroidFeatures > 0 keeps only that many weights of the largest magnitude in each centroid, stored sparse.
+// If objective is given, it is filled at the cost of an extra scoring pass (two with sampling).
 void kmeans(std::vector<Assignation>* partition, SRMatrix<Feature>& pointsFeatures, int centroids, double eps,
-            bool balanced, int seed);
+            bool balanced, int seed, int sampleSize = 0, int maxIter = 0, int centroidFeatures = 0,
+            KMeansObjective* objective = nullptr);
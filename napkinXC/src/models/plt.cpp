@@ -22,9 +22,12 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <climits>
 #include <cmath>
+#include <ctime>
 #include <list>
+#include <sstream>
 #include <vector>
 
 #include "plt.h"
@@ -32,11 +35,13 @@
 
 PLT::PLT() {
     tree = nullptr;
+    lazyBases = nullptr;
     treeSize = 0;
     treeDepth = 0;
     nodeEvaluationCount = 0;
     nodeUpdateCount = 0;
     dataPointCount = 0;
+    collectLevelStats = false;
     type = plt;
     name = "PLT";
 }
@@ -45,6 +50,8 @@ void PLT::unload() {
     for (auto b : bases) delete b;
     bases.clear();
     bases.shrink_to_fit();
+    delete lazyBases;
+    lazyBases = nullptr;
     delete tree;
 }
 
@@ -141,9 +148,26 @@ std::vector<std::vector<Prediction>> PLT::predictWithBeamSearch(SRMatrix<Feature
     for(int i = 0; i < rows; ++i) nodePredictions[tree->root->index].emplace_back(i, 1.0);
 
     int nCount = 0;
+    int level = 0;
     while(!nextLevelQueue->empty()){
         printProgress(nCount++, nodes);
 
+        PLTLevelStats* stats = nullptr;
+        PerfCounterSnapshot countersStart;
+        std::chrono::steady_clock::time_point wallStart;
+        std::clock_t cpuStart = 0;
+        if(collectLevelStats){
+            if(levelStats.size() <= static_cast<size_t>(level)) levelStats.resize(level + 1);
+            stats = &levelStats[level];
+            stats->level = level;
+            stats->rows += rows;
+
+            // Clocks and counters are read only when level stats were requested
+            if(levelCounters != nullptr) levelCounters->read(countersStart);
+            wallStart = std::chrono::steady_clock::now();
+            cpuStart = std::clock();
+        }
+
         auto levelQueue = nextLevelQueue;
         nextLevelQueue = new std::queue<TreeNode*>();
 
@@ -157,14 +181,17 @@ std::vector<std::vector<Prediction>> PLT::predictWithBeamSearch(SRMatrix<Feature
 
             if(!nodePredictions[nIdx].empty()){
                 //std::cerr << "from initial base\n";
-                auto base = bases[nIdx];
+                std::shared_ptr<Base> lazyBase; // Keeps lazy loaded base alive while it is used
+                if(lazyBases != nullptr) lazyBase = lazyBases->get(nIdx);
+                auto base = (lazyBase != nullptr) ? lazyBase.get() : bases[nIdx];
                 auto type = base->getType();
-                if(type == sparse) 
+                // Lazy loaded bases are shared by the cache and keep the representation they were loaded with
+                if(type == sparse && lazyBase == nullptr)
 					base->to(dense);
 
                 for(auto &e : nodePredictions[nIdx]){
                     int rIdx = e.label;
-                    double prob = bases[nIdx]->predictProbability(features[rIdx]) * e.value;
+                    double prob = base->predictProbability(features[rIdx]) * e.value;
                     double value = prob;
 
                     // Reweight score
@@ -175,6 +202,11 @@ std::vector<std::vector<Prediction>> PLT::predictWithBeamSearch(SRMatrix<Feature
                     else levelPredictions[rIdx].emplace_back(n, prob, value); // Internal node prediction
                 }
                 nodeEvaluationCount += nodePredictions[nIdx].size();
+                if(stats != nullptr){
+                    ++stats->nodesEvaluated;
+                    stats->estimatorsEvaluated += nodePredictions[nIdx].size();
+                    for(auto &e : nodePredictions[nIdx]) stats->featuresTouched += features.size(e.label);
+                }
                 nodePredictions[nIdx].clear();
 
                 //std::cerr << "back to initial base\n";
@@ -210,11 +242,23 @@ std::vector<std::vector<Prediction>> PLT::predictWithBeamSearch(SRMatrix<Feature
                 else v.resize(std::min(v.size(), (size_t)args.beamSearchWidth));
             }
 
+            if(stats != nullptr) stats->beamSize += v.size();
             for(auto &nv : v)
                 for(auto &c : nv.node->children)
                     nodePredictions[c->index].emplace_back(rIdx, nv.prob);
             v.clear();
         }
+
+        if(stats != nullptr){
+            stats->wallTimeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wallStart).count();
+            stats->cpuTimeMs += 1000.0 * (std::clock() - cpuStart) / CLOCKS_PER_SEC;
+            if(levelCounters != nullptr){
+                PerfCounterSnapshot countersStop;
+                levelCounters->read(countersStop);
+                stats->counters += levelCounters->delta(countersStart, countersStop);
+            }
+        }
+        ++level;
     }
     delete nextLevelQueue;
 
@@ -227,6 +271,51 @@ std::vector<std::vector<Prediction>> PLT::predictWithBeamSearch(SRMatrix<Feature
     return prediction;
 }
 
+void PLT::predictWithBeamSearch(std::vector<Prediction>& prediction, Feature* features, Args& args){
+    std::vector<TreeNodeValue> level = {{tree->root, 1.0, 1.0}};
+    std::vector<TreeNodeValue> nextLevel;
+
+    while(!level.empty()){
+        nextLevel.clear();
+        for(auto &nv : level){
+            double prob = predictForNode(nv.node, features) * nv.prob;
+            double value = prob;
+            if (!labelsWeights.empty()) value *= nodesWeights[nv.node->index].weight;
+
+            if(nv.node->label >= 0) prediction.emplace_back(nv.node->label, value); // Final prediction
+            else nextLevel.emplace_back(nv.node, prob, value); // Internal node prediction
+        }
+
+        // Keep top internal nodes, as the batch version does for each data point
+        if(!thresholds.empty()){
+            size_t j = 0;
+            for(size_t i = 0; i < nextLevel.size(); ++i){
+                if(nextLevel[i].value > nodesThr[nextLevel[i].node->index].th)
+                    nextLevel[j++] = nextLevel[i];
+            }
+            nextLevel.resize(j);
+        }
+        else {
+            std::sort(nextLevel.rbegin(), nextLevel.rend());
+
+            if(args.threshold > 0){
+                size_t i = 0;
+                while (i < nextLevel.size() && nextLevel[i].value > args.threshold) ++i;
+                nextLevel.resize(i);
+            }
+            else nextLevel.resize(std::min(nextLevel.size(), (size_t)args.beamSearchWidth));
+        }
+
+        level.clear();
+        for(auto &nv : nextLevel)
+            for(auto &c : nv.node->children)
+                level.emplace_back(c, nv.prob, nv.prob);
+    }
+
+    std::sort(prediction.rbegin(), prediction.rend());
+    if(args.topK > 0 && prediction.size() > static_cast<size_t>(args.topK)) prediction.resize(args.topK);
+}
+
 void PLT::predict(std::vector<Prediction>& prediction, Feature* features, Args& args) {
     int topK = args.topK;
     double threshold = args.threshold;
@@ -367,7 +456,8 @@ double PLT::predictForLabel(Label label, Feature* features, Args& args) {
     auto fn = tree->leaves.find(label);
     if(fn == tree->leaves.end()) return 0;
     TreeNode* n = fn->second;
-    double value = bases[n->index]->predictProbability(features);
+    double value = (lazyBases != nullptr) ? lazyBases->predictProbability(n->index, features)
+                                          : bases[n->index]->predictProbability(features);
     while (n->parent) {
         n = n->parent;
         value *= predictForNode(n, features);
@@ -385,9 +475,27 @@ void PLT::load(Args& args, std::string infile) {
 
     tree = new Tree();
     tree->loadFromFile(joinPath(infile, "tree.bin"));
-    bases = loadBases(joinPath(infile, "weights.bin"), args.resume, args.loadAs);
 
-    assert(bases.size() == tree->nodes.size());
+    // Only plain PLT goes through predictForNode for every base, other PLT variants access bases directly
+    std::string weightsFile = joinPath(infile, "weights.bin");
+    BasesIndex index;
+    if (args.lazyLoad && type == plt && index.loadFor(weightsFile)) {
+        Log(CERR) << "Lazy loading base estimators, pinning " << args.lazyPinnedDepth << " upper levels of the tree ...\n";
+        lazyBases = new LazyBases(weightsFile, index, args.lazyCacheMem, args.loadAs);
+        for (auto& n : tree->nodes)
+            if (tree->getNodeDepth(n) <= args.lazyPinnedDepth) lazyBases->pin(n->index);
+        assert(lazyBases->size() == tree->nodes.size());
+        if (lazyBases->pinnedMem() > args.lazyCacheMem)
+            Log(CERR) << "Warning: Pinned base estimators take " << formatMem(lazyBases->pinnedMem())
+                      << ", more than --lazyCacheMem " << formatMem(args.lazyCacheMem)
+                      << ", other base estimators are evicted right after use!\n";
+    } else {
+        if (args.lazyLoad)
+            Log(CERR) << "Warning: Lazy loading requires plain PLT and " << BasesIndex::indexFile(weightsFile)
+                      << ", loading all base estimators!\n";
+        bases = loadBases(weightsFile, args.resume, args.loadAs, args.threads);
+        assert(bases.size() == tree->nodes.size());
+    }
     m = tree->getNumberOfLeaves();
 
     loaded = true;
@@ -401,6 +509,116 @@ void PLT::printInfo() {
         Log(COUT) << "  Updated estimators / data point: " << static_cast<double>(nodeUpdateCount) / dataPointCount << "\n";
     if(nodeEvaluationCount > 0)
         Log(COUT) << "  Evaluated estimators / data point: " << static_cast<double>(nodeEvaluationCount) / dataPointCount << "\n";
+    if(lazyBases != nullptr) lazyBases->printInfo();
+}
+
+void PLT::enableLevelStats(bool enable){
+    collectLevelStats = enable;
+    resetLevelStats();
+}
+
+void PLT::resetLevelStats(){
+    levelStats.clear();
+}
+
+bool PLT::enableLevelCounters(bool enable){
+    levelCounters.reset();
+    if(enable){
+        if(!collectLevelStats) enableLevelStats();
+        levelCounters = std::make_shared<PerfCounters>();
+        if(!levelCounters->available()) levelCounters.reset();
+    }
+    return levelCounters != nullptr;
+}
+
+std::string PLT::levelStatsToJson(){
+    std::ostringstream out;
+    out << "{\"levels\": [";
+    for(size_t i = 0; i < levelStats.size(); ++i){
+        auto& s = levelStats[i];
+        if(i > 0) out << ", ";
+        out << "{\"level\": " << s.level
+            << ", \"wall_time_ms\": " << s.wallTimeMs
+            << ", \"cpu_time_ms\": " << s.cpuTimeMs
+            << ", \"rows\": " << s.rows
+            << ", \"nodes_evaluated\": " << s.nodesEvaluated
+            << ", \"estimators_evaluated\": " << s.estimatorsEvaluated
+            << ", \"features_touched\": " << s.featuresTouched
+            << ", \"beam_size\": " << s.beamSize
+            << ", \"mean_beam_occupancy\": " << (s.rows ? static_cast<double>(s.beamSize) / s.rows : 0.0);
+        if(s.counters.any_valid())
+            out << ", \"counters\": " << s.counters.to_json().dump()
+                << ", \"counters_per_row\": " << s.counters.to_json(s.rows).dump();
+        out << "}";
+    }
+    out << "]}";
+    return out.str();
+}
+
+unsigned long long PLTMemoryUsage::total() const {
+    unsigned long long total = treeIndex + lazyBases;
+    for (auto& l : levels) total += l.total();
+    return total;
+}
+
+std::string PLTMemoryUsage::toJson() const {
+    std::ostringstream out;
+    out << "{\"levels\": [";
+    for(size_t i = 0; i < levels.size(); ++i){
+        auto& l = levels[i];
+        if(i > 0) out << ", ";
+        out << "{\"level\": " << l.level
+            << ", \"nodes\": " << l.nodes
+            << ", \"tree_nodes\": " << l.treeNodes
+            << ", \"bases\": " << l.bases
+            << ", \"node_vectors\": " << l.nodeVectors
+            << ", \"total\": " << l.total() << "}";
+    }
+    out << "], \"tree_index\": " << treeIndex
+        << ", \"lazy_bases\": " << lazyBases
+        << ", \"total\": " << total() << "}";
+    return out.str();
+}
+
+template <typename T> static unsigned long long vectorMem(const std::vector<T>& v){
+    return v.capacity() * sizeof(T);
+}
+
+PLTMemoryUsage PLT::getMemoryUsage(){
+    PLTMemoryUsage usage;
+    if(tree == nullptr) return usage;
+
+    usage.treeIndex = vectorMem(tree->nodes) + vectorMem(bases) + vectorMem(nodesLabels)
+                      + vectorMem(nodesThr) + vectorMem(nodesWeights);
+    auto& leaves = tree->leaves;
+    if(leaves.mask() > 0) usage.treeIndex += leaves.calcNumBytesTotal(leaves.calcNumElementsWithBuffer(leaves.mask() + 1));
+    if(lazyBases != nullptr) usage.lazyBases = lazyBases->mem();
+
+    // Walk the tree level by level
+    std::vector<TreeNode*> levelNodes = {tree->root};
+    int level = 0;
+    while(!levelNodes.empty()){
+        PLTLevelMemory l;
+        l.level = level;
+        l.nodes = levelNodes.size();
+
+        std::vector<TreeNode*> nextLevelNodes;
+        for(auto n : levelNodes){
+            size_t index = n->index;
+            l.treeNodes += sizeof(TreeNode) + vectorMem(n->children);
+            if(index < bases.size() && bases[index] != nullptr) l.bases += bases[index]->mem();
+            if(index < nodesLabels.size()) l.nodeVectors += vectorMem(nodesLabels[index]);
+            if(index < nodesThr.size()) l.nodeVectors += sizeof(TreeNodeThrExt);
+            if(index < nodesWeights.size()) l.nodeVectors += sizeof(TreeNodeWeightsExt);
+            nextLevelNodes.insert(nextLevelNodes.end(), n->children.begin(), n->children.end());
+        }
+
+        usage.levels.push_back(l);
+        levelNodes.swap(nextLevelNodes);
+        ++level;
+    }
+
+    return usage;
 }
 
 void PLT::buildTree(SRMatrix<Label>& labels, SRMatrix<Feature>& features, Args& args, std::string output){
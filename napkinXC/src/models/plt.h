@@ -23,7 +23,9 @@
 #pragma once
 
 #include "base.h"
+#include "lazy_bases.h"
 #include "model.h"
+#include "perf_counters.h"
 #include "tree.h"
 
 // Additional node information for prediction with thresholds
@@ -38,6 +40,40 @@ struct TreeNodeWeightsExt {
     int label;
 };
 
+// Work done on one tree level by predictWithBeamSearch, accumulated over calls
+struct PLTLevelStats {
+    int level = 0;
+    double wallTimeMs = 0; // Time spent on evaluating the level and selecting the beam
+    double cpuTimeMs = 0;
+    unsigned long long nodesEvaluated = 0; // Nodes with at least one data point to evaluate
+    unsigned long long estimatorsEvaluated = 0; // Pairs of (node, data point) evaluated
+    unsigned long long featuresTouched = 0; // Sum of features of the evaluated data points
+    unsigned long long beamSize = 0; // Internal nodes kept in the beams, summed over data points
+    unsigned long long rows = 0; // Data points passed through the level
+    PerfCounterValues counters; // Hardware counters of the timed region, see enableLevelCounters
+};
+
+// Bytes held by the nodes of one tree level, see PLT::getMemoryUsage
+struct PLTLevelMemory {
+    int level = 0;
+    int nodes = 0;
+    unsigned long long treeNodes = 0; // TreeNode objects with their children vectors
+    unsigned long long bases = 0; // Base objects with their weight vectors
+    unsigned long long nodeVectors = 0; // Entries of nodesLabels, nodesThr and nodesWeights
+
+    unsigned long long total() const { return treeNodes + bases + nodeVectors; }
+};
+
+// Exact allocated bytes of a loaded PLT, allocator overhead is not included
+struct PLTMemoryUsage {
+    std::vector<PLTLevelMemory> levels;
+    unsigned long long treeIndex = 0; // Tree::nodes and Tree::leaves, bases array and outer per node vectors
+    unsigned long long lazyBases = 0; // Bases currently cached by lazy loading
+
+    unsigned long long total() const;
+    std::string toJson() const;
+};
+
 // This is virtual class for all PLT based models: HSM, Batch PLT, Online PLT
 class PLT : virtual public Model {
 public:
@@ -47,6 +83,9 @@ public:
     double predictForLabel(Label label, Feature* features, Args& args) override;
     std::vector<std::vector<Prediction>> predictBatch(SRMatrix<Feature>& features, Args& args) override;
     std::vector<std::vector<Prediction>> predictWithBeamSearch(SRMatrix<Feature>& features, Args& args);
+    // Beam search for a single data point, unlike the batch version it does not change the bases,
+    // so it can be called concurrently. Level statistics are not collected.
+    void predictWithBeamSearch(std::vector<Prediction>& prediction, Feature* features, Args& args);
 
     void setThresholds(std::vector<double> th) override;
     void updateThresholds(UnorderedMap<int, double> thToUpdate) override;
@@ -57,6 +96,18 @@ public:
 
     void printInfo() override;
 
+    // Opt-in per level statistics of predictWithBeamSearch, disabled by default
+    void enableLevelStats(bool enable = true);
+    void resetLevelStats();
+    std::vector<PLTLevelStats>& getLevelStats() { return levelStats; }
+    std::string levelStatsToJson();
+
+    // Adds hardware counters to the level statistics (enables them), they count events of the calling thread.
+    // Returns false if no counter is available, the other statistics are collected anyway.
+    bool enableLevelCounters(bool enable = true);
+
+    PLTMemoryUsage getMemoryUsage();
+
     // For Python PLT Framework
     void buildTree(SRMatrix<Label>& labels, SRMatrix<Feature>& features, Args& args, std::string output);
     std::vector<std::vector<std::pair<int, double>>> getNodesToUpdate(std::vector<std::vector<Label>>& labels);
@@ -64,6 +115,7 @@ public:
 
     Tree* tree;
     std::vector<Base*> bases;
+    LazyBases* lazyBases; // Used instead of bases if the model was loaded with lazyLoad
 
     std::vector<std::vector<int>> nodesLabels;
     std::vector<TreeNodeThrExt> nodesThr; // For prediction with thresholds
@@ -88,6 +140,7 @@ public:
                                         TopKQueue<TreeNodeValue>& nQueue, Feature* features);
 
     virtual inline double predictForNode(TreeNode* node, Feature* features){
+        if (lazyBases != nullptr) return lazyBases->predictProbability(node->index, features);
         return bases[node->index]->predictProbability(features);
     }
 
@@ -104,6 +157,10 @@ public:
     int nodeEvaluationCount; // Number of visited nodes during training prediction (updated/evaluated classifiers)
     int nodeUpdateCount; // Number of visited nodes during training or prediction
     int dataPointCount; // Data points count
+
+    bool collectLevelStats;
+    std::vector<PLTLevelStats> levelStats;
+    std::shared_ptr<PerfCounters> levelCounters;
 };
 
 class BatchPLT : public PLT {
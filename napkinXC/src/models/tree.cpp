@@ -98,7 +98,8 @@ void Tree::buildTreeStructure(SRMatrix<Label>& labels, SRMatrix<Feature>& featur
 
 TreeNodePartition Tree::buildKmeansTreeThread(TreeNodePartition nPart, SRMatrix<Feature>& labelsFeatures, Args& args,
                                               int seed) {
-    kmeans(nPart.partition, labelsFeatures, args.arity, args.kmeansEps, args.kmeansBalanced, seed);
+    kmeans(nPart.partition, labelsFeatures, args.arity, args.kmeansEps, args.kmeansBalanced, seed, args.kmeansSample,
+           args.kmeansMaxIter, args.kmeansCentroidFeatures, args.kmeansStats ? &nPart.objective : nullptr);
     return nPart;
 }
 
@@ -119,7 +120,15 @@ void Tree::buildKmeansTree(SRMatrix<Feature>& labelsFeatures, Args& args) {
     ThreadPool tPool(args.threads);
     std::vector<std::future<TreeNodePartition>> results;
 
-    TreeNodePartition rootPart = {root, partition};
+    // Spread of the cluster sizes and the clustering objective of every level, collected with --kmeansStats
+    struct LevelStats {
+        int clusters = 0, minSize = INT_MAX, maxSize = 0;
+        long long points = 0, fitPoints = 0;
+        double fitObjective = 0, fullObjective = 0; // Weighted by the number of points
+    };
+    std::vector<LevelStats> levels;
+
+    TreeNodePartition rootPart = {root, partition, 0, KMeansObjective()};
     results.emplace_back(
         tPool.enqueue(buildKmeansTreeThread, rootPart, std::ref(labelsFeatures), std::ref(args), kmeansSeeder(rng)));
 
@@ -132,6 +141,23 @@ void Tree::buildKmeansTree(SRMatrix<Feature>& labelsFeatures, Args& args) {
         for (int i = 0; i < args.arity; ++i) partitions[i] = new std::vector<Assignation>();
         for (auto a : *nPart.partition) partitions[a.value]->push_back({a.index, 0});
 
+        if (args.kmeansStats) {
+            size_t depth = nPart.depth;
+            if (levels.size() <= depth) levels.resize(depth + 1);
+            auto& level = levels[depth];
+            int points = nPart.partition->size();
+            level.points += points;
+            level.fitPoints += nPart.objective.fitPoints;
+            level.fitObjective += nPart.objective.fit * nPart.objective.fitPoints;
+            level.fullObjective += nPart.objective.full * points;
+            for (int i = 0; i < args.arity; ++i) {
+                if (partitions[i]->empty()) continue;
+                ++level.clusters;
+                level.minSize = std::min<int>(level.minSize, partitions[i]->size());
+                level.maxSize = std::max<int>(level.maxSize, partitions[i]->size());
+            }
+        }
+
         // Create children
         for (int i = 0; i < args.arity; ++i) {
             if (partitions[i]->empty())
@@ -148,7 +174,7 @@ void Tree::buildKmeansTree(SRMatrix<Feature>& labelsFeatures, Args& args) {
                 for (const auto& a : *partitions[i]) createTreeNode(n, a.index);
                 delete partitions[i];
             } else {
-                TreeNodePartition childPart = {n, partitions[i]};
+                TreeNodePartition childPart = {n, partitions[i], nPart.depth + 1, KMeansObjective()};
                 results.emplace_back(tPool.enqueue(buildKmeansTreeThread, childPart, std::ref(labelsFeatures),
                                                    std::ref(args), kmeansSeeder(rng)));
             }
@@ -160,6 +186,19 @@ void Tree::buildKmeansTree(SRMatrix<Feature>& labelsFeatures, Args& args) {
     t = nodes.size();
     assert(k == leaves.size());
     Log(CERR) << "  Nodes: " << nodes.size() << ", leaves: " << leaves.size() << "\n";
+
+    // Balanced K-Means keeps all leaves at the same depth, the spread of the cluster sizes and the objective
+    // of each level show how balanced and how good the clustering is, and what sampling costs
+    for (size_t d = 0; d < levels.size(); ++d) {
+        auto& level = levels[d];
+        Log(CERR) << "  Level " << d << ": clusters: " << level.clusters << ", size min/avg/max: " << level.minSize
+                  << "/" << static_cast<double>(level.points) / level.clusters << "/" << level.maxSize
+                  << ", objective: " << level.fullObjective / level.points;
+        if (level.fitPoints < level.points)
+            Log(CERR) << " (sample: " << level.fitObjective / level.fitPoints << " on " << level.fitPoints
+                      << " points)";
+        Log(CERR) << "\n";
+    }
 }
 
 void Tree::squashTree(){
@@ -236,7 +275,7 @@ void Tree::buildBalancedTree(int labelCount, bool randomizeOrder, Args& args) {
     if (randomizeOrder) std::shuffle(partition->begin(), partition->end(), rng);
 
     std::queue<TreeNodePartition> nQueue;
-    nQueue.push({root, partition});
+    nQueue.push({root, partition, 0, KMeansObjective()});
 
     while (!nQueue.empty()) {
         TreeNodePartition nPart = nQueue.front(); // Current node
@@ -265,7 +304,7 @@ void Tree::buildBalancedTree(int labelCount, bool randomizeOrder, Args& args) {
             // Create children
             for (int i = 0; i < args.arity; ++i) {
                 TreeNode* n = createTreeNode(nPart.node);
-                nQueue.push({n, partitions[i]});
+                nQueue.push({n, partitions[i], nPart.depth + 1, KMeansObjective()});
             }
         } else
             for (const auto& a : *nPart.partition) createTreeNode(nPart.node, a.index);
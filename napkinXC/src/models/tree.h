@@ -67,6 +67,8 @@ struct TreeNodeValue {
 struct TreeNodePartition {
     TreeNode* node;
     std::vector<Assignation>* partition;
+    int depth;
+    KMeansObjective objective; // Set by the clustering of the partition with --kmeansStats
 };
 
 class Tree : public FileHelper {
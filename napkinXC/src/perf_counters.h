@@ -0,0 +1,58 @@
+/*
+ Copyright (c) 2021 by Marek Wydmuch
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ */
+
+
+#pragma once
+
+// Optional hardware performance counters, the implementation is shared with PECOS
+// (pecos/core/utils/perf_counters.hpp). Counters that cannot be opened are reported as unavailable,
+// as are all of them when napkinXC is built without PECOS next to it.
+#if __has_include(<utils/perf_counters.hpp>)
+#include <utils/perf_counters.hpp>
+
+typedef pecos::perf_counter_values_t PerfCounterValues;     // Event counts of one region or a sum of regions
+typedef pecos::perf_counter_snapshot_t PerfCounterSnapshot; // Raw state of the counters at one point in time
+typedef pecos::perf_counter_group_t PerfCounters;           // Counters of the thread that creates it
+
+#else
+#include <string>
+
+struct PerfCounterValues {
+    struct Json {
+        std::string dump() const { return "{}"; }
+    };
+
+    bool any_valid() const { return false; }
+    PerfCounterValues& operator+=(const PerfCounterValues&) { return *this; }
+    Json to_json(double = 1.0) const { return Json(); }
+};
+
+struct PerfCounterSnapshot {};
+
+class PerfCounters {
+public:
+    bool available() const { return false; }
+    void read(PerfCounterSnapshot&) const {}
+    PerfCounterValues delta(const PerfCounterSnapshot&, const PerfCounterSnapshot&) const { return PerfCounterValues(); }
+};
+
+#endif
@@ -24,7 +24,9 @@
 
 #include "resources.h"
 
+#include <cstdlib>
 #include <fstream>
+#include <string>
 
 
 #if defined(__linux__) || defined(__APPLE__)
@@ -33,7 +35,7 @@
 #endif
 
 Resources getResources() {
-    Resources rc;
+    Resources rc = {};
     rc.timePoint = std::chrono::steady_clock::now();
     rc.cpuTime = static_cast<double>(clock()) / CLOCKS_PER_SEC;
 
@@ -47,22 +49,27 @@ Resources getResources() {
 #endif
 
 #ifdef __linux__
+    // Lines have the form "VmRSS:\t    1234 kB", values are in kB
     std::ifstream status("/proc/self/status");
-    std::string next;
-    while (status >> next) {
-        status >> next;
-        if (next == "VmPeak:")
-            status >> rc.peakVirtualMem;
-        else if (next == "VmSize:")
-            status >> rc.currentVirtualMem;
-        else if (next == "VmHWM:")
-            status >> rc.peakRealMem;
-        else if (next == "VmRSS:")
-            status >> rc.currentRealMem;
-        else if (next == "VmData:")
-            status >> rc.dataMemory;
-        else if (next == "VmStk:")
-            status >> rc.stackMemory;
+    std::string line;
+    while (std::getline(status, line)) {
+        auto colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        std::string key = line.substr(0, colon);
+        double* value = nullptr;
+        if (key == "VmPeak")
+            value = &rc.peakVirtualMem;
+        else if (key == "VmSize")
+            value = &rc.currentVirtualMem;
+        else if (key == "VmHWM")
+            value = &rc.peakRealMem;
+        else if (key == "VmRSS")
+            value = &rc.currentRealMem;
+        else if (key == "VmData")
+            value = &rc.dataMemory;
+        else if (key == "VmStk")
+            value = &rc.stackMemory;
+        if (value != nullptr) *value = std::strtod(line.c_str() + colon + 1, nullptr);
     }
 
     status.close();
@@ -79,6 +86,19 @@ Resources getResources() {
     return rc;
 }
 
+bool resetPeakRealMem() {
+#ifdef __linux__
+    // Writing 5 to clear_refs resets VmHWM to the current RSS (Linux 4.0+)
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    if (!clearRefs) return false;
+    clearRefs << "5";
+    clearRefs.close();
+    return !clearRefs.fail();
+#else
+    return false;
+#endif
+}
+
 int getCpuCount() { return std::thread::hardware_concurrency(); }
 
 unsigned long long getSystemMemory() {
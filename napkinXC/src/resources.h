@@ -31,7 +31,7 @@ struct Resources {
     double cpuTime;
     double userCpuTime;
     double systemCpuTime;
-    double currentRealMem;
+    double currentRealMem; // Memory values are in kB
     double peakRealMem;
     double currentVirtualMem;
     double peakVirtualMem;
@@ -42,6 +42,10 @@ struct Resources {
 // Returns Resources structure
 Resources getResources();
 
+// Resets peakRealMem to the current resident set size, so it can measure the peak of a single phase.
+// Returns false if it is not supported.
+bool resetPeakRealMem();
+
 // Returns number of available cpus
 int getCpuCount();
 
@@ -444,7 +444,12 @@ public:
         for(auto p = d; p->first != -1; ++p) func(p->first, p->second);
     };
 
-    unsigned long long mem() const override { return estimateMem(s, n0); };
+    // Allocated bytes, estimateMem gives the size of a vector with n0 non-zero values
+    unsigned long long mem() const override {
+        unsigned long long mem = sizeof(SparseVector<T>);
+        if(d != nullptr) mem += (maxN0 + 1) * sizeof(std::pair<int, T>);
+        return mem;
+    };
     static unsigned long long estimateMem(size_t s, size_t n0){
         return sizeof(SparseVector<T>) + n0 * (sizeof(int) + sizeof(T));
     }
@@ -538,9 +543,13 @@ public:
         for (auto& c : *d) func(c.first, c.second);
     };
 
+    // Allocated bytes: the map object and its table of (mask + 1 + overflow buffer) nodes with info bytes
     unsigned long long mem() const override {
         unsigned long long mem = sizeof(MapVector);
-        if(d != nullptr) mem += d->mask() * (2 * sizeof(int) + sizeof(T));
+        if(d != nullptr){
+            mem += sizeof(UnorderedMap<int, T>);
+            if(d->mask() > 0) mem += d->calcNumBytesTotal(d->calcNumElementsWithBuffer(d->mask() + 1));
+        }
         return mem;
     };
     static unsigned long long estimateMem(size_t s, size_t n0){
@@ -0,0 +1,402 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"). You may not use this file except in compliance
+ * with the License. A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0/
+ *
+ * or in the "license" file accompanying this file. This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES
+ * OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions
+ * and limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PECOS_ANN_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace pecos {
+
+namespace ann {
+
+    // Distance kernels of the HNSW spaces.
+    //
+    // Every instruction set has its own namespace holding the kernels and the DistFn shaped wrappers around them.
+    // The wrappers carry the same target attribute as the kernels, so the kernels are inlined into them and a
+    // distance costs one indirect call. A space picks the wrappers of get_simd_level() once, when it is constructed,
+    // so the code runs on any x86-64 CPU without compiling the whole project for AVX. The wrappers are inline rather
+    // than static, so each has one address in every translation unit and visit_dist_op in hnsw.h can recognize it.
+
+    enum simd_level_t {
+        SIMD_NONE = 0,
+        SIMD_AVX2,
+        SIMD_AVX512
+    };
+
+    // the widest instruction set supported by the CPU, PECOS_ANN_SIMD=none|avx2 lowers it, e.g. for benchmarks
+    inline simd_level_t get_simd_level() {
+        static const simd_level_t level = [] {
+            simd_level_t best = SIMD_NONE;
+#ifdef PECOS_ANN_X86_SIMD
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+                best = SIMD_AVX2;
+            }
+            if (best == SIMD_AVX2 && __builtin_cpu_supports("avx512f")) {
+                best = SIMD_AVX512;
+            }
+#endif
+            const char *env = std::getenv("PECOS_ANN_SIMD");
+            if (env != nullptr) {
+                std::string requested(env);
+                if (requested == "none") {
+                    best = SIMD_NONE;
+                } else if (requested == "avx2" && best > SIMD_AVX2) {
+                    best = SIMD_AVX2;
+                }
+            }
+            return best;
+        }();
+        return level;
+    }
+
+    inline const char* simd_level_name(simd_level_t level) {
+        switch (level) {
+            case SIMD_AVX2:
+                return "avx2";
+            case SIMD_AVX512:
+                return "avx512";
+            default:
+                return "none";
+        }
+    }
+
+    // arg3 of the int8 distances: codes decode to offset[j] + scale[j] * code[j]
+    struct Int8DistParams {
+        size_t feat_dim;
+        const float *scale;
+        const float *offset;
+    };
+
+    namespace simd_none {
+        inline float dot_f32(const float *x, const float *y, size_t d) {
+            float ret = 0;
+            for (size_t i = 0; i < d; i++) {
+                ret += x[i] * y[i];
+            }
+            return ret;
+        }
+
+        inline float l2_f32(const float *x, const float *y, size_t d) {
+            float ret = 0;
+            for (size_t i = 0; i < d; i++) {
+                float diff = x[i] - y[i];
+                ret += diff * diff;
+            }
+            return ret;
+        }
+
+        inline float dot_u8(const uint8_t *cx, const uint8_t *cy, const float *scale, const float *offset, size_t d) {
+            float ret = 0;
+            for (size_t i = 0; i < d; i++) {
+                ret += (offset[i] + scale[i] * cx[i]) * (offset[i] + scale[i] * cy[i]);
+            }
+            return ret;
+        }
+
+        inline float l2_u8(const uint8_t *cx, const uint8_t *cy, const float *scale, size_t d) {
+            float ret = 0;
+            for (size_t i = 0; i < d; i++) {
+                float diff = scale[i] * ((int) cx[i] - (int) cy[i]);
+                ret += diff * diff;
+            }
+            return ret;
+        }
+
+        inline float InnerProduct(const void *x, const void *y, const void *feat_dim) {
+            return 1.0 - dot_f32((const float *) x, (const float *) y, *((const size_t *) feat_dim));
+        }
+
+        inline float L2Sqr(const void *x, const void *y, const void *feat_dim) {
+            return l2_f32((const float *) x, (const float *) y, *((const size_t *) feat_dim));
+        }
+
+        inline float Int8InnerProduct(const void *x, const void *y, const void *params) {
+            auto p = (const Int8DistParams *) params;
+            return 1.0 - dot_u8((const uint8_t *) x, (const uint8_t *) y, p->scale, p->offset, p->feat_dim);
+        }
+
+        inline float Int8L2Sqr(const void *x, const void *y, const void *params) {
+            auto p = (const Int8DistParams *) params;
+            return l2_u8((const uint8_t *) x, (const uint8_t *) y, p->scale, p->feat_dim);
+        }
+    } // end of namespace simd_none
+
+#ifdef PECOS_ANN_X86_SIMD
+#define PECOS_ANN_AVX2 __attribute__((target("avx2,fma")))
+#define PECOS_ANN_AVX512 __attribute__((target("avx512f")))
+
+    namespace simd_avx2 {
+        PECOS_ANN_AVX2 inline float hsum(__m256 v) {
+            __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+            lo = _mm_add_ps(lo, _mm_movehl_ps(lo, lo));
+            lo = _mm_add_ss(lo, _mm_movehdup_ps(lo));
+            return _mm_cvtss_f32(lo);
+        }
+
+        // 8 codes widened to floats
+        PECOS_ANN_AVX2 inline __m256 load_u8(const uint8_t *c) {
+            return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) c)));
+        }
+
+        PECOS_ANN_AVX2 inline float dot_f32(const float *x, const float *y, size_t d) {
+            __m256 sum0 = _mm256_setzero_ps();
+            __m256 sum1 = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 16 <= d; i += 16) {
+                sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), sum0);
+                sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), sum1);
+            }
+            if (i + 8 <= d) {
+                sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), sum0);
+                i += 8;
+            }
+            float ret = hsum(_mm256_add_ps(sum0, sum1));
+            for (; i < d; i++) {
+                ret += x[i] * y[i];
+            }
+            return ret;
+        }
+
+        PECOS_ANN_AVX2 inline float l2_f32(const float *x, const float *y, size_t d) {
+            __m256 sum0 = _mm256_setzero_ps();
+            __m256 sum1 = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 16 <= d; i += 16) {
+                __m256 diff0 = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+                __m256 diff1 = _mm256_sub_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8));
+                sum0 = _mm256_fmadd_ps(diff0, diff0, sum0);
+                sum1 = _mm256_fmadd_ps(diff1, diff1, sum1);
+            }
+            if (i + 8 <= d) {
+                __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+                sum0 = _mm256_fmadd_ps(diff, diff, sum0);
+                i += 8;
+            }
+            float ret = hsum(_mm256_add_ps(sum0, sum1));
+            for (; i < d; i++) {
+                float diff = x[i] - y[i];
+                ret += diff * diff;
+            }
+            return ret;
+        }
+
+        PECOS_ANN_AVX2 inline float dot_u8(const uint8_t *cx, const uint8_t *cy, const float *scale, const float *offset, size_t d) {
+            __m256 sum = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 8 <= d; i += 8) {
+                __m256 s = _mm256_loadu_ps(scale + i);
+                __m256 o = _mm256_loadu_ps(offset + i);
+                __m256 x = _mm256_fmadd_ps(s, load_u8(cx + i), o);
+                __m256 y = _mm256_fmadd_ps(s, load_u8(cy + i), o);
+                sum = _mm256_fmadd_ps(x, y, sum);
+            }
+            float ret = hsum(sum);
+            for (; i < d; i++) {
+                ret += (offset[i] + scale[i] * cx[i]) * (offset[i] + scale[i] * cy[i]);
+            }
+            return ret;
+        }
+
+        PECOS_ANN_AVX2 inline float l2_u8(const uint8_t *cx, const uint8_t *cy, const float *scale, size_t d) {
+            __m256 sum = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 8 <= d; i += 8) {
+                __m256 diff = _mm256_mul_ps(_mm256_loadu_ps(scale + i), _mm256_sub_ps(load_u8(cx + i), load_u8(cy + i)));
+                sum = _mm256_fmadd_ps(diff, diff, sum);
+            }
+            float ret = hsum(sum);
+            for (; i < d; i++) {
+                float diff = scale[i] * ((int) cx[i] - (int) cy[i]);
+                ret += diff * diff;
+            }
+            return ret;
+        }
+
+        PECOS_ANN_AVX2 inline float InnerProduct(const void *x, const void *y, const void *feat_dim) {
+            return 1.0 - dot_f32((const float *) x, (const float *) y, *((const size_t *) feat_dim));
+        }
+
+        PECOS_ANN_AVX2 inline float L2Sqr(const void *x, const void *y, const void *feat_dim) {
+            return l2_f32((const float *) x, (const float *) y, *((const size_t *) feat_dim));
+        }
+
+        PECOS_ANN_AVX2 inline float Int8InnerProduct(const void *x, const void *y, const void *params) {
+            auto p = (const Int8DistParams *) params;
+            return 1.0 - dot_u8((const uint8_t *) x, (const uint8_t *) y, p->scale, p->offset, p->feat_dim);
+        }
+
+        PECOS_ANN_AVX2 inline float Int8L2Sqr(const void *x, const void *y, const void *params) {
+            auto p = (const Int8DistParams *) params;
+            return l2_u8((const uint8_t *) x, (const uint8_t *) y, p->scale, p->feat_dim);
+        }
+    } // end of namespace simd_avx2
+
+    // GCC's AVX-512 intrinsics fill the unused operand of their masked builtins with a self-initialized
+    // register (_mm256_undefined_pd and friends), which -Wuninitialized reports in every function they are
+    // inlined into. The value is never read, so the warning is silenced for these kernels only.
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+    namespace simd_avx512 {
+        // mask of the first n < 16 lanes
+        PECOS_ANN_AVX512 inline __mmask16 tail_mask(size_t n) {
+            return (__mmask16) ((1U << n) - 1);
+        }
+
+        // 16 codes widened to floats
+        PECOS_ANN_AVX512 inline __m512 load_u8(const uint8_t *c) {
+            return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *) c)));
+        }
+
+        PECOS_ANN_AVX512 inline float dot_f32(const float *x, const float *y, size_t d) {
+            __m512 sum0 = _mm512_setzero_ps();
+            __m512 sum1 = _mm512_setzero_ps();
+            size_t i = 0;
+            for (; i + 32 <= d; i += 32) {
+                sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), sum0);
+                sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), sum1);
+            }
+            for (; i + 16 <= d; i += 16) {
+                sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), sum0);
+            }
+            if (i < d) {
+                __mmask16 mask = tail_mask(d - i);
+                sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i), sum1);
+            }
+            return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+        }
+
+        PECOS_ANN_AVX512 inline float l2_f32(const float *x, const float *y, size_t d) {
+            __m512 sum0 = _mm512_setzero_ps();
+            __m512 sum1 = _mm512_setzero_ps();
+            size_t i = 0;
+            for (; i + 32 <= d; i += 32) {
+                __m512 diff0 = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+                __m512 diff1 = _mm512_sub_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16));
+                sum0 = _mm512_fmadd_ps(diff0, diff0, sum0);
+                sum1 = _mm512_fmadd_ps(diff1, diff1, sum1);
+            }
+            for (; i + 16 <= d; i += 16) {
+                __m512 diff = _mm512_sub_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i));
+                sum0 = _mm512_fmadd_ps(diff, diff, sum0);
+            }
+            if (i < d) {
+                __mmask16 mask = tail_mask(d - i);
+                __m512 diff = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + i), _mm512_maskz_loadu_ps(mask, y + i));
+                sum1 = _mm512_fmadd_ps(diff, diff, sum1);
+            }
+            return _mm512_reduce_add_ps(_mm512_add_ps(sum0, sum1));
+        }
+
+        PECOS_ANN_AVX512 inline float dot_u8(const uint8_t *cx, const uint8_t *cy, const float *scale, const float *offset, size_t d) {
+            __m512 sum = _mm512_setzero_ps();
+            size_t i = 0;
+            for (; i + 16 <= d; i += 16) {
+                __m512 s = _mm512_loadu_ps(scale + i);
+                __m512 o = _mm512_loadu_ps(offset + i);
+                sum = _mm512_fmadd_ps(_mm512_fmadd_ps(s, load_u8(cx + i), o), _mm512_fmadd_ps(s, load_u8(cy + i), o), sum);
+            }
+            float ret = _mm512_reduce_add_ps(sum);
+            for (; i < d; i++) {
+                ret += (offset[i] + scale[i] * cx[i]) * (offset[i] + scale[i] * cy[i]);
+            }
+            return ret;
+        }
+
+        PECOS_ANN_AVX512 inline float l2_u8(const uint8_t *cx, const uint8_t *cy, const float *scale, size_t d) {
+            __m512 sum = _mm512_setzero_ps();
+            size_t i = 0;
+            for (; i + 16 <= d; i += 16) {
+                __m512 diff = _mm512_mul_ps(_mm512_loadu_ps(scale + i), _mm512_sub_ps(load_u8(cx + i), load_u8(cy + i)));
+                sum = _mm512_fmadd_ps(diff, diff, sum);
+            }
+            float ret = _mm512_reduce_add_ps(sum);
+            for (; i < d; i++) {
+                float diff = scale[i] * ((int) cx[i] - (int) cy[i]);
+                ret += diff * diff;
+            }
+            return ret;
+        }
+
+        PECOS_ANN_AVX512 inline float InnerProduct(const void *x, const void *y, const void *feat_dim) {
+            return 1.0 - dot_f32((const float *) x, (const float *) y, *((const size_t *) feat_dim));
+        }
+
+        PECOS_ANN_AVX512 inline float L2Sqr(const void *x, const void *y, const void *feat_dim) {
+            return l2_f32((const float *) x, (const float *) y, *((const size_t *) feat_dim));
+        }
+
+        PECOS_ANN_AVX512 inline float Int8InnerProduct(const void *x, const void *y, const void *params) {
+            auto p = (const Int8DistParams *) params;
+            return 1.0 - dot_u8((const uint8_t *) x, (const uint8_t *) y, p->scale, p->offset, p->feat_dim);
+        }
+
+        PECOS_ANN_AVX512 inline float Int8L2Sqr(const void *x, const void *y, const void *params) {
+            auto p = (const Int8DistParams *) params;
+            return l2_u8((const uint8_t *) x, (const uint8_t *) y, p->scale, p->feat_dim);
+        }
+    } // end of namespace simd_avx512
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#undef PECOS_ANN_AVX2
+#undef PECOS_ANN_AVX512
+#else
+    // get_simd_level() is always SIMD_NONE here
+    namespace simd_avx2 = simd_none;
+    namespace simd_avx512 = simd_none;
+#endif // PECOS_ANN_X86_SIMD
+
+    typedef float (*float_dist_fn_t)(const void *, const void *, const void *);
+
+    inline float_dist_fn_t select_dist_fn(simd_level_t level, float_dist_fn_t none_fn, float_dist_fn_t avx2_fn, float_dist_fn_t avx512_fn) {
+        switch (level) {
+            case SIMD_AVX512:
+                return avx512_fn;
+            case SIMD_AVX2:
+                return avx2_fn;
+            default:
+                return none_fn;
+        }
+    }
+
+    inline float_dist_fn_t get_inner_product_fn(simd_level_t level=get_simd_level()) {
+        return select_dist_fn(level, simd_none::InnerProduct, simd_avx2::InnerProduct, simd_avx512::InnerProduct);
+    }
+
+    inline float_dist_fn_t get_l2_sqr_fn(simd_level_t level=get_simd_level()) {
+        return select_dist_fn(level, simd_none::L2Sqr, simd_avx2::L2Sqr, simd_avx512::L2Sqr);
+    }
+
+    inline float_dist_fn_t get_int8_inner_product_fn(simd_level_t level=get_simd_level()) {
+        return select_dist_fn(level, simd_none::Int8InnerProduct, simd_avx2::Int8InnerProduct, simd_avx512::Int8InnerProduct);
+    }
+
+    inline float_dist_fn_t get_int8_l2_sqr_fn(simd_level_t level=get_simd_level()) {
+        return select_dist_fn(level, simd_none::Int8L2Sqr, simd_avx2::Int8L2Sqr, simd_avx512::Int8L2Sqr);
+    }
+
+} // end of namespace ann
+} // end of namespace pecos
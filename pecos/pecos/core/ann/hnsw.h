@@ -13,12 +13,20 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <queue>
 #include <random>
+#include <string>
 #include <vector>
 
+#include "ann/distance.hpp"
 #include "utils/matrix.hpp"
 
 namespace pecos {
@@ -27,26 +35,13 @@ namespace ann {
     // assuming the num_node < 2^31-1 (~4.2 billion)
     typedef uint32_t index_type;
 
-    // for calling InnerProductBLAS/L2SqrBLAS
+    // for calling the distance kernels of distance.hpp
     // arg1 is the ptr for vect1
     // arg2 is the ptr for vect2
     // arg3 is the size of feat_dim
     template<typename MTYPE>
     using DistFn = MTYPE(*)(const void *, const void *, const void *);
 
-    static float InnerProductBLAS(const void *x_ptr, const void *y_ptr, const void *feat_dim) {
-        return 1.0 - do_dot_product((float *) x_ptr, (float *) y_ptr, *((size_t *) feat_dim));
-    }
-
-    static float L2SqrBLAS(const void *x_ptr, const void *y_ptr, const void *feat_dim) {
-        float *x = (float *) x_ptr;
-        float *y = (float *) y_ptr;
-        size_t d = *((size_t *) feat_dim);
-        float x_norm2 = do_dot_product(x, x, d);
-        float y_norm2 = do_dot_product(y, y, d);
-        return x_norm2 + y_norm2 - 2.0 * do_dot_product(x, y, d);
-    }
-
     template<typename MTYPE>
     class DistanceBase {
         public:
@@ -63,7 +58,7 @@ namespace ann {
         size_t feat_dim;
     public:
         InnerProductSpace(size_t feat_dim) {
-            this->dist_fn = InnerProductBLAS;
+            this->dist_fn = get_inner_product_fn();
             this->feat_dim = feat_dim;
         }
 
@@ -83,7 +78,7 @@ namespace ann {
         size_t feat_dim;
     public:
         L2Space(size_t feat_dim) {
-            this->dist_fn = L2SqrBLAS;
+            this->dist_fn = get_l2_sqr_fn();
             this->feat_dim = feat_dim;
         }
 
@@ -98,6 +93,225 @@ namespace ann {
         ~L2Space() {}
     };
 
+    // one non-zero of a sparse feature vector
+    struct SparseEntry {
+        index_type idx;
+        float val;
+    };
+
+    // sparse vectors are stored as the number of non-zeros followed by that many SparseEntry sorted by idx
+    // arg3 is unused, the length of each vector is read from its own header
+    inline float SparseInnerProduct(const void *x_ptr, const void *y_ptr, const void *max_nnz) {
+        index_type x_nnz = *((index_type *) x_ptr);
+        index_type y_nnz = *((index_type *) y_ptr);
+        const SparseEntry *x = (const SparseEntry *) ((index_type *) x_ptr + 1);
+        const SparseEntry *y = (const SparseEntry *) ((index_type *) y_ptr + 1);
+        if (x_nnz > y_nnz) {
+            std::swap(x, y);
+            std::swap(x_nnz, y_nnz);
+        }
+        const SparseEntry *x_end = x + x_nnz;
+        const SparseEntry *y_end = y + y_nnz;
+
+        float ret = 0;
+        // a short query against a long vector, e.g. a cluster weight vector, is cheaper by binary search
+        if ((size_t) x_nnz * 16 < y_nnz) {
+            for (; x < x_end && y < y_end; ++x) {
+                y = std::lower_bound(y, y_end, x->idx, [](const SparseEntry &e, index_type idx) { return e.idx < idx; });
+                if (y < y_end && y->idx == x->idx) {
+                    ret += x->val * y->val;
+                    ++y;
+                }
+            }
+            return 1.0 - ret;
+        }
+        while (x < x_end && y < y_end) {
+            if (x->idx == y->idx) {
+                ret += x->val * y->val;
+                ++x;
+                ++y;
+            } else if (x->idx < y->idx) {
+                ++x;
+            } else {
+                ++y;
+            }
+        }
+        return 1.0 - ret;
+    }
+
+    // Inner product between sparse vectors in the layout read by SparseInnerProduct.
+    // Either HNSW::train gets a csr_t and keeps every node at its own length in an arena (max_nnz is then unused),
+    // or the graph stores each node in get_feat_mem_dim() float-sized slots, so the drm_t passed to
+    // HNSW::train has that many columns and its rows are filled with encode().
+    class SparseInnerProductSpace : public DistanceBase<float> {
+        DistFn<float> dist_fn;
+        size_t max_nnz;
+    public:
+        SparseInnerProductSpace(size_t max_nnz=0) {
+            this->dist_fn = SparseInnerProduct;
+            this->max_nnz = max_nnz;
+        }
+
+        DistFn<float> get_dist_fn() {
+            return dist_fn;
+        }
+
+        void *get_dist_feat_dim() {
+            return &max_nnz;
+        }
+
+        size_t get_feat_mem_dim() const {
+            return get_feat_mem_dim(max_nnz);
+        }
+
+        // number of float-sized slots that hold a vector with nnz non-zeros
+        static size_t get_feat_mem_dim(size_t nnz) {
+            return 1 + nnz * sizeof(SparseEntry) / sizeof(float);
+        }
+
+        // dst has to hold get_feat_mem_dim(nnz) slots, the entries are sorted by idx if they are not already
+        static void encode(const index_type *idx, const float *val, index_type nnz, void *dst) {
+            *((index_type *) dst) = nnz;
+            SparseEntry *entries = (SparseEntry *) ((index_type *) dst + 1);
+            bool sorted = true;
+            for (index_type i = 0; i < nnz; i++) {
+                entries[i].idx = idx[i];
+                entries[i].val = val[i];
+                sorted = sorted && (i == 0 || idx[i - 1] <= idx[i]);
+            }
+            if (!sorted) {
+                std::sort(entries, entries + nnz, [](const SparseEntry &a, const SparseEntry &b) { return a.idx < b.idx; });
+            }
+        }
+
+        static void encode(const SparseEntry *src, index_type nnz, void *dst) {
+            *((index_type *) dst) = nnz;
+            std::memcpy((index_type *) dst + 1, src, nnz * sizeof(SparseEntry));
+        }
+
+        ~SparseInnerProductSpace() {}
+    };
+
+    // Per-dimension affine quantization of dense float vectors into uint8 codes, fitted on the range of each dimension:
+    // x[j] is approximated by offset[j] + scale[j] * code[j]
+    struct Int8Quantizer {
+        index_type feat_dim = 0;
+        std::vector<float> scale;
+        std::vector<float> offset;
+
+        void fit(const pecos::drm_t &X) {
+            feat_dim = X.cols;
+            std::vector<float> lo(feat_dim, std::numeric_limits<float>::max());
+            std::vector<float> hi(feat_dim, std::numeric_limits<float>::lowest());
+            for (index_type i = 0; i < X.rows; i++) {
+                const float *x = X.get_row(i).val;
+                for (index_type j = 0; j < feat_dim; j++) {
+                    lo[j] = std::min(lo[j], x[j]);
+                    hi[j] = std::max(hi[j], x[j]);
+                }
+            }
+            scale.resize(feat_dim);
+            offset.resize(feat_dim);
+            for (index_type j = 0; j < feat_dim; j++) {
+                if (X.rows == 0) {
+                    lo[j] = hi[j] = 0;
+                }
+                offset[j] = lo[j];
+                scale[j] = (hi[j] > lo[j]) ? (hi[j] - lo[j]) / 255.0f : 1.0f;
+            }
+        }
+
+        // values outside the fitted range are clamped
+        void encode(const float *x, uint8_t *code) const {
+            for (index_type j = 0; j < feat_dim; j++) {
+                float c = std::round((x[j] - offset[j]) / scale[j]);
+                code[j] = (uint8_t) std::min(255.0f, std::max(0.0f, c));
+            }
+        }
+
+        // number of float-sized slots that hold the codes of one vector
+        size_t get_feat_mem_dim() const {
+            return (feat_dim + sizeof(float) - 1) / sizeof(float);
+        }
+    };
+
+    // Distances between Int8Quantizer codes, decoded on the fly. Like SparseInnerProductSpace, the graph stores
+    // each node in get_feat_mem_dim() float-sized slots. The quantizer has to outlive the space.
+    class Int8Space : public DistanceBase<float> {
+        DistFn<float> dist_fn;
+        Int8DistParams params;
+        size_t feat_mem_dim;
+    public:
+        Int8Space(const Int8Quantizer &quantizer, bool inner_product) {
+            this->dist_fn = inner_product ? get_int8_inner_product_fn() : get_int8_l2_sqr_fn();
+            this->params.feat_dim = quantizer.feat_dim;
+            this->params.scale = quantizer.scale.data();
+            this->params.offset = quantizer.offset.data();
+            this->feat_mem_dim = quantizer.get_feat_mem_dim();
+        }
+
+        DistFn<float> get_dist_fn() {
+            return dist_fn;
+        }
+
+        void *get_dist_feat_dim() {
+            return &params;
+        }
+
+        size_t get_feat_mem_dim() const {
+            return feat_mem_dim;
+        }
+
+        ~Int8Space() {}
+    };
+
+    // A distance kernel fixed at compile time: search loops instantiated for it call the kernel directly
+    template<typename MTYPE, MTYPE (*kernel)(const void *, const void *, const void *)>
+    struct StaticDistOp {
+        const void *param;
+        MTYPE operator()(const void *x, const void *y) const { return kernel(x, y, param); }
+    };
+
+    // any other kernel, called through the pointer
+    template<typename MTYPE>
+    struct DynamicDistOp {
+        DistFn<MTYPE> kernel;
+        const void *param;
+        MTYPE operator()(const void *x, const void *y) const { return kernel(x, y, param); }
+    };
+
+    // Calls visit with the distance op of fn, once per search rather than once per distance.
+    // The kernels of distance.hpp and SparseInnerProduct get their StaticDistOp, anything else a DynamicDistOp.
+    template<typename MTYPE, class Visitor>
+    auto visit_dist_op(DistFn<MTYPE> fn, const void *param, Visitor &&visit) -> decltype(visit(DynamicDistOp<MTYPE>{fn, param})) {
+        return visit(DynamicDistOp<MTYPE>{fn, param});
+    }
+
+    template<class Visitor>
+    auto visit_dist_op(DistFn<float> fn, const void *param, Visitor &&visit) -> decltype(visit(DynamicDistOp<float>{fn, param})) {
+#define PECOS_ANN_VISIT_KERNEL(kernel) \
+        if (fn == &kernel) { \
+            return visit(StaticDistOp<float, &kernel>{param}); \
+        }
+        PECOS_ANN_VISIT_KERNEL(simd_none::InnerProduct)
+        PECOS_ANN_VISIT_KERNEL(simd_none::L2Sqr)
+        PECOS_ANN_VISIT_KERNEL(simd_none::Int8InnerProduct)
+        PECOS_ANN_VISIT_KERNEL(simd_none::Int8L2Sqr)
+#ifdef PECOS_ANN_X86_SIMD
+        PECOS_ANN_VISIT_KERNEL(simd_avx2::InnerProduct)
+        PECOS_ANN_VISIT_KERNEL(simd_avx2::L2Sqr)
+        PECOS_ANN_VISIT_KERNEL(simd_avx2::Int8InnerProduct)
+        PECOS_ANN_VISIT_KERNEL(simd_avx2::Int8L2Sqr)
+        PECOS_ANN_VISIT_KERNEL(simd_avx512::InnerProduct)
+        PECOS_ANN_VISIT_KERNEL(simd_avx512::L2Sqr)
+        PECOS_ANN_VISIT_KERNEL(simd_avx512::Int8InnerProduct)
+        PECOS_ANN_VISIT_KERNEL(simd_avx512::Int8L2Sqr)
+#endif
+        PECOS_ANN_VISIT_KERNEL(SparseInnerProduct)
+#undef PECOS_ANN_VISIT_KERNEL
+        return visit(DynamicDistOp<float>{fn, param});
+    }
+
     struct GraphBase {
         virtual index_type* get_node_degree_ptr(index_type node_id, index_type dummy_level_id=0) = 0;
         virtual index_type* get_node_neighbor_ptr(index_type node_id, index_type dummy_level_id=0) = 0;
@@ -110,24 +324,86 @@ namespace ann {
         index_type node_mem_size;
         std::vector<char> buffer;
 
+        // Features of variable length (see HNSW::train for csr_t) are not part of the node blocks, which then
+        // have feat_dim == 0. Node i owns the float-sized slots [feat_offset[i], feat_offset[i + 1]) of feat_arena.
+        bool sparse_feat = false;
+        std::vector<uint64_t> feat_offset;
+        std::vector<float> feat_arena;
+
+        // set by HNSW::load_mmap, the nodes then live in mapped_file and buffer is empty
+        std::shared_ptr<ReadOnlyMappedFile> mapped_file;
+        char *mapped_ptr = nullptr;
+        float *mapped_feat_arena = nullptr;
+
         void resize(index_type num_node, index_type feat_dim, index_type max_degree) {
             this->num_node = num_node;
             this->feat_dim = feat_dim;
             this->max_degree = max_degree;
             this->node_mem_size = feat_dim * sizeof(float) + (1 + max_degree) * sizeof(index_type);
-            buffer.resize(num_node * this->node_mem_size);
+            sparse_feat = false;
+            feat_offset.clear();
+            feat_arena.clear();
+            mapped_file.reset();
+            mapped_ptr = nullptr;
+            mapped_feat_arena = nullptr;
+            buffer.resize((size_t) num_node * this->node_mem_size);
+        }
+
+        // keeps the existing nodes, used by HNSW::add_points; arena features are appended by the caller
+        void grow(index_type num_node) {
+            if (mapped_ptr != nullptr) {
+                throw std::runtime_error("nodes can not be added to a memory mapped HNSW index");
+            }
+            this->num_node = num_node;
+            buffer.resize((size_t) num_node * node_mem_size);
+        }
+
+        // switch to arena features, offsets has num_node + 1 entries starting at 0.
+        // The arena is allocated unless it is mapped from a file by HNSW::load_mmap.
+        void resize_feat_arena(std::vector<uint64_t> offsets, float *mapped_arena=nullptr) {
+            if (feat_dim != 0 || offsets.size() != (size_t) num_node + 1) {
+                throw std::invalid_argument("feature arena needs a graph without inline features and num_node + 1 offsets");
+            }
+            sparse_feat = true;
+            feat_offset = std::move(offsets);
+            mapped_feat_arena = mapped_arena;
+            feat_arena.resize(mapped_arena ? 0 : feat_offset.back());
+        }
+
+        inline size_t mem_size() const {
+            return (size_t) num_node * node_mem_size;
+        }
+
+        inline char* data() {
+            return mapped_ptr ? mapped_ptr : buffer.data();
+        }
+
+        inline float* feat_arena_data() {
+            return mapped_feat_arena ? mapped_feat_arena : feat_arena.data();
+        }
+
+        // sizes in bytes of the two arena buffers, 0 for inline features
+        inline size_t feat_offset_mem_size() const {
+            return sparse_feat ? ((size_t) num_node + 1) * sizeof(uint64_t) : 0;
+        }
+
+        inline size_t feat_arena_mem_size() const {
+            return sparse_feat ? feat_offset[num_node] * sizeof(float) : 0;
         }
 
         inline float* get_node_feat(index_type node_id) {
-            return (float *) &buffer.data()[node_id * node_mem_size + (1 + max_degree) * sizeof(index_type)];
+            if (sparse_feat) {
+                return feat_arena_data() + feat_offset[node_id];
+            }
+            return (float *) &data()[(size_t) node_id * node_mem_size + (1 + max_degree) * sizeof(index_type)];
         }
 
         inline index_type* get_node_degree_ptr(index_type node_id, index_type dummy_level_id=0) {
-            return (index_type *) &buffer.data()[node_id * node_mem_size];
+            return (index_type *) &data()[(size_t) node_id * node_mem_size];
         }
 
         inline index_type* get_node_neighbor_ptr(index_type node_id, index_type dummy_level_id=0) {
-            return (index_type *) &buffer.data()[node_id * node_mem_size + 1 * sizeof(index_type)];
+            return (index_type *) &data()[(size_t) node_id * node_mem_size + 1 * sizeof(index_type)];
         }
     };
 
@@ -139,20 +415,43 @@ namespace ann {
         index_type level_mem_size;
         std::vector<index_type> buffer;
 
+        // set by HNSW::load_mmap, see GraphL0
+        std::shared_ptr<ReadOnlyMappedFile> mapped_file;
+        index_type *mapped_ptr = nullptr;
+
         void resize(index_type num_node, index_type max_level, index_type max_degree) {
             this->num_node = num_node;
             this->max_level = max_level;
             this->max_degree = max_degree;
             this->level_mem_size = 1 + max_degree;
             this->node_mem_size = max_level * this->level_mem_size;
-            buffer.resize(num_node * this->node_mem_size);
+            mapped_file.reset();
+            mapped_ptr = nullptr;
+            buffer.resize((size_t) num_node * this->node_mem_size);
+        }
+
+        inline size_t mem_size() const {
+            return (size_t) num_node * node_mem_size * sizeof(index_type);
+        }
+
+        // see GraphL0::grow
+        void grow(index_type num_node) {
+            if (mapped_ptr != nullptr) {
+                throw std::runtime_error("nodes can not be added to a memory mapped HNSW index");
+            }
+            this->num_node = num_node;
+            buffer.resize((size_t) num_node * node_mem_size);
+        }
+
+        inline index_type* data() {
+            return mapped_ptr ? mapped_ptr : buffer.data();
         }
 
         inline index_type* get_node_degree_ptr(index_type node_id, index_type level_id=0) {
             if (level_id == 0) {
                 throw std::runtime_error("get_node_degree_ptr can not have level_id == 0!");
             }
-            return &buffer[node_id * this->node_mem_size + (level_id - 1) * this->level_mem_size];
+            return &data()[(size_t) node_id * this->node_mem_size + (level_id - 1) * this->level_mem_size];
         }
 
         inline index_type* get_node_neighbor_ptr(index_type node_id, index_type level_id=0) {
@@ -160,6 +459,14 @@ namespace ann {
         }
     };
 
+    // node orderings applied by HNSW::reorder
+    enum reorder_t {
+        REORDER_NONE,
+        REORDER_BFS,     // breadth first from the entry point
+        REORDER_RCM,     // reverse Cuthill-McKee, neighbors visited by increasing degree
+        REORDER_DEGREE,  // decreasing in-degree, the most linked nodes share cache lines and pages
+    };
+
     // PECOS-HNSW Interface
     template<typename dist_t>
     struct HNSW {
@@ -168,6 +475,8 @@ namespace ann {
             constexpr bool operator()(pair_t const &a, pair_t const &b) const noexcept { return a.first < b.first; }
         };
         typedef typename std::priority_queue<pair_t, std::vector<pair_t>, CompareByFirst> max_heap_t;
+        // one lock per node guarding its neighbor lists while the graph is built by several threads
+        typedef std::vector<std::mutex> node_locks_t;
 
         template<class T>
         struct SetOfVistedNodes {
@@ -193,6 +502,25 @@ namespace ann {
             }
         };
 
+        // per-query search state, one per concurrently searching thread
+        struct Searcher {
+            SetOfVistedNodes<unsigned short int> visited;
+            Searcher(index_type num_node) : visited(num_node) { }
+        };
+
+        // searchers released after a query, reused so their visited sets are only allocated once
+        struct SearcherPool {
+            std::mutex lock;
+            std::vector<std::unique_ptr<Searcher>> searchers;
+        };
+
+        // row i holds the neighbors of query i in [indptr[i], indptr[i + 1]), by increasing distance
+        struct BatchResult {
+            std::vector<uint64_t> indptr;
+            std::vector<index_type> indices;
+            std::vector<dist_t> dists;
+        };
+
         // scalar variables
         index_type num_node;
         index_type feat_dim;
@@ -210,13 +538,23 @@ namespace ann {
         // data structures for multi-level graph
         GraphL1 graph_l1;
         GraphL0 graph_l0;
-        SetOfVistedNodes<unsigned short int> set_of_visited_nodes;
+        std::shared_ptr<SearcherPool> searcher_pool = std::make_shared<SearcherPool>();
         std::vector<index_type> node2level_vec;
+        // external id of every node after reorder or compact, empty while nodes keep the ids they were trained with
+        std::vector<index_type> node_labels;
+        // tombstones set by mark_deleted, empty while no node is deleted
+        std::vector<uint8_t> node_deleted;
+        index_type num_deleted = 0;
         std::default_random_engine level_generator_;
         std::default_random_engine update_probability_generator_;
 
-        // constructor
-        HNSW(DistanceBase<dist_t> *s) {}
+        // constructor, for an index that is then loaded from a file
+        HNSW(DistanceBase<dist_t> *s) {
+            this->num_node = 0;
+            this->feat_dim = 0;
+            this->dist_fn = s->get_dist_fn();
+            this->dist_feat_dim = s->get_dist_feat_dim();
+        }
 
         // constructor
         HNSW(
@@ -225,7 +563,7 @@ namespace ann {
             index_type feat_dim,
             index_type M=16,
             index_type efC=200
-        ) : set_of_visited_nodes(num_node) {
+        ) {
             this->num_node = num_node;
             this->feat_dim = feat_dim;
             this->dist_fn = s->get_dist_fn();
@@ -284,7 +622,8 @@ namespace ann {
         }
 
         // line 10-17, Algorithm 1 of HNSW paper
-        index_type mutually_connect(index_type query_id, max_heap_t &top_candidates, index_type level) {
+        // node_locks is nullptr when a single thread modifies the graph
+        index_type mutually_connect(index_type query_id, max_heap_t &top_candidates, index_type level, node_locks_t *node_locks=nullptr) {
             index_type Mcurmax = level ? this->maxM : this->maxM0;
             get_neighbors_heuristic(top_candidates, this->maxM);
             if (top_candidates.size() > this->maxM) {
@@ -307,21 +646,55 @@ namespace ann {
             }
 
             // for node in selected_neighbors, connect query_id to node
-            auto degree_ptr = G->get_node_degree_ptr(query_id, level);
-            *degree_ptr = selected_neighbors.size();
-            auto neighbors = degree_ptr + 1;
-            for (index_type idx = 0; idx < selected_neighbors.size(); idx++) {
-                if (neighbors[idx]) {
-                    throw std::runtime_error("Possible memory corruption");
+            {
+                std::unique_lock<std::mutex> lock_node;
+                if (node_locks) {
+                    lock_node = std::unique_lock<std::mutex>((*node_locks)[query_id]);
                 }
-                if (level > node2level_vec[selected_neighbors[idx]]) {
-                    throw std::runtime_error("Trying to make a link on a non-existent level");
+                auto degree_ptr = G->get_node_degree_ptr(query_id, level);
+                auto neighbors = degree_ptr + 1;
+                auto num_edges = *degree_ptr;
+                if (num_edges == 0) {
+                    *degree_ptr = selected_neighbors.size();
+                    for (index_type idx = 0; idx < selected_neighbors.size(); idx++) {
+                        if (neighbors[idx]) {
+                            throw std::runtime_error("Possible memory corruption");
+                        }
+                        if (level > node2level_vec[selected_neighbors[idx]]) {
+                            throw std::runtime_error("Trying to make a link on a non-existent level");
+                        }
+                        neighbors[idx] = selected_neighbors[idx];
+                    }
+                } else {
+                    // another thread reached query_id from the level above and already linked to it,
+                    // so its links are merged with the selected ones and pruned like a full list
+                    const void *query_feat_ptr = graph_l0.get_node_feat(query_id);
+                    max_heap_t candidates;
+                    for (index_type j = 0; j < num_edges; j++) {
+                        candidates.emplace(dist_fn(query_feat_ptr, graph_l0.get_node_feat(neighbors[j]), dist_feat_dim), neighbors[j]);
+                    }
+                    for (auto node : selected_neighbors) {
+                        if (std::find(neighbors, neighbors + num_edges, node) == neighbors + num_edges) {
+                            candidates.emplace(dist_fn(query_feat_ptr, graph_l0.get_node_feat(node), dist_feat_dim), node);
+                        }
+                    }
+                    get_neighbors_heuristic(candidates, Mcurmax);
+                    index_type indx = 0;
+                    while (candidates.size() > 0) {
+                        neighbors[indx] = candidates.top().second;
+                        candidates.pop();
+                        indx++;
+                    }
+                    *degree_ptr = indx;
                 }
-                neighbors[idx] = selected_neighbors[idx];
             }
 
             // for node in selected_neighbors, connect node to query_id
             for (index_type idx = 0; idx < selected_neighbors.size(); idx++) {
+                std::unique_lock<std::mutex> lock_node;
+                if (node_locks) {
+                    lock_node = std::unique_lock<std::mutex>((*node_locks)[selected_neighbors[idx]]);
+                }
                 auto degree_ptr = G->get_node_degree_ptr(selected_neighbors[idx], level);
                 auto neighbors = degree_ptr + 1;
                 auto num_edges = *degree_ptr;
@@ -368,86 +741,372 @@ namespace ann {
             return next_closest_entry_point;
         }
 
+        // greedy search with ef=1 from curr_node on the levels above target_level, used before search_layer
+        index_type search_upper_levels(const void *query, index_type curr_node, index_type top_level, index_type target_level, node_locks_t *node_locks=nullptr) {
+            return search_upper_levels(DynamicDistOp<dist_t>{dist_fn, dist_feat_dim}, query, curr_node, top_level, target_level, node_locks);
+        }
+
+        template<class dist_op_t>
+        index_type search_upper_levels(const dist_op_t &dist, const void *query, index_type curr_node, index_type top_level, index_type target_level, node_locks_t *node_locks=nullptr) {
+            dist_t curr_dist = dist(query, graph_l0.get_node_feat(curr_node));
+            for (auto level = top_level; level > target_level; level--) {
+                bool changed = true;
+                while (changed) {
+                    changed = false;
+                    std::unique_lock<std::mutex> lock_node;
+                    if (node_locks) {
+                        lock_node = std::unique_lock<std::mutex>((*node_locks)[curr_node]);
+                    }
+                    auto degree_ptr = graph_l1.get_node_degree_ptr(curr_node, level);
+                    auto neighbors = degree_ptr + 1;
+                    auto num_edges = *degree_ptr;
+                    for (index_type j = 0; j < num_edges; j++) {
+                        index_type next_node = neighbors[j];
+                        dist_t next_dist = dist(query, graph_l0.get_node_feat(next_node));
+                        if (next_dist < curr_dist) {
+                            curr_dist = next_dist;
+                            curr_node = next_node;
+                            changed = true;
+                        }
+                    }
+                }
+            }
+            return curr_node;
+        }
+
         // train, Algorithm 1 of HNSW paper (i.e., construct HNSW graph)
-        void train(pecos::drm_t &X_trn, index_type max_level_upper_bound) {
+        // Points are inserted by `threads` workers concurrently. Each neighbor list is guarded by its node's lock,
+        // and a node that raises the maximum level holds the global lock for its whole insertion, so the entry point
+        // is never visible before its links. Levels are sampled up front, so a single thread builds the same graph
+        // as the sequential algorithm.
+        void train(pecos::drm_t &X_trn, index_type max_level_upper_bound, int threads=1) {
+            this->num_node = X_trn.rows;
+            this->feat_dim = X_trn.cols;
+            graph_l0.resize(this->num_node, this->feat_dim, this->maxM0);
+            for (index_type node_id = 0; node_id < num_node; node_id++) {
+                std::memcpy(graph_l0.get_node_feat(node_id), X_trn.get_row(node_id).val, sizeof(float) * this->feat_dim);
+            }
+            build_graph(max_level_upper_bound, threads);
+        }
+
+        // Sparse rows are kept at their own length in the feature arena of graph_l0, in the layout of
+        // SparseInnerProduct, so the index has to use a SparseInnerProductSpace. feat_dim is the number of columns.
+        void train(const pecos::csr_t &X_trn, index_type max_level_upper_bound, int threads=1) {
             this->num_node = X_trn.rows;
             this->feat_dim = X_trn.cols;
+            graph_l0.resize(this->num_node, 0, this->maxM0);
+            std::vector<uint64_t> offsets(num_node + 1, 0);
+            for (index_type node_id = 0; node_id < num_node; node_id++) {
+                offsets[node_id + 1] = offsets[node_id] + SparseInnerProductSpace::get_feat_mem_dim(X_trn.nnz_of_row(node_id));
+            }
+            graph_l0.resize_feat_arena(std::move(offsets));
+            parallel_for<index_type>(0, num_node, [&](index_type node_id, int thread_id) {
+                const auto &row = X_trn.get_row(node_id);
+                SparseInnerProductSpace::encode(row.idx, row.val, row.nnz, graph_l0.get_node_feat(node_id));
+            }, threads);
+            build_graph(max_level_upper_bound, threads);
+        }
+
+    private:
+        // link the nodes whose features are already in graph_l0
+        void build_graph(index_type max_level_upper_bound, int threads) {
+            graph_l1.resize(this->num_node, max_level_upper_bound, this->maxM);
+            node2level_vec.clear();
+            node_labels.clear();
+            node_deleted.clear();
+            num_deleted = 0;
+            insert_nodes(0, threads);
+        }
+
+        // sample the levels of the nodes from begin on, whose features are in graph_l0, and link them to the graph
+        void insert_nodes(index_type begin, int threads) {
             // this is m_l defined in Sec 4.1 of HNSW paper
             float mult_l = 1.0 / log(1.0 * this->maxM);
+            index_type max_level_upper_bound = graph_l1.max_level;
 
-            graph_l1.resize(this->num_node, max_level_upper_bound, this->maxM);
-            graph_l0.resize(this->num_node, this->feat_dim, this->maxM0);
             node2level_vec.resize(num_node);
+            for (index_type node_id = begin; node_id < num_node; node_id++) {
+                index_type node_level = get_random_level(mult_l);
+                node2level_vec[node_id] = std::min(node_level, max_level_upper_bound);
+            }
+            if (begin >= num_node) {
+                return;
+            }
 
-            index_type entrypoint_id = 0;
-            index_type max_level = 0;
-            // add point sequentially
-            for (index_type query_id = 0; query_id < num_node; query_id++) {
-                bool is_first_node = (query_id == 0);
+            threads = std::max(1, std::min<int>(resolve_threads(threads), num_node - begin));
+            node_locks_t node_locks(threads > 1 ? num_node : 0);
+            std::mutex global_lock;
+            std::vector<SetOfVistedNodes<unsigned short int>> visited_per_thread(threads, SetOfVistedNodes<unsigned short int>(num_node));
+            node_locks_t *locks_ptr = (threads > 1) ? &node_locks : nullptr;
+
+            // the first node of an empty graph is its entry point
+            index_type entrypoint_id = (begin == 0) ? 0 : this->init_node;
+            index_type max_level = (begin == 0) ? node2level_vec[0] : this->max_level;
+            if (begin == 0) {
+                begin = 1;
+            }
 
-                // assign query node features to graph_l0
-                dist_t *query_feat_ptr = X_trn.get_row(query_id).val;
-                std::memcpy(graph_l0.get_node_feat(query_id), query_feat_ptr, sizeof(float) * this->feat_dim);
+            auto add_point = [&](index_type query_id, int thread_id) {
+                index_type query_level = node2level_vec[query_id];
+                const dist_t *query_feat_ptr = graph_l0.get_node_feat(query_id);
 
-                // sample the query node's level
-                index_type query_level = get_random_level(mult_l);
-                if (query_level > max_level_upper_bound) {
-                    query_level = max_level_upper_bound;
+                std::unique_lock<std::mutex> lock_global(global_lock);
+                index_type curr_max_level = max_level;
+                index_type curr_node = entrypoint_id;
+                if (query_level <= curr_max_level) {
+                    lock_global.unlock();
                 }
-                node2level_vec[query_id] = query_level;
 
-                index_type curr_node = entrypoint_id;
-                if (is_first_node) {
-                    entrypoint_id = 0;
-                    max_level = query_level;
-                } else {
-                    // find entrypoint with ef=1 for layer > 1
-                    if (query_level < max_level) {
-                        dist_t curr_dist = dist_fn(query_feat_ptr, graph_l0.get_node_feat(curr_node), dist_feat_dim);
-                        for (auto level = max_level; level > query_level; level--) {
-                            bool changed = true;
-                            while (changed) {
-                                changed = false;
-                                auto degree_ptr = graph_l1.get_node_degree_ptr(curr_node, level);
-                                auto neighbors = degree_ptr + 1;
-                                auto num_edges = *degree_ptr;
-                                for (index_type j = 0; j < num_edges; j++) {
-                                    index_type next_node = neighbors[j];
-                                    dist_t next_dist = dist_fn(query_feat_ptr, graph_l0.get_node_feat(next_node), dist_feat_dim);
-                                    if (next_dist < curr_dist) {
-                                        curr_dist = next_dist;
-                                        curr_node = next_node;
-                                        changed = true;
-                                    }
-                                }
-                            }
-                        }
-                    }
-                    for (auto level=std::min(query_level, max_level); ; level--) {
-                        auto top_candidates = search_layer(query_feat_ptr, curr_node, this->efC, level);
-                        curr_node = mutually_connect(query_id, top_candidates, level);
-                        if (level == 0) { break; }
-                    }
+                // find entrypoint with ef=1 for layer > 1
+                if (query_level < curr_max_level) {
+                    curr_node = search_upper_levels(query_feat_ptr, curr_node, curr_max_level, query_level, locks_ptr);
                 }
-                if (query_level > max_level) {
+                auto &visited = visited_per_thread[thread_id];
+                for (auto level = std::min(query_level, curr_max_level); ; level--) {
+                    auto top_candidates = search_layer(query_feat_ptr, curr_node, this->efC, level, visited, locks_ptr);
+                    curr_node = mutually_connect(query_id, top_candidates, level, locks_ptr);
+                    if (level == 0) { break; }
+                }
+
+                if (query_level > curr_max_level) {
                     entrypoint_id = query_id;
                     max_level = query_level;
                 }
-            }
+            };
+            parallel_for<index_type>(begin, num_node, add_point, threads);
+
             this->max_level = max_level;
             this->init_node = entrypoint_id;
         }
 
+    public:
+        // ===== Incremental updates =====
+        // Inserts the rows of X after the existing nodes, as train would have, and returns the id of the first one;
+        // the others follow consecutively. Ids continue after the largest id in the index, which after compact
+        // can be the id of a compacted node. No search may run concurrently.
+        index_type add_points(const pecos::drm_t &X, int threads=1) {
+            if (graph_l0.sparse_feat) {
+                throw std::invalid_argument("the index was trained on sparse features, points have to be a csr_t");
+            }
+            if (X.rows > 0 && X.cols != graph_l0.feat_dim) {
+                throw std::invalid_argument("points have " + std::to_string(X.cols) + " columns, the index has " + std::to_string(graph_l0.feat_dim));
+            }
+            index_type first_id = next_label();
+            index_type begin = num_node;
+            grow(num_node + X.rows);
+            for (index_type i = 0; i < X.rows; i++) {
+                std::memcpy(graph_l0.get_node_feat(begin + i), X.get_row(i).val, sizeof(float) * graph_l0.feat_dim);
+            }
+            insert_nodes(begin, threads);
+            return first_id;
+        }
+
+        index_type add_points(const pecos::csr_t &X, int threads=1) {
+            if (!graph_l0.sparse_feat) {
+                throw std::invalid_argument("the index was trained on dense features, points have to be a drm_t");
+            }
+            index_type first_id = next_label();
+            index_type begin = num_node;
+            grow(num_node + X.rows);
+            auto &offsets = graph_l0.feat_offset;
+            for (index_type i = 0; i < X.rows; i++) {
+                offsets.push_back(offsets.back() + SparseInnerProductSpace::get_feat_mem_dim(X.nnz_of_row(i)));
+            }
+            graph_l0.feat_arena.resize(offsets.back());
+            for (index_type i = 0; i < X.rows; i++) {
+                const auto &row = X.get_row(i);
+                SparseInnerProductSpace::encode(row.idx, row.val, row.nnz, graph_l0.get_node_feat(begin + i));
+            }
+            insert_nodes(begin, threads);
+            return first_id;
+        }
+
+        // Tombstones the nodes with the given ids: searches still walk through them but never return them.
+        // Returns the number of nodes that were not deleted before. No search may run concurrently.
+        index_type mark_deleted(const std::vector<index_type> &ids) {
+            std::vector<index_type> internal_of_label;
+            if (!node_labels.empty()) {
+                internal_of_label.assign(next_label(), num_node);
+                for (index_type node = 0; node < num_node; node++) {
+                    internal_of_label[node_labels[node]] = node;
+                }
+            }
+            node_deleted.resize(num_node, 0);
+            index_type newly_deleted = 0;
+            for (auto id : ids) {
+                index_type node = node_labels.empty() ? id : (id < internal_of_label.size() ? internal_of_label[id] : num_node);
+                if (node >= num_node) {
+                    throw std::invalid_argument("id " + std::to_string(id) + " is not in the index");
+                }
+                if (!node_deleted[node]) {
+                    node_deleted[node] = 1;
+                    newly_deleted++;
+                }
+            }
+            num_deleted += newly_deleted;
+            return newly_deleted;
+        }
+
+        inline index_type get_num_deleted() const {
+            return num_deleted;
+        }
+
+        // Once more than max_deleted_fraction of the nodes are tombstones, links to them are replaced by links to
+        // their live neighbors (pruned with the neighbor heuristic) and the tombstones are dropped from the index.
+        // Ids of the remaining nodes do not change. Returns whether the index was compacted.
+        // No search may run concurrently.
+        bool compact(double max_deleted_fraction=0.1, int threads=1) {
+            if (num_deleted == 0 || num_deleted <= max_deleted_fraction * num_node) {
+                return false;
+            }
+            if (graph_l0.mapped_ptr != nullptr || graph_l1.mapped_ptr != nullptr) {
+                throw std::runtime_error("a memory mapped HNSW index can not be compacted");
+            }
+
+            // every live node only rewrites its own lists and reads the lists of deleted nodes, which stay as they are
+            parallel_for<index_type>(0, num_node, [&](index_type node, int thread_id) {
+                if (node_deleted[node]) {
+                    return;
+                }
+                for (index_type level = 0; level <= node2level_vec[node]; level++) {
+                    repair_links(node, level);
+                }
+            }, threads);
+
+            std::vector<index_type> old_of_new;
+            index_type entrypoint_id = num_node;
+            for (index_type node = 0; node < num_node; node++) {
+                if (!node_deleted[node]) {
+                    old_of_new.push_back(node);
+                    if (entrypoint_id == num_node || node2level_vec[node] > node2level_vec[entrypoint_id]) {
+                        entrypoint_id = node;
+                    }
+                }
+            }
+            if (!node_deleted[init_node]) {
+                entrypoint_id = init_node;
+            }
+            if (!old_of_new.empty()) {
+                init_node = entrypoint_id;
+                max_level = node2level_vec[entrypoint_id];
+            }
+            permute_nodes(old_of_new);
+            return true;
+        }
+
+    private:
+        // external id that the next added node gets
+        index_type next_label() const {
+            if (node_labels.empty()) {
+                return num_node;
+            }
+            return *std::max_element(node_labels.begin(), node_labels.end()) + 1;
+        }
+
+        void grow(index_type new_num_node) {
+            graph_l0.grow(new_num_node);
+            graph_l1.grow(new_num_node);
+            index_type next = next_label();
+            for (index_type node = num_node; node < new_num_node && !node_labels.empty(); node++) {
+                node_labels.push_back(next++);
+            }
+            if (!node_deleted.empty()) {
+                node_deleted.resize(new_num_node, 0);
+            }
+            num_node = new_num_node;
+        }
+
+        // replaces the links of node on level to deleted nodes by the live neighbors of those
+        void repair_links(index_type node, index_type level) {
+            GraphBase *G = (level == 0) ? (GraphBase *) &graph_l0 : (GraphBase *) &graph_l1;
+            index_type *degree_ptr = G->get_node_degree_ptr(node, level);
+            index_type *neighbors = degree_ptr + 1;
+            index_type num_edges = *degree_ptr;
+            bool has_deleted = false;
+            for (index_type j = 0; j < num_edges && !has_deleted; j++) {
+                has_deleted = node_deleted[neighbors[j]];
+            }
+            if (!has_deleted) {
+                return;
+            }
+
+            std::vector<index_type> candidates;
+            for (index_type j = 0; j < num_edges; j++) {
+                index_type next_node = neighbors[j];
+                if (!node_deleted[next_node]) {
+                    candidates.push_back(next_node);
+                    continue;
+                }
+                index_type *next_degree_ptr = G->get_node_degree_ptr(next_node, level);
+                for (index_type k = 0; k < *next_degree_ptr; k++) {
+                    index_type hop = next_degree_ptr[1 + k];
+                    if (hop != node && !node_deleted[hop]) {
+                        candidates.push_back(hop);
+                    }
+                }
+            }
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+            const void *node_feat_ptr = graph_l0.get_node_feat(node);
+            max_heap_t top_candidates;
+            for (auto candidate : candidates) {
+                top_candidates.emplace(dist_fn(node_feat_ptr, graph_l0.get_node_feat(candidate), dist_feat_dim), candidate);
+            }
+            index_type Mcurmax = level ? this->maxM : this->maxM0;
+            get_neighbors_heuristic(top_candidates, Mcurmax);
+            index_type indx = 0;
+            while (top_candidates.size() > 0) {
+                neighbors[indx] = top_candidates.top().second;
+                top_candidates.pop();
+                indx++;
+            }
+            *degree_ptr = indx;
+        }
+
+    public:
+
         // Algorithm 2 of HNSW paper
-        max_heap_t search_layer(const void *query, index_type init_node, index_type efS, index_type level) {
+        // node_locks is set while other threads may be modifying the graph
+        template<class T>
+        max_heap_t search_layer(
+            const void *query,
+            index_type init_node,
+            index_type efS,
+            index_type level,
+            SetOfVistedNodes<T> &visited,
+            node_locks_t *node_locks=nullptr,
+            bool skip_deleted=false
+        ) {
+            return search_layer(DynamicDistOp<dist_t>{dist_fn, dist_feat_dim}, query, init_node, efS, level, visited, node_locks, skip_deleted);
+        }
+
+        // the same with the distance op given, see visit_dist_op
+        template<class T, class dist_op_t>
+        max_heap_t search_layer(
+            const dist_op_t &dist,
+            const void *query,
+            index_type init_node,
+            index_type efS,
+            index_type level,
+            SetOfVistedNodes<T> &visited,
+            node_locks_t *node_locks=nullptr,
+            bool skip_deleted=false
+        ) {
             max_heap_t topk_queue;
             max_heap_t cand_queue;
-            set_of_visited_nodes.reset();
-
-            dist_t topk_ub_dist = dist_fn(query, graph_l0.get_node_feat(init_node), dist_feat_dim);
-            topk_queue.emplace(topk_ub_dist, init_node);
-            cand_queue.emplace(-topk_ub_dist, init_node);
-            set_of_visited_nodes.mark_visited(init_node);
+            visited.reset();
+            // deleted nodes are walked through but kept out of the results
+            const uint8_t *deleted = (skip_deleted && num_deleted > 0) ? node_deleted.data() : nullptr;
+
+            dist_t init_dist = dist(query, graph_l0.get_node_feat(init_node));
+            dist_t topk_ub_dist = std::numeric_limits<dist_t>::max();
+            if (!deleted || !deleted[init_node]) {
+                topk_ub_dist = init_dist;
+                topk_queue.emplace(init_dist, init_node);
+            }
+            cand_queue.emplace(-init_dist, init_node);
+            visited.mark_visited(init_node);
 
             GraphBase *G;
             if (level == 0) {
@@ -465,18 +1124,24 @@ namespace ann {
                 cand_queue.pop();
 
                 index_type cand_node = cand_pair.second;
+                std::unique_lock<std::mutex> lock_node;
+                if (node_locks) {
+                    lock_node = std::unique_lock<std::mutex>((*node_locks)[cand_node]);
+                }
                 auto degree_ptr = G->get_node_degree_ptr(cand_node, level);
                 auto neighbors = degree_ptr + 1;
                 auto num_edges = *degree_ptr;
                 // visiting neighbors of candidate node
                 for (index_type j = 0; j < num_edges; j++) {
                     index_type next_node = neighbors[j];
-                    if (!set_of_visited_nodes.is_visited(next_node)) {
-                        set_of_visited_nodes.mark_visited(next_node);
+                    if (!visited.is_visited(next_node)) {
+                        visited.mark_visited(next_node);
                         dist_t next_lb_dist;
-                        next_lb_dist = dist_fn(query, graph_l0.get_node_feat(next_node), dist_feat_dim);
+                        next_lb_dist = dist(query, graph_l0.get_node_feat(next_node));
                         if (next_lb_dist < topk_ub_dist || topk_queue.size() < efS) {
-                            topk_queue.emplace(next_lb_dist, next_node);
+                            if (!deleted || !deleted[next_node]) {
+                                topk_queue.emplace(next_lb_dist, next_node);
+                            }
                             cand_queue.emplace(-next_lb_dist, next_node);
                             if (topk_queue.size() > efS) {
                                 topk_queue.pop();
@@ -491,48 +1156,671 @@ namespace ann {
             return topk_queue;
         }
 
-        // Algorithm 5 of HNSW paper
-        // current implementation is not thread safe
-        max_heap_t predict_single(const void *query, index_type efS, index_type topk=10) {
-            index_type curr_node = this->init_node;
-            auto &G1 = graph_l1;
-            auto &G0 = graph_l0;
-            // specialized search_layer for layer l=1,...,L because its faster for efS=1
-            dist_t curr_dist = dist_fn(query, G0.get_node_feat(init_node), dist_feat_dim);
-            for (index_type curr_level = this->max_level; curr_level >= 1; curr_level--) {
-                bool changed = true;
-                while (changed) {
-                    changed = false;
-                    auto degree_ptr = G1.get_node_degree_ptr(curr_node, curr_level);
-                    auto neighbors = degree_ptr + 1;
-                    auto num_edges = *degree_ptr;
-                    for (index_type j = 0; j < num_edges; j++) {
-                        index_type next_node = neighbors[j];
-                        dist_t next_dist = dist_fn(query, G0.get_node_feat(next_node), dist_feat_dim);
-                        if (next_dist < curr_dist) {
-                            curr_dist = next_dist;
-                            curr_node = next_node;
-                            changed = true;
-                        }
-                    }
+        // take a searcher from the pool, safe to call from several threads
+        std::unique_ptr<Searcher> acquire_searcher() {
+            std::unique_ptr<Searcher> searcher;
+            {
+                std::lock_guard<std::mutex> guard(searcher_pool->lock);
+                if (!searcher_pool->searchers.empty()) {
+                    searcher = std::move(searcher_pool->searchers.back());
+                    searcher_pool->searchers.pop_back();
                 }
             }
+            if (!searcher || searcher->visited.buffer.size() < num_node) {
+                searcher.reset(new Searcher(num_node));
+            }
+            return searcher;
+        }
+
+        void release_searcher(std::unique_ptr<Searcher> searcher) {
+            std::lock_guard<std::mutex> guard(searcher_pool->lock);
+            searcher_pool->searchers.push_back(std::move(searcher));
+        }
+
+        // Algorithm 5 of HNSW paper
+        // only reads the graph, so any number of threads can search one index, each with its own searcher
+        max_heap_t predict_single(const void *query, index_type efS, index_type topk, Searcher &searcher) {
+            if (num_node == 0) {
+                return max_heap_t();
+            }
+            return visit_dist_op(dist_fn, dist_feat_dim, [&](const auto &dist) {
+                return this->predict_single(dist, query, efS, topk, searcher);
+            });
+        }
+
+        // the search of predict_single, instantiated for each distance op
+        template<class dist_op_t>
+        max_heap_t predict_single(const dist_op_t &dist, const void *query, index_type efS, index_type topk, Searcher &searcher) {
+            // specialized search_layer for layer l=1,...,L because its faster for efS=1
+            index_type curr_node = search_upper_levels(dist, query, this->init_node, this->max_level, 0);
             // generalized search_layer for layer=0 for efS >= 1
-            auto topk_queue = search_layer(query, curr_node, std::max(efS, topk), 0);
+            auto topk_queue = search_layer(dist, query, curr_node, std::max(efS, topk), 0, searcher.visited, nullptr, true);
             // remove extra when efS > topk
             while (topk_queue.size() > topk) {
                 topk_queue.pop();
             }
-            // reverse order from smallest distance indices first
-            max_heap_t results;
-            while (topk_queue.size() > 0) {
-                auto rez = topk_queue.top();
-                results.push(pair_t(rez.first, rez.second));
-                topk_queue.pop();
+            if (!node_labels.empty()) {
+                max_heap_t labeled_queue;
+                for (; !topk_queue.empty(); topk_queue.pop()) {
+                    labeled_queue.emplace(topk_queue.top().first, node_labels[topk_queue.top().second]);
+                }
+                return labeled_queue;
             }
+            return topk_queue;
+        }
+
+        // thread safe, borrows a searcher from the pool for the query
+        max_heap_t predict_single(const void *query, index_type efS, index_type topk=10) {
+            auto searcher = acquire_searcher();
+            auto results = predict_single(query, efS, topk, *searcher);
+            release_searcher(std::move(searcher));
             return results;
         }
 
+        // sparse query for an index trained on a csr_t, thread safe
+        max_heap_t predict_single(const pecos::csr_t::row_vec_t &query, index_type efS, index_type topk=10) {
+            std::vector<float> query_feat(SparseInnerProductSpace::get_feat_mem_dim(query.nnz));
+            SparseInnerProductSpace::encode(query.idx, query.val, query.nnz, query_feat.data());
+            return predict_single(query_feat.data(), efS, topk);
+        }
+
+        // search every row of queries on up to `threads` threads
+        BatchResult predict_batch(const pecos::drm_t &queries, index_type efS, index_type topk, int threads=1) {
+            if (queries.rows > 0 && queries.cols != feat_dim) {
+                throw std::invalid_argument("queries have " + std::to_string(queries.cols) + " columns, the index has " + std::to_string(feat_dim));
+            }
+            if (graph_l0.sparse_feat) {
+                throw std::invalid_argument("the index was trained on sparse features, queries have to be a csr_t");
+            }
+            threads = std::max(1, std::min<int>(resolve_threads(threads), queries.rows));
+            std::vector<std::unique_ptr<Searcher>> searchers;
+            for (int t = 0; t < threads; t++) {
+                searchers.push_back(acquire_searcher());
+            }
+            auto result = batch_search(queries.rows, topk, threads, [&](index_type i, int thread_id) {
+                return predict_single(queries.get_row(i).val, efS, topk, *searchers[thread_id]);
+            });
+            for (auto &searcher : searchers) {
+                release_searcher(std::move(searcher));
+            }
+            return result;
+        }
+
+        BatchResult predict_batch(const pecos::csr_t &queries, index_type efS, index_type topk, int threads=1) {
+            if (queries.rows > 0 && queries.cols != feat_dim) {
+                throw std::invalid_argument("queries have " + std::to_string(queries.cols) + " columns, the index has " + std::to_string(feat_dim));
+            }
+            if (!graph_l0.sparse_feat) {
+                throw std::invalid_argument("the index was trained on dense features, queries have to be a drm_t");
+            }
+            threads = std::max(1, std::min<int>(resolve_threads(threads), queries.rows));
+            std::vector<std::unique_ptr<Searcher>> searchers;
+            for (int t = 0; t < threads; t++) {
+                searchers.push_back(acquire_searcher());
+            }
+            std::vector<std::vector<float>> query_feats(threads);
+            auto result = batch_search(queries.rows, topk, threads, [&](index_type i, int thread_id) {
+                const auto &row = queries.get_row(i);
+                auto &query_feat = query_feats[thread_id];
+                query_feat.resize(std::max<size_t>(query_feat.size(), SparseInnerProductSpace::get_feat_mem_dim(row.nnz)));
+                SparseInnerProductSpace::encode(row.idx, row.val, row.nnz, query_feat.data());
+                return predict_single(query_feat.data(), efS, topk, *searchers[thread_id]);
+            });
+            for (auto &searcher : searchers) {
+                release_searcher(std::move(searcher));
+            }
+            return result;
+        }
+
+        // calls search(i, thread_id) for every row i and packs the returned heaps of at most topk entries
+        template<class SearchFn>
+        static BatchResult batch_search(index_type rows, index_type topk, int threads, SearchFn search) {
+            // each row is written to its own slots first, then the rows are packed
+            std::vector<pair_t> slots((size_t) rows * topk);
+            std::vector<index_type> row_size(rows);
+            parallel_for<index_type>(0, rows, [&](index_type i, int thread_id) {
+                max_heap_t topk_queue = search(i, thread_id);
+                row_size[i] = topk_queue.size();
+                pair_t *row = &slots[(size_t) i * topk];
+                for (index_type j = topk_queue.size(); j > 0; j--) {
+                    row[j - 1] = topk_queue.top();
+                    topk_queue.pop();
+                }
+            }, threads);
+
+            BatchResult result;
+            result.indptr.resize(rows + 1, 0);
+            for (index_type i = 0; i < rows; i++) {
+                result.indptr[i + 1] = result.indptr[i] + row_size[i];
+            }
+            result.indices.resize(result.indptr.back());
+            result.dists.resize(result.indptr.back());
+            for (index_type i = 0; i < rows; i++) {
+                const pair_t *row = &slots[(size_t) i * topk];
+                for (index_type j = 0; j < row_size[i]; j++) {
+                    result.indices[result.indptr[i] + j] = row[j].second;
+                    result.dists[result.indptr[i] + j] = row[j].first;
+                }
+            }
+            return result;
+        }
+
+        // ===== Reordering =====
+        // Renumbers the nodes so that nodes linked in graph_l0 are stored close to each other, which turns the
+        // random memory accesses of a search into mostly nearby ones. Searches keep returning the ids the nodes
+        // were trained with, through node_labels. The index has to be in memory (not from load_mmap) and no
+        // search may run concurrently.
+        void reorder(reorder_t order) {
+            if (order == REORDER_NONE || num_node == 0) {
+                return;
+            }
+            if (graph_l0.mapped_ptr != nullptr || graph_l1.mapped_ptr != nullptr) {
+                throw std::runtime_error("a memory mapped HNSW index can not be reordered");
+            }
+            permute_nodes(compute_ordering(order));
+        }
+
+    private:
+        // keeps the nodes old_of_new lists, in that order; links to dropped nodes are removed.
+        // The entry point has to be kept unless every node is dropped.
+        void permute_nodes(const std::vector<index_type> &old_of_new) {
+            index_type new_num_node = old_of_new.size();
+            std::vector<index_type> new_of_old(num_node, new_num_node);
+            for (index_type n = 0; n < new_num_node; n++) {
+                new_of_old[old_of_new[n]] = n;
+            }
+
+            auto remap_neighbors = [&](index_type *degree_ptr) {
+                index_type *neighbors = degree_ptr + 1;
+                index_type degree = 0;
+                for (index_type j = 0; j < *degree_ptr; j++) {
+                    if (new_of_old[neighbors[j]] < new_num_node) {
+                        neighbors[degree++] = new_of_old[neighbors[j]];
+                    }
+                }
+                *degree_ptr = degree;
+            };
+
+            std::vector<char> l0_buffer((size_t) new_num_node * graph_l0.node_mem_size);
+            std::vector<index_type> l1_buffer((size_t) new_num_node * graph_l1.node_mem_size);
+            for (index_type n = 0; n < new_num_node; n++) {
+                index_type o = old_of_new[n];
+                std::memcpy(&l0_buffer[(size_t) n * graph_l0.node_mem_size],
+                    &graph_l0.buffer[(size_t) o * graph_l0.node_mem_size], graph_l0.node_mem_size);
+                remap_neighbors((index_type *) &l0_buffer[(size_t) n * graph_l0.node_mem_size]);
+                std::memcpy(&l1_buffer[(size_t) n * graph_l1.node_mem_size],
+                    &graph_l1.buffer[(size_t) o * graph_l1.node_mem_size], graph_l1.node_mem_size * sizeof(index_type));
+                for (index_type level = 1; level <= node2level_vec[o]; level++) {
+                    remap_neighbors(&l1_buffer[(size_t) n * graph_l1.node_mem_size + (level - 1) * graph_l1.level_mem_size]);
+                }
+            }
+            graph_l0.buffer.swap(l0_buffer);
+            graph_l1.buffer.swap(l1_buffer);
+            graph_l0.num_node = new_num_node;
+            graph_l1.num_node = new_num_node;
+
+            if (graph_l0.sparse_feat) {
+                std::vector<uint64_t> offsets(new_num_node + 1, 0);
+                for (index_type n = 0; n < new_num_node; n++) {
+                    index_type o = old_of_new[n];
+                    offsets[n + 1] = offsets[n] + (graph_l0.feat_offset[o + 1] - graph_l0.feat_offset[o]);
+                }
+                std::vector<float> arena(offsets.back());
+                for (index_type n = 0; n < new_num_node; n++) {
+                    std::memcpy(&arena[offsets[n]], graph_l0.get_node_feat(old_of_new[n]), (offsets[n + 1] - offsets[n]) * sizeof(float));
+                }
+                graph_l0.feat_offset.swap(offsets);
+                graph_l0.feat_arena.swap(arena);
+            }
+
+            std::vector<index_type> levels(new_num_node);
+            std::vector<index_type> labels(new_num_node);
+            std::vector<uint8_t> deleted(node_deleted.empty() ? 0 : new_num_node);
+            num_deleted = 0;
+            for (index_type n = 0; n < new_num_node; n++) {
+                levels[n] = node2level_vec[old_of_new[n]];
+                labels[n] = node_labels.empty() ? old_of_new[n] : node_labels[old_of_new[n]];
+                if (!deleted.empty()) {
+                    deleted[n] = node_deleted[old_of_new[n]];
+                    num_deleted += deleted[n];
+                }
+            }
+            node2level_vec.swap(levels);
+            node_labels.swap(labels);
+            node_deleted.swap(deleted);
+            if (num_deleted == 0) {
+                node_deleted.clear();
+            }
+            if (new_num_node == 0) {
+                init_node = 0;
+                max_level = 0;
+            } else {
+                init_node = new_of_old[init_node];
+            }
+            num_node = new_num_node;
+        }
+
+        // old ids of the nodes in their new order
+        std::vector<index_type> compute_ordering(reorder_t order) {
+            std::vector<index_type> old_of_new;
+            old_of_new.reserve(num_node);
+            auto neighbors_of = [&](index_type node, index_type &degree) {
+                degree = *graph_l0.get_node_degree_ptr(node);
+                return graph_l0.get_node_neighbor_ptr(node);
+            };
+
+            if (order == REORDER_DEGREE) {
+                std::vector<index_type> in_degree(num_node, 0);
+                for (index_type node = 0; node < num_node; node++) {
+                    index_type degree;
+                    const index_type *neighbors = neighbors_of(node, degree);
+                    for (index_type j = 0; j < degree; j++) {
+                        in_degree[neighbors[j]]++;
+                    }
+                }
+                for (index_type node = 0; node < num_node; node++) {
+                    old_of_new.push_back(node);
+                }
+                std::stable_sort(old_of_new.begin(), old_of_new.end(),
+                    [&](index_type a, index_type b) { return in_degree[a] > in_degree[b]; });
+                return old_of_new;
+            }
+
+            // BFS and Cuthill-McKee over the out-links of graph_l0, restarted at unreached nodes.
+            // BFS starts from the entry point, Cuthill-McKee from the nodes of smallest degree.
+            std::vector<bool> visited(num_node, false);
+            std::vector<index_type> starts;
+            std::vector<index_type> node_degree;
+            if (order == REORDER_RCM) {
+                node_degree.resize(num_node);
+                for (index_type node = 0; node < num_node; node++) {
+                    neighbors_of(node, node_degree[node]);
+                    starts.push_back(node);
+                }
+                std::stable_sort(starts.begin(), starts.end(),
+                    [&](index_type a, index_type b) { return node_degree[a] < node_degree[b]; });
+            } else {
+                starts.push_back(init_node);
+                for (index_type node = 0; node < num_node; node++) {
+                    starts.push_back(node);
+                }
+            }
+            std::vector<index_type> next;
+            for (index_type start : starts) {
+                if (visited[start]) {
+                    continue;
+                }
+                visited[start] = true;
+                size_t head = old_of_new.size();
+                old_of_new.push_back(start);
+                for (; head < old_of_new.size(); head++) {
+                    index_type degree;
+                    const index_type *neighbors = neighbors_of(old_of_new[head], degree);
+                    next.clear();
+                    for (index_type j = 0; j < degree; j++) {
+                        if (!visited[neighbors[j]]) {
+                            visited[neighbors[j]] = true;
+                            next.push_back(neighbors[j]);
+                        }
+                    }
+                    if (order == REORDER_RCM) {
+                        std::stable_sort(next.begin(), next.end(),
+                            [&](index_type a, index_type b) { return node_degree[a] < node_degree[b]; });
+                    }
+                    old_of_new.insert(old_of_new.end(), next.begin(), next.end());
+                }
+            }
+            if (order == REORDER_RCM) {
+                std::reverse(old_of_new.begin(), old_of_new.end());
+            }
+            return old_of_new;
+        }
+
+    public:
+        // ===== Serialization =====
+        // A file is a fixed header followed by the raw graph_l0, graph_l1 and node2level_vec buffers and, for
+        // sparse features, the feature arena offsets and slots of graph_l0, each starting at a multiple of
+        // FILE_ALIGNMENT bytes. The buffers are written as they are laid out in memory, so load_mmap can use them
+        // in place; files are only portable between machines with the same byte order.
+        // A reordered or compacted index also stores node_labels, an index with tombstones node_deleted.
+        // Version 1 files have no arena fields in their header, version 1 and 2 files no labels and files before
+        // version 4 no tombstones; all are still read.
+        static constexpr uint32_t FILE_VERSION = 4;
+        static constexpr uint64_t FILE_ALIGNMENT = 64;
+
+        struct file_header_t {
+            char magic[8];
+            uint32_t version;
+            uint32_t dist_size;  // sizeof(dist_t)
+            char byte_order;     // '<' little endian, '>' big endian
+            char padding[3];
+            index_type num_node;
+            index_type feat_dim;
+            index_type maxM;
+            index_type maxM0;
+            index_type efC;
+            index_type max_level;
+            index_type init_node;
+            index_type max_level_upper_bound;  // levels allocated per node in graph_l1
+            uint64_t graph_l0_offset;
+            uint64_t graph_l0_size;
+            uint64_t graph_l1_offset;
+            uint64_t graph_l1_size;
+            uint64_t node2level_offset;
+            uint64_t node2level_size;
+            // since version 2, sizes are 0 for dense features
+            uint64_t feat_offset_offset;
+            uint64_t feat_offset_size;
+            uint64_t feat_arena_offset;
+            uint64_t feat_arena_size;
+            // since version 3, size is 0 if the index was not reordered
+            uint64_t node_labels_offset;
+            uint64_t node_labels_size;
+            // since version 4, size is 0 if no node is deleted
+            uint64_t node_deleted_offset;
+            uint64_t node_deleted_size;
+        };
+
+        static size_t file_header_size(uint32_t version) {
+            if (version == 1) {
+                return offsetof(file_header_t, feat_offset_offset);
+            } else if (version == 2) {
+                return offsetof(file_header_t, node_labels_offset);
+            } else if (version == 3) {
+                return offsetof(file_header_t, node_deleted_offset);
+            }
+            return sizeof(file_header_t);
+        }
+
+        static const char* file_magic() { return "PECOSANN"; }
+
+        // The distance space is not saved, the HNSW that loads the file has to be constructed with the same one.
+        // An order other than REORDER_NONE reorders this index before it is written, see reorder.
+        void save(const std::string& filepath, reorder_t order=REORDER_NONE) {
+            reorder(order);
+            file_header_t header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(header.magic, file_magic(), sizeof(header.magic));
+            header.version = FILE_VERSION;
+            header.dist_size = sizeof(dist_t);
+            header.byte_order = endian::runtime();
+            header.num_node = num_node;
+            header.feat_dim = feat_dim;
+            header.maxM = maxM;
+            header.maxM0 = maxM0;
+            header.efC = efC;
+            header.max_level = max_level;
+            header.init_node = init_node;
+            header.max_level_upper_bound = graph_l1.max_level;
+
+            auto align = [](uint64_t offset) { return (offset + FILE_ALIGNMENT - 1) / FILE_ALIGNMENT * FILE_ALIGNMENT; };
+            header.graph_l0_offset = align(sizeof(header));
+            header.graph_l0_size = graph_l0.mem_size();
+            header.graph_l1_offset = align(header.graph_l0_offset + header.graph_l0_size);
+            header.graph_l1_size = graph_l1.mem_size();
+            header.node2level_offset = align(header.graph_l1_offset + header.graph_l1_size);
+            header.node2level_size = node2level_vec.size() * sizeof(index_type);
+            header.feat_offset_offset = align(header.node2level_offset + header.node2level_size);
+            header.feat_offset_size = graph_l0.feat_offset_mem_size();
+            header.feat_arena_offset = align(header.feat_offset_offset + header.feat_offset_size);
+            header.feat_arena_size = graph_l0.feat_arena_mem_size();
+            header.node_labels_offset = align(header.feat_arena_offset + header.feat_arena_size);
+            header.node_labels_size = node_labels.size() * sizeof(index_type);
+            header.node_deleted_offset = align(header.node_labels_offset + header.node_labels_size);
+            header.node_deleted_size = node_deleted.size() * sizeof(uint8_t);
+
+            FILE *fp = fopen(filepath.c_str(), "wb");
+            if (fp == nullptr) {
+                throw std::runtime_error("cannot open " + filepath + " for writing");
+            }
+            const char zeros[FILE_ALIGNMENT] = {0};
+            auto write_at = [&](uint64_t offset, const void *ptr, uint64_t size) {
+                uint64_t pos = ftell(fp);
+                if (fwrite(zeros, 1, offset - pos, fp) != offset - pos || fwrite(ptr, 1, size, fp) != size) {
+                    fclose(fp);
+                    throw std::runtime_error("cannot write " + filepath);
+                }
+            };
+            write_at(0, &header, sizeof(header));
+            write_at(header.graph_l0_offset, graph_l0.data(), header.graph_l0_size);
+            write_at(header.graph_l1_offset, graph_l1.data(), header.graph_l1_size);
+            write_at(header.node2level_offset, node2level_vec.data(), header.node2level_size);
+            if (graph_l0.sparse_feat) {
+                write_at(header.feat_offset_offset, graph_l0.feat_offset.data(), header.feat_offset_size);
+                write_at(header.feat_arena_offset, graph_l0.feat_arena_data(), header.feat_arena_size);
+            }
+            write_at(header.node_labels_offset, node_labels.data(), header.node_labels_size);
+            write_at(header.node_deleted_offset, node_deleted.data(), header.node_deleted_size);
+            if (fclose(fp) != 0) {
+                throw std::runtime_error("cannot write " + filepath);
+            }
+        }
+
+        // read the whole index into memory
+        void load(const std::string& filepath) {
+            FILE *fp = fopen(filepath.c_str(), "rb");
+            if (fp == nullptr) {
+                throw std::runtime_error("cannot open " + filepath);
+            }
+            file_header_t header;
+            std::memset(&header, 0, sizeof(header));
+            try {
+                endian::fget_multiple<char>((char *) &header, file_header_size(1), fp);
+                endian::fget_multiple<char>((char *) &header + file_header_size(1), file_header_size(header.version) - file_header_size(1), fp);
+                load_header(header, filepath);
+                graph_l0.resize(header.num_node, graph_l0_feat_dim(header), header.maxM0);
+                graph_l1.resize(header.num_node, header.max_level_upper_bound, header.maxM);
+                if (header.feat_offset_size > 0) {
+                    std::vector<uint64_t> offsets(header.feat_offset_size / sizeof(uint64_t));
+                    fseek(fp, header.feat_offset_offset, SEEK_SET);
+                    endian::fget_multiple<uint64_t>(offsets.data(), offsets.size(), fp);
+                    resize_feat_arena(offsets, nullptr, filepath);
+                }
+                check_sizes(header, filepath);
+                fseek(fp, header.graph_l0_offset, SEEK_SET);
+                endian::fget_multiple<char>(graph_l0.data(), header.graph_l0_size, fp);
+                fseek(fp, header.graph_l1_offset, SEEK_SET);
+                endian::fget_multiple<index_type>(graph_l1.data(), header.graph_l1_size / sizeof(index_type), fp);
+                fseek(fp, header.node2level_offset, SEEK_SET);
+                endian::fget_multiple<index_type>(node2level_vec.data(), num_node, fp);
+                if (graph_l0.sparse_feat) {
+                    fseek(fp, header.feat_arena_offset, SEEK_SET);
+                    endian::fget_multiple<float>(graph_l0.feat_arena.data(), graph_l0.feat_arena.size(), fp);
+                }
+                if (!node_labels.empty()) {
+                    fseek(fp, header.node_labels_offset, SEEK_SET);
+                    endian::fget_multiple<index_type>(node_labels.data(), num_node, fp);
+                }
+                if (!node_deleted.empty()) {
+                    fseek(fp, header.node_deleted_offset, SEEK_SET);
+                    endian::fget_multiple<uint8_t>(node_deleted.data(), num_node, fp);
+                }
+                count_deleted();
+            } catch (...) {
+                fclose(fp);
+                throw;
+            }
+            fclose(fp);
+        }
+
+        // map the graphs from the file instead of reading them. Pages are loaded on first access and,
+        // as long as nothing writes to the index, shared through the page cache by all processes mapping the file.
+        void load_mmap(const std::string& filepath) {
+            auto file = std::make_shared<ReadOnlyMappedFile>(filepath);
+            if (file->size() < sizeof(file_header_t)) {
+                throw std::runtime_error(filepath + " is too short for an HNSW index");
+            }
+            file_header_t header;
+            std::memset(&header, 0, sizeof(header));
+            std::memcpy(&header, file->data(), file_header_size(1));
+            if (file->size() < file_header_size(header.version)) {
+                throw std::runtime_error(filepath + " is too short for an HNSW index");
+            }
+            std::memcpy(&header, file->data(), file_header_size(header.version));
+            load_header(header, filepath);
+            graph_l0.resize(0, graph_l0_feat_dim(header), header.maxM0);
+            graph_l1.resize(0, header.max_level_upper_bound, header.maxM);
+            graph_l0.num_node = header.num_node;
+            graph_l1.num_node = header.num_node;
+            if (header.graph_l0_offset + header.graph_l0_size > file->size()
+                    || header.graph_l1_offset + header.graph_l1_size > file->size()
+                    || header.node2level_offset + header.node2level_size > file->size()
+                    || header.feat_offset_offset + header.feat_offset_size > file->size()
+                    || header.feat_arena_offset + header.feat_arena_size > file->size()
+                    || header.node_labels_offset + header.node_labels_size > file->size()
+                    || header.node_deleted_offset + header.node_deleted_size > file->size()) {
+                throw std::runtime_error(filepath + " is truncated");
+            }
+
+            char *base = (char *) file->data();
+            if (header.feat_offset_size > 0) {
+                // the offsets take 8 bytes per node and are copied, the arena stays in the file
+                std::vector<uint64_t> offsets(header.feat_offset_size / sizeof(uint64_t));
+                std::memcpy(offsets.data(), base + header.feat_offset_offset, header.feat_offset_size);
+                resize_feat_arena(offsets, (float *) (base + header.feat_arena_offset), filepath);
+            }
+            check_sizes(header, filepath);
+            graph_l0.mapped_file = file;
+            graph_l0.mapped_ptr = base + header.graph_l0_offset;
+            graph_l1.mapped_file = file;
+            graph_l1.mapped_ptr = (index_type *) (base + header.graph_l1_offset);
+            std::memcpy(node2level_vec.data(), base + header.node2level_offset, header.node2level_size);
+            std::memcpy(node_labels.data(), base + header.node_labels_offset, header.node_labels_size);
+            std::memcpy(node_deleted.data(), base + header.node_deleted_offset, header.node_deleted_size);
+            count_deleted();
+        }
+
+    private:
+        void load_header(const file_header_t &header, const std::string &filepath) {
+            if (std::memcmp(header.magic, file_magic(), sizeof(header.magic)) != 0) {
+                throw std::runtime_error(filepath + " is not an HNSW index");
+            }
+            if (header.version < 1 || header.version > FILE_VERSION) {
+                throw std::runtime_error(filepath + " has unsupported HNSW index version " + std::to_string(header.version));
+            }
+            if (header.dist_size != sizeof(dist_t) || header.byte_order != endian::runtime()) {
+                throw std::runtime_error(filepath + " was saved with a different distance type or byte order");
+            }
+            num_node = header.num_node;
+            feat_dim = header.feat_dim;
+            maxM = header.maxM;
+            maxM0 = header.maxM0;
+            efC = header.efC;
+            max_level = header.max_level;
+            init_node = header.init_node;
+            node2level_vec.resize(num_node);
+            node_labels.assign(header.node_labels_size > 0 ? num_node : 0, 0);
+            node_deleted.assign(header.node_deleted_size > 0 ? num_node : 0, 0);
+        }
+
+        void count_deleted() {
+            num_deleted = std::count(node_deleted.begin(), node_deleted.end(), 1);
+        }
+
+        void check_sizes(const file_header_t &header, const std::string &filepath) {
+            if (header.graph_l0_size != graph_l0.mem_size()
+                    || header.graph_l1_size != graph_l1.mem_size()
+                    || header.node2level_size != num_node * sizeof(index_type)
+                    || header.feat_offset_size != graph_l0.feat_offset_mem_size()
+                    || header.feat_arena_size != graph_l0.feat_arena_mem_size()
+                    || header.node_labels_size != node_labels.size() * sizeof(index_type)
+                    || header.node_deleted_size != node_deleted.size() * sizeof(uint8_t)) {
+                throw std::runtime_error(filepath + " has inconsistent HNSW buffer sizes");
+            }
+        }
+
+        // graph_l0 keeps no inline features when they are in the arena
+        static index_type graph_l0_feat_dim(const file_header_t &header) {
+            return header.feat_offset_size > 0 ? 0 : header.feat_dim;
+        }
+
+        void resize_feat_arena(std::vector<uint64_t> &offsets, float *mapped_arena, const std::string &filepath) {
+            bool valid = offsets.size() == (size_t) num_node + 1 && offsets[0] == 0;
+            for (size_t i = 1; valid && i < offsets.size(); i++) {
+                valid = offsets[i] > offsets[i - 1];
+            }
+            if (!valid) {
+                throw std::runtime_error(filepath + " has invalid HNSW feature offsets");
+            }
+            graph_l0.resize_feat_arena(std::move(offsets), mapped_arena);
+        }
+    };
+
+    // HNSW over Int8Quantizer codes of dense vectors. The graph is built and traversed on the codes, which take a
+    // quarter of the memory of float features, and the final candidates are re-ranked with the exact float distance.
+    // The float vectors passed to train are kept as a view for re-ranking and have to outlive the index.
+    template<typename dist_t>
+    struct QuantizedHNSW {
+        typedef typename HNSW<dist_t>::max_heap_t max_heap_t;
+        typedef typename HNSW<dist_t>::BatchResult BatchResult;
+
+        bool inner_product;
+        index_type M;
+        index_type efC;
+        Int8Quantizer quantizer;
+        std::unique_ptr<Int8Space> code_space;
+        std::unique_ptr<DistanceBase<dist_t>> exact_space;
+        std::unique_ptr<HNSW<dist_t>> index;
+        pecos::drm_t X_exact;
+
+        QuantizedHNSW(bool inner_product, index_type M=16, index_type efC=200) :
+            inner_product(inner_product),
+            M(M),
+            efC(efC) { }
+
+        void train(const pecos::drm_t &X_trn, index_type max_level_upper_bound, int threads=1) {
+            quantizer.fit(X_trn);
+            code_space.reset(new Int8Space(quantizer, inner_product));
+            if (inner_product) {
+                exact_space.reset(new InnerProductSpace(X_trn.cols));
+            } else {
+                exact_space.reset(new L2Space(X_trn.cols));
+            }
+            X_exact = X_trn;
+
+            index_type code_dim = quantizer.get_feat_mem_dim();
+            std::vector<float> codes((size_t) X_trn.rows * code_dim, 0);
+            parallel_for<index_type>(0, X_trn.rows, [&](index_type i, int thread_id) {
+                quantizer.encode(X_trn.get_row(i).val, (uint8_t *) &codes[(size_t) i * code_dim]);
+            }, threads);
+            pecos::drm_t X_codes;
+            X_codes.rows = X_trn.rows;
+            X_codes.cols = code_dim;
+            X_codes.val = codes.data();
+
+            index.reset(new HNSW<dist_t>(code_space.get(), X_trn.rows, code_dim, M, efC));
+            index->train(X_codes, max_level_upper_bound, threads);
+        }
+
+        // the graph search keeps max(efS, topk) candidates, all of them are re-ranked; thread safe
+        max_heap_t predict_single(const float *query, index_type efS, index_type topk=10) {
+            std::vector<float> code(quantizer.get_feat_mem_dim(), 0);
+            quantizer.encode(query, (uint8_t *) code.data());
+            auto candidates = index->predict_single(code.data(), efS, std::max(efS, topk));
+
+            auto exact_dist_fn = exact_space->get_dist_fn();
+            auto exact_feat_dim = exact_space->get_dist_feat_dim();
+            max_heap_t topk_queue;
+            while (!candidates.empty()) {
+                index_type node = candidates.top().second;
+                candidates.pop();
+                topk_queue.emplace(exact_dist_fn(query, X_exact.get_row(node).val, exact_feat_dim), node);
+                if (topk_queue.size() > topk) {
+                    topk_queue.pop();
+                }
+            }
+            return topk_queue;
+        }
+
+        BatchResult predict_batch(const pecos::drm_t &queries, index_type efS, index_type topk, int threads=1) {
+            if (queries.rows > 0 && queries.cols != quantizer.feat_dim) {
+                throw std::invalid_argument("queries have " + std::to_string(queries.cols) + " columns, the index has " + std::to_string(quantizer.feat_dim));
+            }
+            threads = std::max(1, std::min<int>(resolve_threads(threads), queries.rows));
+            return HNSW<dist_t>::batch_search(queries.rows, topk, threads, [&](index_type i, int thread_id) {
+                return predict_single(queries.get_row(i).val, efS, topk);
+            });
+        }
     };
 
 
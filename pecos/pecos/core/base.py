@@ -1236,8 +1236,10 @@ class corelib(object):
             c_uint32,
             c_int,
             c_uint32,
+            c_uint32,
             c_int,
             POINTER(c_uint32),
+            POINTER(c_double),
         ]
         corelib.fillprototype(
             self.clib_float32.c_run_clustering_csr_f32, None, [POINTER(ScipyCsrF32)] + arg_list[1:]
@@ -1246,7 +1248,18 @@ class corelib(object):
             self.clib_float32.c_run_clustering_drm_f32, None, [POINTER(ScipyDrmF32)] + arg_list[1:]
         )
 
-    def run_clustering(self, py_feat_mat, depth, algo, seed, codes=None, max_iter=10, threads=-1):
+    def run_clustering(
+        self,
+        py_feat_mat,
+        depth,
+        algo,
+        seed,
+        codes=None,
+        max_iter=10,
+        threads=-1,
+        sample_size=0,
+        layer_stats=None,
+    ):
         """
         Run clustering with given label embedding matrix and parameters in C++.
 
@@ -1258,6 +1271,13 @@ class corelib(object):
             codes (ndarray, optional): Label clustering results.
             max_iter (int, optional): Maximum number of iter for reordering each node based on score.
             threads (int, optional): The number of threads. Default -1 to use all cores.
+            sample_size (int, optional): If positive, each node is clustered on at most `sample_size` random
+                labels and all of its labels are then split in a single pass. Default 0 to use all labels.
+            layer_stats (ndarray, optional): If given, a float64 array of shape (depth, 6) filled with
+                the min and max cluster size, the number of fitted and of all labels, and the mean
+                inner product of the fitted and of all labels with the normalized sum of their cluster
+                (their cosine similarity for unit length rows) of each layer.
+                Collecting them costs an extra scoring pass per node. Default None to skip.
 
         Return:
             codes (ndarray): The clustering result.
@@ -1275,14 +1295,26 @@ class corelib(object):
 
         if codes is None or len(codes) != py_feat_mat.shape[0] or codes.dtype != np.uint32:
             codes = np.zeros(py_feat_mat.rows, dtype=np.uint32)
+        if layer_stats is not None and (
+            layer_stats.dtype != np.float64
+            or not layer_stats.flags.c_contiguous
+            or layer_stats.shape != (depth, 6)
+        ):
+            raise ValueError(
+                "layer_stats must be a C-contiguous float64 array of shape {}, got {} of shape {}".format(
+                    (depth, 6), layer_stats.dtype, layer_stats.shape
+                )
+            )
         run_clustering(
             byref(py_feat_mat),
             depth,
             algo,
             seed,
             max_iter,
+            sample_size,
             threads,
             codes.ctypes.data_as(POINTER(c_uint32)),
+            None if layer_stats is None else layer_stats.ctypes.data_as(POINTER(c_double)),
         )
         return codes
 
@@ -258,11 +258,24 @@ extern "C" {
         uint32_t partition_algo, \
         int seed, \
         uint32_t max_iter, \
+        uint32_t sample_size, \
         int threads, \
-        uint32_t* label_codes) { \
+        uint32_t* label_codes, \
+        double* layer_stats) { \
         C_MAT feat_mat(py_mat_ptr); \
         pecos::clustering::Tree tree(depth); \
-        tree.run_clustering(feat_mat, partition_algo, seed, label_codes, max_iter, threads); \
+        tree.collect_stats = (layer_stats != NULL); \
+        tree.run_clustering(feat_mat, partition_algo, seed, label_codes, max_iter, threads, sample_size); \
+        for(size_t d = 0; d < tree.layer_stats.size(); d++) { \
+            const auto& stats = tree.layer_stats[d]; \
+            double* row = layer_stats + 6 * d; \
+            row[0] = stats.min_size; \
+            row[1] = stats.max_size; \
+            row[2] = stats.fit_elements; \
+            row[3] = stats.elements; \
+            row[4] = stats.fit_objective; \
+            row[5] = stats.full_objective; \
+        } \
     }
     C_RUN_CLUSTERING(_csr_f32, ScipyCsrF32, pecos::csr_t)
     C_RUN_CLUSTERING(_drm_f32, ScipyDrmF32, pecos::drm_t)
@@ -18,6 +18,7 @@
 #include <vector>
 
 #include "matrix.hpp"
+#include "parallel.hpp"
 #include "random.hpp"
 
 namespace pecos {
@@ -68,6 +69,19 @@ struct Tree {
     // Temporary working spaces for function update_center, will be cleared after clustering to release space
     std::vector<f32_dvec_t> center_tmp_thread; // thread-private working array for parallel updating center
 
+    // Balance and quality of the splits of one layer, filled by run_clustering if collect_stats is set.
+    // The objective of a split is the mean cosine similarity of its elements to the normalized sum of their side.
+    struct layer_stats_t {
+        size_t min_size = 0, max_size = 0; // sizes of the clusters the layer is split into
+        size_t fit_elements = 0, elements = 0;
+        double fit_objective = 0;  // over the elements the centers were fitted on (a sample with sample_size > 0)
+        double full_objective = 0; // over all elements
+    };
+    std::vector<layer_stats_t> layer_stats;
+    bool collect_stats = false;
+    f64_dvec_t node_fit_objective, node_full_objective; // per node, sums over its elements
+    std::vector<size_t> node_fit_elements;
+
     Tree(size_t depth=0) { this->reset_depth(depth); }
 
     void reset_depth(size_t depth) {
@@ -133,37 +147,134 @@ struct Tree {
                 do_axpy(alpha, feat, cur_center);
             }
         } else {
-            #pragma omp parallel num_threads(threads)
-            {
-                int thread_id = omp_get_thread_num();
-                std::fill(center_tmp_thread[thread_id].begin(), center_tmp_thread[thread_id].end(), 0);
-                dvec_wrapper_t cur_center_tmp_thread(center_tmp_thread[thread_id]);
-                // use static for reproducibility under multi-trials with same seed.
-                #pragma omp for schedule(static)
-                for(size_t i = cur_node.start; i < cur_node.end; i++) {
+            // each thread accumulates a fixed contiguous block of elements into its own center,
+            // so the result does not depend on scheduling for reproducibility under multi-trials with same seed.
+            size_t block = (cur_node.size() + threads - 1) / threads;
+            parallel_for<int>(0, threads, [&](int tid, int) {
+                std::fill(center_tmp_thread[tid].begin(), center_tmp_thread[tid].end(), 0);
+                dvec_wrapper_t cur_center_tmp_thread(center_tmp_thread[tid]);
+                size_t block_end = std::min(cur_node.end, cur_node.start + (tid + 1) * block);
+                for(size_t i = cur_node.start + tid * block; i < block_end; i++) {
                     size_t eid = elements[i];
                     const auto& feat = feat_mat.get_row(eid);
                     do_axpy(alpha, feat, cur_center_tmp_thread);
                 }
-            }
-
-            // global parallel reduction
-            #pragma omp parallel for schedule(static)
-            for(size_t i=0; i<cur_center.len; ++i) {
-                for(size_t thread_id = 0; thread_id < threads; thread_id++) {
-                        cur_center[i] += center_tmp_thread[thread_id][i];
+            }, threads);
+
+            // global parallel reduction over blocks of dimensions
+            size_t dim_block = (cur_center.len + threads - 1) / threads;
+            parallel_for<int>(0, threads, [&](int part, int) {
+                size_t dim_end = std::min(cur_center.len, (part + 1) * dim_block);
+                for(size_t thread_id = 0; thread_id < (size_t) threads; thread_id++) {
+                    const float32_t* tmp = center_tmp_thread[thread_id].data();
+                    for(size_t i = part * dim_block; i < dim_end; ++i) {
+                        cur_center[i] += tmp[i];
+                    }
                 }
+            }, threads);
+        }
+    }
+
+    // scores[eid] = <center, x_eid> for every element of root
+    template<typename MAT>
+    void update_scores(const MAT& feat_mat, const Node& root, const dvec_wrapper_t& center, int threads=1) {
+        parallel_for<size_t>(root.start, root.end, [&](size_t i, int) {
+            size_t eid = elements[i];
+            const auto& feat = feat_mat.get_row(eid);
+            scores[eid] = do_dot_product(center, feat);
+        }, threads);
+    }
+
+    // Move sample_size random elements of root to its front and return them as a node,
+    // or return root itself when sample_size is 0 or not smaller than root
+    Node sample_elements(const Node& root, size_t sample_size, rng_t& rng) {
+        if(sample_size == 0 || sample_size >= root.size()) {
+            return root;
+        }
+        sample_size = std::max<size_t>(sample_size, 2);
+        for(size_t i = 0; i < sample_size; i++) {
+            size_t j = rng.randint(i, root.size() - 1);
+            std::swap(elements[root.start + i], elements[root.start + j]);
+        }
+        return Node(root.start, root.start + sample_size);
+    }
+
+    // cur_center += mean of right - mean of left
+    template<typename MAT>
+    void update_kmeans_center(const MAT& feat_mat, Node& left, Node& right, dvec_wrapper_t& cur_center, int threads=1) {
+        float32_t alpha = 0;
+        alpha = +1.0 / right.size();
+        update_center(feat_mat, right, cur_center, alpha, threads);
+
+        alpha = -1.0 / left.size();
+        update_center(feat_mat, left, cur_center, alpha, threads);
+    }
+
+    // cur_center1 += normalized sum of right - normalized sum of left, using cur_center2 as working space
+    template<typename MAT>
+    void update_skmeans_center(const MAT& feat_mat, Node& left, Node& right, dvec_wrapper_t& cur_center1, dvec_wrapper_t& cur_center2, int threads=1) {
+        float32_t one = 1.0;
+        update_center(feat_mat, right, cur_center1, one, threads);
+        float32_t alpha = do_dot_product(cur_center1, cur_center1);
+        if(alpha > 0) {
+            do_scale(1.0 / sqrt(alpha), cur_center1);
+        }
+
+        update_center(feat_mat, left, cur_center2, one, threads);
+        alpha = do_dot_product(cur_center2, cur_center2);
+        if(alpha > 0) {
+            do_scale(1.0 / sqrt(alpha), cur_center2);
+        }
+
+        do_axpy(-1.0, cur_center2, cur_center1);
+    }
+
+    // Sum over the elements of left and right of their cosine similarity to the normalized sum of their side,
+    // rows are assumed to have unit length. Overwrites center1 and center2 of thread_id and the scores.
+    template<typename MAT>
+    double split_objective(const MAT& feat_mat, Node left, Node right, int threads, int thread_id) {
+        dvec_wrapper_t left_center(center1[thread_id]);
+        dvec_wrapper_t right_center(center2[thread_id]);
+        std::fill(center1[thread_id].begin(), center1[thread_id].end(), 0);
+        std::fill(center2[thread_id].begin(), center2[thread_id].end(), 0);
+        float32_t one = 1.0;
+        update_center(feat_mat, left, left_center, one, threads);
+        update_center(feat_mat, right, right_center, one, threads);
+        for(auto center : {&left_center, &right_center}) {
+            float32_t norm2 = do_dot_product(*center, *center);
+            if(norm2 > 0) {
+                do_scale(1.0 / sqrt(norm2), *center);
             }
         }
+        update_scores(feat_mat, left, left_center, threads);
+        update_scores(feat_mat, right, right_center, threads);
+        double sum = 0;
+        for(size_t i = left.start; i < right.end; i++) {
+            sum += scores[elements[i]];
+        }
+        return sum;
+    }
+
+    // Stores the objective of the split of nid on the fitted elements, before the final pass of a sampled split
+    template<typename MAT>
+    void collect_fit_objective(size_t nid, const MAT& feat_mat, const Node& fit_left, const Node& fit_right, int threads, int thread_id) {
+        node_fit_objective[nid] = split_objective(feat_mat, fit_left, fit_right, threads, thread_id);
+        node_fit_elements[nid] = fit_left.size() + fit_right.size();
     }
 
+    // With sample_size > 0, the center is fitted on at most sample_size random elements of the node
+    // and all elements are then split by a single scoring pass.
     template<typename MAT>
-    void partition_kmeans(size_t nid, size_t depth, const MAT& feat_mat, rng_t& rng, size_t max_iter=10, int threads=1, int thread_id=0) {
+    void partition_kmeans(size_t nid, size_t depth, const MAT& feat_mat, rng_t& rng, size_t max_iter=10, int threads=1, int thread_id=0, size_t sample_size=0) {
         Node& root = root_of(nid);
         Node& left = left_of(nid);
         Node& right = right_of(nid);
         partition_elements(root, left, right);
 
+        Node fit = sample_elements(root, sample_size, rng);
+        Node fit_left, fit_right;
+        partition_elements(fit, fit_left, fit_right);
+
         dvec_wrapper_t cur_center(center1[thread_id]);
 
         // perform the clustering and sorting
@@ -171,10 +282,10 @@ struct Tree {
             // construct cur_center (for right child)
             std::fill(center1[thread_id].begin(), center1[thread_id].end(), 0);
             if(iter == 0) {
-                auto right_idx = rng.randint(0, root.size() - 1);
-                auto left_idx = (right_idx + rng.randint(1, root.size() - 1)) % root.size();
-                right_idx += root.start;
-                left_idx  += root.start;
+                auto right_idx = rng.randint(0, fit.size() - 1);
+                auto left_idx = (right_idx + rng.randint(1, fit.size() - 1)) % fit.size();
+                right_idx += fit.start;
+                left_idx  += fit.start;
 
                 const auto& feat_right = feat_mat.get_row(elements[right_idx]);
                 const auto& feat_left = feat_mat.get_row(elements[left_idx]);
@@ -182,59 +293,57 @@ struct Tree {
                 do_axpy(-1.0, feat_left, cur_center);
 
             } else {
-                float32_t alpha = 0;
-                alpha = +1.0 / right.size();
-                update_center(feat_mat, right, cur_center, alpha, threads);
-
-                alpha = -1.0 / left.size();
-                update_center(feat_mat, left, cur_center, alpha, threads);
+                update_kmeans_center(feat_mat, fit_left, fit_right, cur_center, threads);
             }
-            u64_dvec_t *elements_ptr = &elements;
-            auto *scores_ptr = &scores;
-            auto *center_ptr = &cur_center;
-            const MAT* feat_mat_ptr = &feat_mat;
-            if(threads == 1) {
-                for(size_t i = root.start; i < root.end; i++) {
-                    size_t eid = elements_ptr->at(i);
-                    const auto& feat = feat_mat_ptr->get_row(eid);
-                    scores_ptr->at(eid) = do_dot_product(*center_ptr, feat);
-                }
-            } else {
-#pragma omp parallel for shared(elements_ptr, scores_ptr, center_ptr, feat_mat_ptr)
-                for(size_t i = root.start; i < root.end; i++) {
-                    size_t eid = elements_ptr->at(i);
-                    const auto& feat = feat_mat_ptr->get_row(eid);
-                    scores_ptr->at(eid) = do_dot_product(*center_ptr, feat);
-                }
-            }
-            bool assignment_changed = sort_elements_by_scores_on_node(root);
+            update_scores(feat_mat, fit, cur_center, threads);
+            bool assignment_changed = sort_elements_by_scores_on_node(fit);
             if(!assignment_changed) {
                 break;
             }
         }
+
+        if(collect_stats) {
+            collect_fit_objective(nid, feat_mat, fit_left, fit_right, threads, thread_id);
+        }
+
+        if(fit.size() < root.size()) {
+            std::fill(center1[thread_id].begin(), center1[thread_id].end(), 0);
+            update_kmeans_center(feat_mat, fit_left, fit_right, cur_center, threads);
+            update_scores(feat_mat, root, cur_center, threads);
+            sort_elements_by_scores_on_node(root);
+        }
+
+        if(collect_stats) {
+            node_full_objective[nid] = (fit.size() < root.size()) ?
+                split_objective(feat_mat, left, right, threads, thread_id) : node_fit_objective[nid];
+        }
     }
 
+    // See partition_kmeans for sample_size
     template<typename MAT>
-    void partition_skmeans(size_t nid, size_t depth, const MAT& feat_mat, rng_t& rng, size_t max_iter=10, int threads=1, int thread_id=0) {
+    void partition_skmeans(size_t nid, size_t depth, const MAT& feat_mat, rng_t& rng, size_t max_iter=10, int threads=1, int thread_id=0, size_t sample_size=0) {
         Node& root = root_of(nid);
         Node& left = left_of(nid);
         Node& right = right_of(nid);
         partition_elements(root, left, right);
 
+        Node fit = sample_elements(root, sample_size, rng);
+        Node fit_left, fit_right;
+        partition_elements(fit, fit_left, fit_right);
+
         dvec_wrapper_t cur_center1(center1[thread_id]);
         dvec_wrapper_t cur_center2(center2[thread_id]);
 
         // perform the clustering and sorting
         for(size_t iter = 0; iter < max_iter; iter++) {
-            float32_t one = 1.0;
             // construct center1 (for right child)
             std::fill(center1[thread_id].begin(), center1[thread_id].end(), 0);
             std::fill(center2[thread_id].begin(), center2[thread_id].end(), 0);
             if(iter == 0) {
-                auto right_idx = rng.randint(0, root.size() - 1);
-                auto left_idx = (right_idx + rng.randint(1, root.size() - 1)) % root.size();
-                right_idx += root.start;
-                left_idx  += root.start;
+                auto right_idx = rng.randint(0, fit.size() - 1);
+                auto left_idx = (right_idx + rng.randint(1, fit.size() - 1)) % fit.size();
+                right_idx += fit.start;
+                left_idx  += fit.start;
 
                 const auto& feat_right = feat_mat.get_row(elements[right_idx]);
                 const auto& feat_left = feat_mat.get_row(elements[left_idx]);
@@ -242,49 +351,37 @@ struct Tree {
                 do_axpy(1.0, feat_left, cur_center2);
                 do_axpy(-1.0, cur_center2, cur_center1);
             } else {
-                update_center(feat_mat, right, cur_center1, one, threads);
-                float32_t alpha = do_dot_product(cur_center1, cur_center1);
-                if(alpha > 0) {
-                    do_scale(1.0 / sqrt(alpha), cur_center1);
-                }
-
-                update_center(feat_mat, left, cur_center2, one, threads);
-                alpha = do_dot_product(cur_center2, cur_center2);
-                if(alpha > 0) {
-                    do_scale(1.0 / sqrt(alpha), cur_center2);
-                }
-
-                do_axpy(-1.0, cur_center2, cur_center1);
+                update_skmeans_center(feat_mat, fit_left, fit_right, cur_center1, cur_center2, threads);
             }
 
 
-            u64_dvec_t *elements_ptr = &elements;
-            auto *scores_ptr = &scores;
-            auto *center_ptr = &cur_center1;
-            const MAT* feat_mat_ptr = &feat_mat;
-            if(threads == 1) {
-                for(size_t i = root.start; i < root.end; i++) {
-                    size_t eid = elements_ptr->at(i);
-                    const auto& feat = feat_mat_ptr->get_row(eid);
-                    scores_ptr->at(eid) = do_dot_product(*center_ptr, feat);
-                }
-            } else {
-#pragma omp parallel for shared(elements_ptr, scores_ptr, center_ptr, feat_mat_ptr)
-                for(size_t i = root.start; i < root.end; i++) {
-                    size_t eid = elements_ptr->at(i);
-                    const auto& feat = feat_mat_ptr->get_row(eid);
-                    scores_ptr->at(eid) = do_dot_product(*center_ptr, feat);
-                }
-            }
-            bool assignment_changed = sort_elements_by_scores_on_node(root);
+            update_scores(feat_mat, fit, cur_center1, threads);
+            bool assignment_changed = sort_elements_by_scores_on_node(fit);
             if(!assignment_changed) {
                 break;
             }
         }
+
+        if(collect_stats) {
+            collect_fit_objective(nid, feat_mat, fit_left, fit_right, threads, thread_id);
+        }
+
+        if(fit.size() < root.size()) {
+            std::fill(center1[thread_id].begin(), center1[thread_id].end(), 0);
+            std::fill(center2[thread_id].begin(), center2[thread_id].end(), 0);
+            update_skmeans_center(feat_mat, fit_left, fit_right, cur_center1, cur_center2, threads);
+            update_scores(feat_mat, root, cur_center1, threads);
+            sort_elements_by_scores_on_node(root);
+        }
+
+        if(collect_stats) {
+            node_full_objective[nid] = (fit.size() < root.size()) ?
+                split_objective(feat_mat, left, right, threads, thread_id) : node_fit_objective[nid];
+        }
     }
 
     template<typename MAT, typename IND=unsigned>
-    void run_clustering(const MAT& feat_mat, int partition_algo, int seed=0, IND *label_codes=NULL, size_t max_iter=10, int threads=1) {
+    void run_clustering(const MAT& feat_mat, int partition_algo, int seed=0, IND *label_codes=NULL, size_t max_iter=10, int threads=1, size_t sample_size=0) {
         size_t nr_elements = feat_mat.rows;
         elements.resize(nr_elements);
         previous_elements.resize(nr_elements);
@@ -296,7 +393,7 @@ struct Tree {
             seed_for_nodes[nid] = rng.randint<unsigned>();
         }
 
-        threads = set_threads(threads);
+        threads = resolve_threads(threads);
         center1.resize(threads, f32_dvec_t(feat_mat.cols, 0));
         center2.resize(threads, f32_dvec_t(feat_mat.cols, 0));
         scores.resize(feat_mat.rows, 0);
@@ -306,34 +403,54 @@ struct Tree {
         // Allocate tmp arrays for parallel update center
         center_tmp_thread.resize(threads, f32_dvec_t(feat_mat.cols, 0));
 
+        layer_stats.clear();
+        if(collect_stats) {
+            layer_stats.resize(depth);
+            node_fit_objective.assign(nodes.size(), 0);
+            node_full_objective.assign(nodes.size(), 0);
+            node_fit_elements.assign(nodes.size(), 0);
+        }
 
         // let's do it layer by layer so we can parallelize it
         for(size_t d = 0; d < depth; d++) {
             size_t layer_start = 1U << d;
             size_t layer_end = 1U << (d + 1);
-            if((layer_end - layer_start) >= threads) {
-#pragma omp parallel for schedule(dynamic)
-                for(size_t nid = layer_start; nid < layer_end; nid++) {
-                    rng_t rng(seed_for_nodes[nid]);
-                    int local_threads = 1;
-                    int thread_id = omp_get_thread_num();
-                    if(partition_algo == KMEANS) {
-                        partition_kmeans(nid, d, feat_mat, rng, max_iter, local_threads, thread_id);
-                    } else if(partition_algo == SKMEANS) {
-                        partition_skmeans(nid, d, feat_mat, rng, max_iter, local_threads, thread_id);
-                    }
+            auto partition = [&](size_t nid, int local_threads, int thread_id) {
+                rng_t rng(seed_for_nodes[nid]);
+                if(partition_algo == KMEANS) {
+                    partition_kmeans(nid, d, feat_mat, rng, max_iter, local_threads, thread_id, sample_size);
+                } else if(partition_algo == SKMEANS) {
+                    partition_skmeans(nid, d, feat_mat, rng, max_iter, local_threads, thread_id, sample_size);
                 }
+            };
+            if((layer_end - layer_start) >= (size_t) threads) {
+                // nodes of a layer own disjoint ranges of elements, so they are partitioned concurrently,
+                // each on one thread with that thread's centers
+                parallel_for<size_t>(layer_start, layer_end, [&](size_t nid, int thread_id) {
+                    partition(nid, 1, thread_id);
+                }, threads);
             } else {
+                // too few nodes to keep every thread busy, parallelize within each node instead
+                for(size_t nid = layer_start; nid < layer_end; nid++) {
+                    partition(nid, threads, 0);
+                }
+            }
+
+            if(collect_stats) {
+                layer_stats_t& stats = layer_stats[d];
+                stats.min_size = nr_elements;
                 for(size_t nid = layer_start; nid < layer_end; nid++) {
-                    rng_t rng(seed_for_nodes[nid]);
-                    int local_threads = threads;
-                    int thread_id = 0;
-                    if(partition_algo == KMEANS) {
-                        partition_kmeans(nid, d, feat_mat, rng, max_iter, local_threads, thread_id);
-                    } else if(partition_algo == SKMEANS) {
-                        partition_skmeans(nid, d, feat_mat, rng, max_iter, local_threads, thread_id);
+                    for(size_t child : {nid << 1, (nid << 1) + 1}) {
+                        stats.min_size = std::min(stats.min_size, nodes[child].size());
+                        stats.max_size = std::max(stats.max_size, nodes[child].size());
                     }
+                    stats.fit_elements += node_fit_elements[nid];
+                    stats.elements += nodes[nid].size();
+                    stats.fit_objective += node_fit_objective[nid];
+                    stats.full_objective += node_full_objective[nid];
                 }
+                stats.fit_objective /= std::max<size_t>(stats.fit_elements, 1);
+                stats.full_objective /= std::max<size_t>(stats.elements, 1);
             }
         }
 
@@ -350,6 +467,9 @@ struct Tree {
         // clear tmp arrays
         center_tmp_thread.clear();
         center_tmp_thread.shrink_to_fit();
+        node_fit_objective.clear();
+        node_full_objective.clear();
+        node_fit_elements.clear();
     }
 
     void output() {
@@ -410,7 +410,7 @@ namespace pecos {
     };
 
     // Transpose Methods
-    csc_t csr_t::transpose() const {
+    inline csc_t csr_t::transpose() const {
         csc_t ret;
         ret.rows = cols;
         ret.cols = rows;
@@ -420,7 +420,7 @@ namespace pecos {
         return ret;
     }
 
-    csr_t csc_t::transpose() const {
+    inline csr_t csc_t::transpose() const {
         csr_t ret;
         ret.rows = cols;
         ret.cols = rows;
@@ -430,7 +430,7 @@ namespace pecos {
         return ret;
     }
 
-    dcm_t drm_t::transpose() const {
+    inline dcm_t drm_t::transpose() const {
         dcm_t ret;
         ret.rows = cols;
         ret.cols = rows;
@@ -438,7 +438,7 @@ namespace pecos {
         return ret;
     }
 
-    drm_t dcm_t::transpose() const {
+    inline drm_t dcm_t::transpose() const {
         drm_t ret;
         ret.rows = cols;
         ret.cols = rows;
@@ -447,7 +447,7 @@ namespace pecos {
     }
 
     // CSC to CSR
-    csc_t csr_t::to_csc() const {
+    inline csc_t csr_t::to_csc() const {
         csc_t ret;
         auto nnz = this->get_nnz();
         ret.rows = rows;
@@ -472,7 +472,7 @@ namespace pecos {
         return ret;
     }
 
-    csr_t csc_t::to_csr() const {
+    inline csr_t csc_t::to_csr() const {
         return this->transpose().to_csc().transpose();
     }
 
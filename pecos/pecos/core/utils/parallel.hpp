@@ -15,14 +15,19 @@
 #define  __PARALLEL_H__
 
 #include <algorithm>
+#include <atomic>
+#include <exception>
 #include <iterator>
+#include <mutex>
 #include <numeric>
 #include <omp.h>
+#include <thread>
+#include <vector>
 
 namespace pecos {
 
     // ===== Thread Utility =====
-    int set_threads(int threads) {
+    inline int set_threads(int threads) {
         if(threads == -1) {
             threads = 1;
         }
@@ -31,6 +36,70 @@ namespace pecos {
         return threads;
     }
 
+    // Number of std::thread workers to use; -1 means all hardware threads.
+    // Unlike set_threads, this is not tied to OpenMP and is not clamped.
+    inline int resolve_threads(int threads) {
+        if(threads <= 0) {
+            threads = std::max(1U, std::thread::hardware_concurrency());
+        }
+        return threads;
+    }
+
+    // Calls fn(i, thread_id) for every i in [begin, end) on up to `threads` std::threads.
+    // Indices are handed out dynamically in small blocks, so uneven work per index is balanced.
+    // thread_id is in [0, threads) and can be used to index per-thread buffers.
+    // The first exception thrown by fn is rethrown in the calling thread once all workers have stopped.
+    template<class IndexT, class Fn>
+    void parallel_for(IndexT begin, IndexT end, Fn fn, int threads=1) {
+        if(end <= begin) {
+            return;
+        }
+        size_t len = static_cast<size_t>(end - begin);
+        threads = static_cast<int>(std::min<size_t>(resolve_threads(threads), len));
+        if(threads == 1) {
+            for(IndexT i = begin; i < end; ++i) {
+                fn(i, 0);
+            }
+            return;
+        }
+
+        size_t block = std::max<size_t>(1, len / (static_cast<size_t>(threads) * 16));
+        std::atomic<size_t> next(0);
+        std::exception_ptr error = nullptr;
+        std::mutex error_lock;
+
+        auto worker = [&](int tid) {
+            try {
+                for(size_t start = next.fetch_add(block); start < len; start = next.fetch_add(block)) {
+                    size_t stop = std::min(len, start + block);
+                    for(size_t i = start; i < stop; ++i) {
+                        fn(static_cast<IndexT>(begin + i), tid);
+                    }
+                }
+            } catch(...) {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if(!error) {
+                    error = std::current_exception();
+                }
+                // stop handing out work to the other threads
+                next.store(len);
+            }
+        };
+
+        std::vector<std::thread> workers;
+        workers.reserve(threads - 1);
+        for(int tid = 1; tid < threads; tid++) {
+            workers.emplace_back(worker, tid);
+        }
+        worker(0);
+        for(auto& t : workers) {
+            t.join();
+        }
+        if(error) {
+            std::rethrow_exception(error);
+        }
+    }
+
     template<class InputIt, class OutputIt>
     void parallel_partial_sum(InputIt first, InputIt last, OutputIt out, int threads=1) {
         typedef typename std::iterator_traits<InputIt>::value_type value_type;
@@ -0,0 +1,308 @@
+/*
+ * Copyright 2021 Amazon.com, Inc. or its affiliates. All Rights Reserved.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"). You may not use this file except in compliance
+ * with the License. A copy of the License is located at
+ *
+ * http://aws.amazon.com/apache2.0/
+ *
+ * or in the "license" file accompanying this file. This file is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES
+ * OR CONDITIONS OF ANY KIND, either express or implied. See the License for the specific language governing permissions
+ * and limitations under the License.
+ */
+
+/*
+* File: perf_counters.hpp
+*
+* Description: Optional hardware performance counters read through Linux perf_event_open,
+* used by both PECOS and napkinXC. Counters that cannot be opened (no PMU, restrictive
+* perf_event_paranoid, non Linux platform, ...) are reported as unavailable instead of
+* raising an error.
+*/
+
+#ifndef __PERF_COUNTERS_H__
+#define __PERF_COUNTERS_H__
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <third_party/nlohmann_json/json.hpp>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace pecos {
+
+    enum perf_event_kind_t {
+        PERF_CYCLES = 0,
+        PERF_INSTRUCTIONS,
+        PERF_L1D_MISSES,
+        PERF_LLC_MISSES,
+        PERF_BRANCH_MISSES,
+        PERF_DTLB_MISSES,
+        PERF_EVENT_COUNT
+    };
+
+    inline const char* perf_event_name(int kind) {
+        static const char* names[PERF_EVENT_COUNT] = {
+            "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses", "dtlb_misses"
+        };
+        return names[kind];
+    }
+
+    // Event counts of one measured region, or the sum over several regions
+    struct perf_counter_values_t {
+        std::array<double, PERF_EVENT_COUNT> values{};
+        std::array<bool, PERF_EVENT_COUNT> valid{};
+
+        bool any_valid() const {
+            for (auto v : valid) {
+                if (v) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        perf_counter_values_t& operator+=(const perf_counter_values_t& other) {
+            for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+                if (other.valid[i]) {
+                    values[i] += other.values[i];
+                    valid[i] = true;
+                }
+            }
+            return *this;
+        }
+
+        // Counts divided by `per`, e.g. the number of queries; unavailable events are omitted
+        nlohmann::json to_json(double per=1.0) const {
+            nlohmann::json j = nlohmann::json::object();
+            for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+                if (valid[i]) {
+                    j[perf_event_name(i)] = per > 0.0 ? values[i] / per : 0.0;
+                }
+            }
+            if (valid[PERF_CYCLES] && valid[PERF_INSTRUCTIONS] && values[PERF_CYCLES] > 0.0) {
+                j["ipc"] = values[PERF_INSTRUCTIONS] / values[PERF_CYCLES];
+            }
+            return j;
+        }
+    };
+
+    // Raw state of the counters at one point in time, see perf_counter_group_t::read.
+    // Enabled and running times are kept per event, they only differ when events are opened individually.
+    struct perf_counter_snapshot_t {
+        std::array<uint64_t, PERF_EVENT_COUNT> values{};
+        std::array<uint64_t, PERF_EVENT_COUNT> time_enabled{};
+        std::array<uint64_t, PERF_EVENT_COUNT> time_running{};
+    };
+
+    // User space counters of the thread that constructs it, shared by PECOS and napkinXC.
+    // The counters run from construction on; regions are measured as the difference of two snapshots,
+    // so no counter is started or stopped per region.
+    // The events are opened as one group, read with a single system call. When the PMU cannot schedule
+    // the whole group, which then never runs and counts nothing, they are reopened individually and
+    // read with one system call each. Counts are scaled by time enabled / time running when the kernel
+    // multiplexes the counters.
+    class perf_counter_group_t {
+    private:
+        std::array<int, PERF_EVENT_COUNT> fds;
+        std::array<int, PERF_EVENT_COUNT> slots; // Position of each event in the group read, -1 if unavailable
+        int leader = -1; // -1 when the events are opened individually
+        int opened = 0;
+
+#ifdef __linux__
+        static void event_attr(int kind, bool grouped, perf_event_attr& attr) {
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            if (grouped) {
+                attr.read_format |= PERF_FORMAT_GROUP;
+            }
+
+            auto cache_miss = [](uint64_t cache) {
+                return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            };
+
+            switch (kind) {
+                case PERF_CYCLES:
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+                    break;
+                case PERF_INSTRUCTIONS:
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+                    break;
+                case PERF_L1D_MISSES:
+                    attr.type = PERF_TYPE_HW_CACHE;
+                    attr.config = cache_miss(PERF_COUNT_HW_CACHE_L1D);
+                    break;
+                case PERF_LLC_MISSES:
+                    attr.type = PERF_TYPE_HW_CACHE;
+                    attr.config = cache_miss(PERF_COUNT_HW_CACHE_LL);
+                    break;
+                case PERF_BRANCH_MISSES:
+                    attr.type = PERF_TYPE_HARDWARE;
+                    attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+                    break;
+                case PERF_DTLB_MISSES:
+                    attr.type = PERF_TYPE_HW_CACHE;
+                    attr.config = cache_miss(PERF_COUNT_HW_CACHE_DTLB);
+                    break;
+            }
+        }
+
+        static int open_event(perf_event_attr& attr, int group_fd) {
+            return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+        }
+
+        void close_all() {
+            for (int& fd : fds) {
+                if (fd != -1) {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            slots.fill(-1);
+            leader = -1;
+            opened = 0;
+        }
+
+        // Returns false if the group opened but was not scheduled once enabled
+        bool open_group() {
+            // The first event that opens leads the group, events the kernel refuses alongside it are skipped
+            for (int kind = 0; kind < PERF_EVENT_COUNT; ++kind) {
+                perf_event_attr attr;
+                event_attr(kind, true, attr);
+                attr.disabled = (leader == -1) ? 1 : 0;
+                int fd = open_event(attr, leader);
+                if (fd == -1) {
+                    continue;
+                }
+                if (leader == -1) {
+                    leader = fd;
+                }
+                fds[kind] = fd;
+                slots[kind] = opened++;
+            }
+            if (leader == -1) {
+                return true;
+            }
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+            // Enabling schedules the group of the calling thread right away if the PMU has room for it
+            perf_counter_snapshot_t snapshot;
+            read(snapshot);
+            int first = 0;
+            while (slots[first] == -1) {
+                ++first;
+            }
+            return snapshot.time_enabled[first] == 0 || snapshot.time_running[first] > 0;
+        }
+
+        void open_individually() {
+            for (int kind = 0; kind < PERF_EVENT_COUNT; ++kind) {
+                perf_event_attr attr;
+                event_attr(kind, false, attr);
+                int fd = open_event(attr, -1);
+                if (fd == -1) {
+                    continue;
+                }
+                fds[kind] = fd;
+                slots[kind] = opened++;
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+
+    public:
+        perf_counter_group_t() {
+            fds.fill(-1);
+            slots.fill(-1);
+#ifdef __linux__
+            if (!open_group()) {
+                close_all();
+                open_individually();
+            }
+#endif
+        }
+
+        ~perf_counter_group_t() {
+#ifdef __linux__
+            close_all();
+#endif
+        }
+
+        perf_counter_group_t(const perf_counter_group_t&) = delete;
+        perf_counter_group_t& operator=(const perf_counter_group_t&) = delete;
+
+        inline bool available() const {
+            return opened > 0;
+        }
+
+        inline bool available(int kind) const {
+            return slots[kind] != -1;
+        }
+
+        // Events that cannot be read keep a running time of zero, so they are invalid in delta
+        void read(perf_counter_snapshot_t& snapshot) const {
+#ifdef __linux__
+            if (leader != -1) {
+                uint64_t buffer[3 + PERF_EVENT_COUNT];
+                ssize_t expected = static_cast<ssize_t>((3 + opened) * sizeof(uint64_t));
+                if (::read(leader, buffer, sizeof(buffer)) != expected) {
+                    snapshot.time_running.fill(0);
+                    return;
+                }
+                for (int kind = 0; kind < PERF_EVENT_COUNT; ++kind) {
+                    if (slots[kind] != -1) {
+                        snapshot.values[kind] = buffer[3 + slots[kind]];
+                        snapshot.time_enabled[kind] = buffer[1];
+                        snapshot.time_running[kind] = buffer[2];
+                    }
+                }
+                return;
+            }
+            for (int kind = 0; kind < PERF_EVENT_COUNT; ++kind) {
+                if (fds[kind] == -1) {
+                    continue;
+                }
+                uint64_t buffer[3];
+                if (::read(fds[kind], buffer, sizeof(buffer)) != static_cast<ssize_t>(sizeof(buffer))) {
+                    snapshot.time_running[kind] = 0;
+                    continue;
+                }
+                snapshot.values[kind] = buffer[0];
+                snapshot.time_enabled[kind] = buffer[1];
+                snapshot.time_running[kind] = buffer[2];
+            }
+#endif
+        }
+
+        // Counts between two snapshots; events that were never scheduled in between are not valid
+        perf_counter_values_t delta(const perf_counter_snapshot_t& start, const perf_counter_snapshot_t& stop) const {
+            perf_counter_values_t result;
+            for (int kind = 0; kind < PERF_EVENT_COUNT; ++kind) {
+                if (slots[kind] == -1 || stop.time_running[kind] <= start.time_running[kind]) {
+                    continue;
+                }
+                double scale = static_cast<double>(stop.time_enabled[kind] - start.time_enabled[kind])
+                    / (stop.time_running[kind] - start.time_running[kind]);
+                result.values[kind] = scale * (stop.values[kind] - start.values[kind]);
+                result.valid[kind] = true;
+            }
+            return result;
+        }
+    };
+
+} // namespace pecos
+
+#endif // __PERF_COUNTERS_H__
@@ -16,9 +16,17 @@
 
 #include <algorithm>
 #include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace pecos {
 
 namespace endian {
@@ -82,6 +90,54 @@ namespace endian {
 } // end of namespace endian
 
 
+/* A read-only memory mapping of a whole file, shared by the NpyArrays that point into it.
+ * Pages are mapped without write permission, so writing through a view faults instead of reaching the file. */
+class ReadOnlyMappedFile {
+
+public:
+    ReadOnlyMappedFile(const std::string& filename) : filename(filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw std::runtime_error("cannot open " + filename);
+        }
+        struct stat st;
+        if(fstat(fd, &st) != 0) {
+            close(fd);
+            throw std::runtime_error("cannot stat " + filename);
+        }
+        length = static_cast<size_t>(st.st_size);
+        if(length > 0) {
+            void* ptr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(ptr == MAP_FAILED) {
+                close(fd);
+                throw std::runtime_error("cannot mmap " + filename);
+            }
+            addr = static_cast<uint8_t*>(ptr);
+        }
+        // the mapping stays valid after the descriptor is closed
+        close(fd);
+    }
+
+    ~ReadOnlyMappedFile() {
+        if(addr != nullptr) {
+            munmap(addr, length);
+        }
+    }
+
+    ReadOnlyMappedFile(const ReadOnlyMappedFile&) = delete;
+    ReadOnlyMappedFile& operator=(const ReadOnlyMappedFile&) = delete;
+
+    const std::string& name() const { return filename; }
+    const uint8_t* data() const { return addr; }
+    size_t size() const { return length; }
+
+private:
+    std::string filename;
+    uint8_t* addr = nullptr;
+    size_t length = 0;
+};
+
+
 //https://numpy.org/devdocs/reference/generated/numpy.lib.format.html
 template<typename T>
 class NpyArray {
@@ -96,6 +152,11 @@ public:
     size_t num_elements;
     bool fortran_order;
 
+    // set by load_mmap when the content can be used in place;
+    // in that case `array` is empty and the elements live in the read-only `mapped_file`
+    std::shared_ptr<ReadOnlyMappedFile> mapped_file;
+    value_type* mapped_ptr = nullptr;
+
     NpyArray() {}
 
     NpyArray(const std::string& filename, uint64_t offset=0) { load(filename, offset); }
@@ -106,8 +167,100 @@ public:
     NpyArray<T>& load(const std::string& filename, uint64_t offset=0) {
         //https://numpy.org/devdocs/reference/generated/numpy.lib.format.html
         FILE *fp = fopen(filename.c_str(), "rb");
+        if(fp == nullptr) {
+            throw std::runtime_error("cannot open " + filename);
+        }
         fseek(fp, offset, SEEK_SET);
 
+        char endian_code, type_code;
+        uint32_t word_size;
+        std::string dtype;
+        this->read_header(fp, endian_code, type_code, word_size, dtype);
+        this->release_mapping();
+
+        // load array content
+        this->load_content(fp, word_size, dtype);
+
+        fclose(fp);
+        return *this;
+    }
+
+    /* load an NpyArray<T> starting from the `offset`-th byte of an already mapped file
+     *
+     * When the stored dtype has the layout of T, is in the runtime byte order and is suitably aligned,
+     * the elements are used in place and no copy is made. Otherwise the content is converted into `array`
+     * exactly as load() does, only reading from the mapping instead of the file.
+     * */
+    NpyArray<T>& load_mmap(const std::shared_ptr<ReadOnlyMappedFile>& file, uint64_t offset=0) {
+        if(offset >= file->size()) {
+            throw std::runtime_error("offset is beyond the end of " + file->name());
+        }
+        // fmemopen takes a non-const buffer but does not write to it in read mode
+        uint8_t* begin = const_cast<uint8_t*>(file->data()) + offset;
+        size_t length = file->size() - offset;
+        FILE *fp = fmemopen(begin, length, "rb");
+        if(fp == nullptr) {
+            throw std::runtime_error("cannot read the mapping of " + file->name());
+        }
+
+        char endian_code, type_code;
+        uint32_t word_size;
+        std::string dtype;
+        this->read_header(fp, endian_code, type_code, word_size, dtype);
+        this->release_mapping();
+
+        uint64_t content_offset = ftell(fp);
+        uint8_t* content = begin + content_offset;
+        bool in_place = is_layout_compatible(type_code, word_size)
+            && !endian::different_from_runtime(endian_code)
+            && reinterpret_cast<uintptr_t>(content) % alignof(value_type) == 0
+            && num_elements * sizeof(value_type) <= length - content_offset;
+
+        if(in_place) {
+            array.clear();
+            array.shrink_to_fit();
+            mapped_file = file;
+            mapped_ptr = reinterpret_cast<value_type*>(content);
+        } else {
+            this->load_content(fp, word_size, dtype);
+        }
+
+        fclose(fp);
+        return *this;
+    }
+
+    void resize(const std::vector<uint64_t>& new_shape, value_type default_value=value_type()) {
+        release_mapping();
+        shape = new_shape;
+        size_t num_elements = 1;
+        for(auto& dim : shape) {
+            num_elements *= dim;
+        }
+        array.resize(num_elements);
+        std::fill(array.begin(), array.end(), default_value);
+    }
+
+    size_t ndim() const { return shape.size(); }
+    size_t size() const { return num_elements; }
+    bool is_mapped() const { return mapped_ptr != nullptr; }
+    // bytes held in `array`, i.e., not served by the mapping
+    size_t copied_bytes() const { return mapped_ptr ? 0 : array.size() * sizeof(value_type); }
+    value_type* data() { return mapped_ptr ? mapped_ptr : &array[0]; }
+    const value_type* data() const { return mapped_ptr ? mapped_ptr : &array[0]; }
+    value_type& at(size_t idx) { return data()[idx]; }
+    const value_type& at(size_t idx) const { return data()[idx]; }
+    value_type& operator[](size_t idx) { return data()[idx]; }
+    const value_type& operator[](size_t idx) const { return data()[idx]; }
+
+private:
+
+    void release_mapping() {
+        mapped_ptr = nullptr;
+        mapped_file.reset();
+    }
+
+    // read the magic string, the version and the header, leaving `fp` at the first byte of the content
+    void read_header(FILE *fp, char& endian_code, char& type_code, uint32_t& word_size, std::string& dtype) {
         // check magic string
         std::vector<uint8_t> magic = {0x93u, 'N', 'U', 'M', 'P', 'Y'};
         for(size_t i = 0; i < magic.size(); i++) {
@@ -137,37 +290,26 @@ public:
         // load header
         std::vector<char> header(header_len + 1, (char) 0);
         endian::fget_multiple<char>(&header[0], header_len, fp);
-        char endian_code, type_code;
-        uint32_t word_size;
-        std::string dtype;
         this->parse_header(header, endian_code, type_code, word_size, dtype);
-
-        // load array content
-        this->load_content(fp, word_size, dtype);
-
-        fclose(fp);
-        return *this;
     }
 
-    void resize(const std::vector<uint64_t>& new_shape, value_type default_value=value_type()) {
-        shape = new_shape;
-        size_t num_elements = 1;
-        for(auto& dim : shape) {
-            num_elements *= dim;
+    // mapped bytes are reinterpreted as value_type, so only exact layouts are used in place.
+    // indices and indptr are non-negative, hence signed and unsigned integers of the same width are interchangeable.
+    template<typename U=value_type, typename std::enable_if<std::is_arithmetic<U>::value, U>::type* = nullptr>
+    static bool is_layout_compatible(char type_code, uint32_t word_size) {
+        if(word_size != sizeof(U)) {
+            return false;
         }
-        array.resize(num_elements);
-        std::fill(array.begin(), array.end(), default_value);
+        if(std::is_floating_point<U>::value) {
+            return type_code == 'f';
+        }
+        return type_code == 'i' || type_code == 'u';
     }
 
-    size_t ndim() const { return shape.size(); }
-    size_t size() const { return num_elements; }
-    value_type* data() { return &array[0]; }
-    value_type& at(size_t idx) { return array[idx]; }
-    const value_type& at(size_t idx) const { return array[idx]; }
-    value_type& operator[](size_t idx) { return array[idx]; }
-    const value_type& operator[](size_t idx) const { return array[idx]; }
-
-private:
+    template<typename U=value_type, typename std::enable_if<!std::is_arithmetic<U>::value, U>::type* = nullptr>
+    static bool is_layout_compatible(char, uint32_t) {
+        return false;
+    }
 
     void parse_header(const std::vector<char>& header, char& endian_code, char& type_code, uint32_t& word_size, std::string& dtype) {
         char value_buffer[1024] = {0};
@@ -378,7 +520,13 @@ struct ScipySparseNpz {
 
     ScipySparseNpz() {}
 
-    ScipySparseNpz(const std::string& npz_filepath) { load(npz_filepath); }
+    ScipySparseNpz(const std::string& npz_filepath, bool use_mmap=false) {
+        if(use_mmap) {
+            load_mmap(npz_filepath);
+        } else {
+            load(npz_filepath);
+        }
+    }
 
 
     uint64_t size() const { return data.size(); }
@@ -386,6 +534,15 @@ struct ScipySparseNpz {
     uint64_t cols() const { return shape[1]; }
     uint64_t nnz() const { return data.size(); }
 
+    /* true if indices and data, the arrays of nnz elements, point into the mapping rather than a private copy.
+     * scipy saves indptr as int32 unless nnz exceeds 2^31, which load_mmap widens to IndptrT in a private copy
+     * of rows + 1 (CSR) or cols + 1 (CSC) elements, so indptr is left out here; see copied_bytes().
+     * */
+    bool is_zero_copy() const { return indices.is_mapped() && data.is_mapped(); }
+
+    // bytes of indices, indptr and data that load_mmap had to copy out of the mapping
+    uint64_t copied_bytes() const { return indices.copied_bytes() + indptr.copied_bytes() + data.copied_bytes(); }
+
     void load(const std::string& npz_filepath) {
         auto npz = ReadOnlyZipArchive(npz_filepath);
         format.load(npz_filepath, npz["format.npy"].offset_of_content);
@@ -400,6 +557,25 @@ struct ScipySparseNpz {
         shape.load(npz_filepath, npz["shape.npy"].offset_of_content);
     }
 
+    /* Same as load(), but maps the (uncompressed) npz and lets indices, indptr and data refer to the mapping.
+     * Arrays whose dtype, byte order or alignment do not match are converted into private copies instead,
+     * see NpyArray::load_mmap. The mapping lives as long as any of the arrays refers to it.
+     * */
+    void load_mmap(const std::string& npz_filepath) {
+        auto npz = ReadOnlyZipArchive(npz_filepath);
+        auto file = std::make_shared<ReadOnlyMappedFile>(npz_filepath);
+        format.load_mmap(file, npz["format.npy"].offset_of_content);
+        if(IsCsr && format[0] != "csr") {
+            throw std::runtime_error(npz_filepath + " is not a valid scipy CSR npz");
+        } else if (!IsCsr && format[0] != "csc") {
+            throw std::runtime_error(npz_filepath + " is not a valid scipy CSC npz");
+        }
+        indices.load_mmap(file, npz["indices.npy"].offset_of_content);
+        data.load_mmap(file, npz["data.npy"].offset_of_content);
+        indptr.load_mmap(file, npz["indptr.npy"].offset_of_content);
+        shape.load_mmap(file, npz["shape.npy"].offset_of_content);
+    }
+
     void fill_ones(size_t rows, size_t cols) {
         shape.resize({2});
         shape[0] = rows;
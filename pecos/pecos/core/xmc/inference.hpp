@@ -28,14 +28,19 @@
 #include <chrono>
 #include <cmath>
 #include <cstdlib>
+#include <ctime>
 #include <string>
 #include <fstream>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <type_traits>
 #include <unistd.h>
 #include <vector>
+#include <ann/hnsw.h>
 #include <utils/matrix.hpp>
+#include <utils/perf_counters.hpp>
 #include <third_party/nlohmann_json/json.hpp>
 #include <third_party/robin_hood_hashing/robin_hood.h>
 
@@ -159,6 +164,9 @@ namespace pecos {
             };
             const std::string log_prefix("log-");
             static unordered_map<std::string, PostProcessor<T>> post_processors;
+            // Predictions on several threads of one model look up post processors concurrently
+            static std::mutex post_processors_mutex;
+            std::lock_guard<std::mutex> lock(post_processors_mutex);
 
             if (post_processors.find(name) != post_processors.end()) {
                 return post_processors[name];
@@ -247,6 +255,16 @@ namespace pecos {
             row_ptr[row_indx] = ptr;
             row_hash[row] = row_indx;
         }
+
+        // Number of entries stored for the given matrix row in this chunk
+        mem_index_type nnz_of_row(index_type row) const {
+            auto it = row_hash.find(row);
+            return (it == row_hash.end()) ? 0 : row_ptr[it->second + 1] - row_ptr[it->second];
+        }
+
+        mem_index_type get_nnz() const {
+            return row_ptr ? row_ptr[row_hash.size()] - row_ptr[0] : 0;
+        }
     };
 
     struct bin_search_chunk_t {
@@ -292,6 +310,20 @@ namespace pecos {
             row_ptr[row_indx] = ptr;
             row_idx[row_indx] = row;
         }
+
+        // Number of entries stored for the given matrix row in this chunk
+        mem_index_type nnz_of_row(index_type row) const {
+            auto it = std::lower_bound(row_idx, row_idx + nnz_rows, row);
+            if (it == row_idx + nnz_rows || *it != row) {
+                return 0;
+            }
+            auto i = it - row_idx;
+            return row_ptr[i + 1] - row_ptr[i];
+        }
+
+        mem_index_type get_nnz() const {
+            return nnz_rows ? row_ptr[nnz_rows] - row_ptr[0] : 0;
+        }
     };
 
     struct hash_chunked_matrix_t {
@@ -376,11 +408,13 @@ namespace pecos {
     }
 
     // Create a chunked matrix from a csc matrix. chunk_col_idx specifies the
-    // column starts of each chunk.
+    // column starts of each chunk. Chunks are independent of each other, so they
+    // are built concurrently by up to `threads` threads.
     template <typename matrix_type_t, typename chunk_col_array_index_t>
     matrix_type_t make_chunked_from_csc(const csc_t& mat,
         const chunk_col_array_index_t chunk_col_idx[],
-        const uint32_t chunk_count) {
+        const uint32_t chunk_count,
+        int threads=1) {
 
         typedef typename matrix_type_t::index_type index_type;
         typedef typename matrix_type_t::mem_index_type mem_index_type;
@@ -415,18 +449,20 @@ namespace pecos {
         }
         chunk_ptr[chunk_count] = mat.col_ptr[mat.cols];
 
-        std::vector<chunk_nz_entry_t> nonzeros;
+        threads = std::min<int>(resolve_threads(threads), std::max<uint32_t>(chunk_count, 1));
+        std::vector<std::vector<chunk_nz_entry_t>> nonzeros_thread(threads);
 
-        for (chunk_index_type i_chunk = 0; i_chunk < chunk_count; ++i_chunk) {
+        parallel_for<chunk_index_type>(0, chunk_count, [&](chunk_index_type i_chunk, int thread_id) {
             auto& chunk = chunked.chunks[i_chunk];
             mem_index_type chunk_nnz = chunk_ptr[i_chunk + 1] - chunk_ptr[i_chunk];
 
             // No nonzeros, no problem!
             if (chunk_nnz == 0) {
                 chunk.set_empty();
-                continue;
+                return;
             }
 
+            auto& nonzeros = nonzeros_thread[thread_id];
             nonzeros.resize(chunk_nnz);
 
             // Collect nonzeros
@@ -472,7 +508,7 @@ namespace pecos {
                 chunked.entries[entry_location].col_offset = entry.col - chunk.col_begin;
                 chunked.entries[entry_location].val = entry.val;
             }
-        }
+        }, threads);
         return chunked;
     }
 
@@ -496,13 +532,13 @@ namespace pecos {
 
     template <typename matrix_t>
     matrix_t make_chunked_W_from_layer_matrices(const csc_t& W, const csc_t& C,
-        bool b_use_bias) {
+        bool b_use_bias, int threads=1) {
 
         typedef typename matrix_t::chunk_index_type chunk_index_t;
         typedef typename csc_t::mem_index_type index_t;
 
         // Make sure that the rows of C are contiguous in order of parent node
-        matrix_t result = make_chunked_from_csc<matrix_t, index_t>(W, C.col_ptr, C.cols);
+        matrix_t result = make_chunked_from_csc<matrix_t, index_t>(W, C.col_ptr, C.cols, threads);
 
         // Precompute whether each chunk actually has a bias term.
         if (b_use_bias) {
@@ -1269,6 +1305,95 @@ namespace pecos {
         }
     };
 
+    // Heap bytes held by the data structures of one layer, see IModelLayer::get_memory_usage.
+    // Counts are exact sizes of the allocations made by the layer, allocator overhead is not included.
+    struct layer_memory_t {
+        uint64_t chunk_entries = 0; // hash_chunked_matrix_t/bin_search_chunked_matrix_t::entries
+        uint64_t chunk_headers = 0; // The chunk_t array
+        uint64_t row_hash = 0; // hash_chunk_t::row_hash tables
+        uint64_t row_idx = 0; // bin_search_chunk_t::row_idx, or csc_t::row_idx of an unchunked W
+        uint64_t row_ptr = 0; // Chunk row_ptr arrays, or csc_t::col_ptr of an unchunked W
+        uint64_t values = 0; // csc_t::val of an unchunked W
+        uint64_t codes = 0; // The C matrix
+        uint64_t permutation = 0; // perm and perm_inv of the children rearrangement
+
+        uint64_t total() const {
+            return chunk_entries + chunk_headers + row_hash + row_idx + row_ptr + values + codes + permutation;
+        }
+
+        layer_memory_t& operator+=(const layer_memory_t& other) {
+            chunk_entries += other.chunk_entries;
+            chunk_headers += other.chunk_headers;
+            row_hash += other.row_hash;
+            row_idx += other.row_idx;
+            row_ptr += other.row_ptr;
+            values += other.values;
+            codes += other.codes;
+            permutation += other.permutation;
+            return *this;
+        }
+
+        nlohmann::json to_json() const {
+            return {
+                {"chunk_entries", chunk_entries},
+                {"chunk_headers", chunk_headers},
+                {"row_hash", row_hash},
+                {"row_idx", row_idx},
+                {"row_ptr", row_ptr},
+                {"values", values},
+                {"codes", codes},
+                {"permutation", permutation},
+                {"total", total()}
+            };
+        }
+    };
+
+    // Bytes of the table allocated by a robin_hood map, which is a single block for flat maps
+    template <typename map_t>
+    inline uint64_t hash_table_bytes(const map_t& map) {
+        static_assert(map_t::is_flat, "node based maps allocate every entry separately");
+        if (map.mask() == 0) {
+            return 0;
+        }
+        return map.calcNumBytesTotal(map.calcNumElementsWithBuffer(map.mask() + 1));
+    }
+
+    inline uint64_t csc_bytes(const csc_t& mat) {
+        return sizeof(csc_t::mem_index_type) * (mat.cols + 1)
+            + (sizeof(csc_t::index_type) + sizeof(csc_t::value_type)) * mat.get_nnz();
+    }
+
+    inline void add_memory_usage(const csc_t& W, layer_memory_t& memory) {
+        memory.row_ptr += sizeof(csc_t::mem_index_type) * (W.cols + 1);
+        memory.row_idx += sizeof(csc_t::index_type) * W.get_nnz();
+        memory.values += sizeof(csc_t::value_type) * W.get_nnz();
+    }
+
+    // Entries are counted per chunk, as get_nnz of the matrix needs a non empty last chunk
+    inline void add_memory_usage(const hash_chunked_matrix_t& W, layer_memory_t& memory) {
+        memory.chunk_headers += sizeof(hash_chunk_t) * W.chunk_count;
+        for (hash_chunked_matrix_t::index_type i = 0; i < W.chunk_count; ++i) {
+            auto& chunk = W.chunks[i];
+            memory.chunk_entries += sizeof(chunk_entry_t) * chunk.get_nnz();
+            if (chunk.row_ptr) {
+                memory.row_ptr += sizeof(hash_chunk_t::mem_index_type) * (chunk.row_hash.size() + 1);
+            }
+            memory.row_hash += hash_table_bytes(chunk.row_hash);
+        }
+    }
+
+    inline void add_memory_usage(const bin_search_chunked_matrix_t& W, layer_memory_t& memory) {
+        memory.chunk_headers += sizeof(bin_search_chunk_t) * W.chunk_count;
+        for (bin_search_chunked_matrix_t::index_type i = 0; i < W.chunk_count; ++i) {
+            auto& chunk = W.chunks[i];
+            memory.chunk_entries += sizeof(chunk_entry_t) * chunk.get_nnz();
+            if (chunk.row_ptr) {
+                memory.row_ptr += sizeof(bin_search_chunk_t::mem_index_type) * (chunk.nnz_rows + 1);
+                memory.row_idx += sizeof(bin_search_chunk_t::index_type) * chunk.nnz_rows;
+            }
+        }
+    }
+
     struct query_statistics_t {
         typedef typename csr_t::index_type index_type;
         typedef typename csr_t::mem_index_type mem_index_type;
@@ -1294,6 +1419,179 @@ namespace pecos {
         }
     };
 
+    // Measures wall clock and process CPU time since construction or the last restart.
+    // Constructed with start=false it reads no clock until restart is called.
+    struct stopwatch_t {
+        std::chrono::steady_clock::time_point wall_start;
+        std::clock_t cpu_start = 0;
+
+        explicit stopwatch_t(bool start=true) {
+            if (start) {
+                restart();
+            }
+        }
+
+        void restart() {
+            wall_start = std::chrono::steady_clock::now();
+            cpu_start = std::clock();
+        }
+
+        double wall_ms() const {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - wall_start).count();
+        }
+
+        double cpu_ms() const {
+            return 1000.0 * (std::clock() - cpu_start) / CLOCKS_PER_SEC;
+        }
+    };
+
+    // Work done by one layer during HierarchicalMLModel::predict.
+    // Values accumulate over predict calls until the instrumentation is reset.
+    struct layer_instrumentation_t {
+        typedef typename csr_t::mem_index_type mem_index_type;
+
+        double wall_time_ms = 0.0;
+        double cpu_time_ms = 0.0;
+        double counting_time_ms = 0.0; // Wall time of filling the work counters below, not part of the timings
+        double counting_cpu_time_ms = 0.0;
+        mem_index_type queries = 0; // Query rows passed through the layer
+        mem_index_type beam_nnz = 0; // Active parent nodes entering the layer, summed over queries
+        mem_index_type nodes_evaluated = 0; // Query x node scores computed
+        mem_index_type chunks_evaluated = 0; // Query x chunk products computed, 0 for LAYER_TYPE_CSC
+        mem_index_type nnz_touched = 0; // Weight matrix nonzeros read by those products
+        perf_counter_values_t counters; // Hardware counters of the timed region, see enable_hardware_counters
+
+        double mean_beam_occupancy() const {
+            return queries ? static_cast<double>(beam_nnz) / queries : 0.0;
+        }
+
+        nlohmann::json to_json() const {
+            nlohmann::json j = {
+                {"wall_time_ms", wall_time_ms},
+                {"cpu_time_ms", cpu_time_ms},
+                {"counting_time_ms", counting_time_ms},
+                {"queries", queries},
+                {"beam_nnz", beam_nnz},
+                {"mean_beam_occupancy", mean_beam_occupancy()},
+                {"nodes_evaluated", nodes_evaluated},
+                {"chunks_evaluated", chunks_evaluated},
+                {"nnz_touched", nnz_touched}
+            };
+            if (counters.any_valid()) {
+                j["counters"] = counters.to_json();
+                j["counters_per_query"] = counters.to_json(queries);
+            }
+            return j;
+        }
+    };
+
+    struct prediction_instrumentation_t {
+        std::vector<layer_instrumentation_t> layers;
+        uint64_t predict_calls = 0;
+        uint64_t queries = 0;
+        // The time the layers spend counting their work is taken out of wall_time_ms and cpu_time_ms
+        // and reported as counting_time_ms. The hardware counters still include it.
+        double wall_time_ms = 0.0;
+        double cpu_time_ms = 0.0;
+        double counting_time_ms = 0.0;
+        perf_counter_values_t counters;
+
+        double layers_counting_time_ms() const {
+            double total = 0.0;
+            for (auto& layer : layers) {
+                total += layer.counting_time_ms;
+            }
+            return total;
+        }
+
+        double layers_counting_cpu_time_ms() const {
+            double total = 0.0;
+            for (auto& layer : layers) {
+                total += layer.counting_cpu_time_ms;
+            }
+            return total;
+        }
+
+        void reset(size_t depth) {
+            layers.assign(depth, layer_instrumentation_t());
+            predict_calls = 0;
+            queries = 0;
+            wall_time_ms = 0.0;
+            cpu_time_ms = 0.0;
+            counting_time_ms = 0.0;
+            counters = perf_counter_values_t();
+        }
+
+        nlohmann::json to_json() const {
+            nlohmann::json j_layers = nlohmann::json::array();
+            for (auto& layer : layers) {
+                j_layers.push_back(layer.to_json());
+            }
+            nlohmann::json j = {
+                {"predict_calls", predict_calls},
+                {"queries", queries},
+                {"wall_time_ms", wall_time_ms},
+                {"cpu_time_ms", cpu_time_ms},
+                {"counting_time_ms", counting_time_ms},
+                {"layers", j_layers}
+            };
+            if (counters.any_valid()) {
+                j["counters"] = counters.to_json();
+                j["counters_per_query"] = counters.to_json(queries);
+            }
+            return j;
+        }
+
+        std::string dump_json(int indent=4) const {
+            return to_json().dump(indent);
+        }
+    };
+
+    // Number of weight nonzeros read when multiplying a query with a chunk
+    template <typename chunk_t>
+    inline uint64_t count_chunk_nnz_touched(const csr_t::row_vec_t& v, const chunk_t& chunk,
+        typename chunk_t::index_type bias_row) {
+        uint64_t touched = chunk.b_has_explicit_bias ? chunk.nnz_of_row(bias_row) : 0;
+        for (csr_t::row_vec_t::index_type i = 0; i < v.nnz; ++i) {
+            touched += chunk.nnz_of_row(v.idx[i]);
+        }
+        return touched;
+    }
+
+    // Dense queries read every entry of the chunk including the bias row, only the query type matters
+    template <typename chunk_t>
+    inline uint64_t count_chunk_nnz_touched(const drm_t::row_vec_t&, const chunk_t& chunk,
+        typename chunk_t::index_type) {
+        return chunk.get_nnz();
+    }
+
+    // Fills the work counters of a layer from the sparsity patterns used by w_ops::compute_sparse_predictions
+    template <typename query_matrix_t, typename chunked_matrix_t>
+    void count_layer_work(const query_matrix_t& X, const chunked_matrix_t& W,
+        const csr_t& prev_layer_pred, const csr_t&, layer_instrumentation_t& stats) {
+        typedef typename csr_t::mem_index_type mem_index_type;
+        typedef typename csr_t::index_type index_type;
+
+        stats.chunks_evaluated += prev_layer_pred.get_nnz();
+        for (index_type row = 0; row < X.rows; ++row) {
+            auto xi = X.get_row(row);
+            for (mem_index_type i = prev_layer_pred.row_ptr[row]; i < prev_layer_pred.row_ptr[row + 1]; ++i) {
+                stats.nnz_touched += count_chunk_nnz_touched(xi, W.chunks[prev_layer_pred.col_idx[i]], W.rows - 1);
+            }
+        }
+    }
+
+    // Every selected label reads its whole weight column, whatever the queries and the beam were
+    template <typename query_matrix_t>
+    void count_layer_work(const query_matrix_t&, const csc_t& W,
+        const csr_t&, const csr_t& labels, layer_instrumentation_t& stats) {
+        typedef typename csr_t::mem_index_type mem_index_type;
+
+        for (mem_index_type i = 0; i < labels.get_nnz(); ++i) {
+            stats.nnz_touched += W.nnz_of_col(labels.col_idx[i]);
+        }
+    }
+
     csr_t csr_npz_to_csr_t_deep_copy(ScipyCsrF32Npz& mat) {
         csr_t result;
         result.rows = mat.rows();
@@ -1314,20 +1612,49 @@ namespace pecos {
         return result.deep_copy();
     }
 
+    // Wraps the arrays of mat without copying them, e.g., after ScipySparseNpz::load_mmap.
+    // The result does not own its memory: it is only valid while mat is alive,
+    // and one should NOT call free_underlying_memory on it.
+    csr_t csr_npz_to_csr_t_view(ScipyCsrF32Npz& mat) {
+        csr_t result;
+        result.rows = mat.rows();
+        result.cols = mat.cols();
+        result.col_idx = mat.indices.data();
+        result.row_ptr = mat.indptr.data();
+        result.val = mat.data.data();
+        return result;
+    }
+
+    csc_t csc_npz_to_csc_t_view(ScipyCscF32Npz& mat) {
+        csc_t result;
+        result.rows = mat.rows();
+        result.cols = mat.cols();
+        result.row_idx = mat.indices.data();
+        result.col_ptr = mat.indptr.data();
+        result.val = mat.data.data();
+        return result;
+    }
+
     // An abstract interface for a layer of the model
     template <typename index_type, typename value_type>
     class IModelLayer {
     protected:
+        // Where predict records its timings and work counters, nullptr when instrumentation is disabled
+        layer_instrumentation_t* instrumentation = nullptr;
+        // Hardware counters read around the timed region, nullptr when they are disabled
+        const perf_counter_group_t* counter_group = nullptr;
+
         virtual void init(
             csc_t& W,
             csc_t& C,
             uint32_t depth,
             bool b_assumes_ownership,
-            MLModelMetadata& metadata
+            MLModelMetadata& metadata,
+            int threads
         ) = 0;
         static IModelLayer<index_type, value_type>* instantiate(const layer_type_t layer_type);
         static void load(const std::string& folderpath, const uint32_t cur_depth,
-            IModelLayer<index_type, value_type>* model);
+            IModelLayer<index_type, value_type>* model, int threads=1);
 
     public:
         virtual void predict(
@@ -1374,6 +1701,14 @@ namespace pecos {
 
         // Layer statistics
         virtual layer_statistics_t get_statistics() const = 0;
+
+        // Bytes held by the weights, codes and permutation of this layer
+        virtual layer_memory_t get_memory_usage() const = 0;
+
+        void set_instrumentation(layer_instrumentation_t* stats, const perf_counter_group_t* counters=nullptr) {
+            instrumentation = stats;
+            counter_group = stats ? counters : nullptr;
+        }
         virtual layer_type_t get_type() const = 0;
         virtual index_type label_count() const = 0;
         virtual index_type feature_count() const = 0;
@@ -1381,13 +1716,14 @@ namespace pecos {
         virtual value_type bias() const = 0;
 
         static IModelLayer<index_type, value_type>* instantiate(const std::string& folderpath,
-            const layer_type_t layer_type, const uint32_t cur_depth);
+            const layer_type_t layer_type, const uint32_t cur_depth, int threads=1);
     };
 
     template <typename index_type, typename value_type>
     void IModelLayer<index_type, value_type>::load(const std::string& folderpath,
         const uint32_t cur_depth,
-        IModelLayer<index_type, value_type>* model) {
+        IModelLayer<index_type, value_type>* model,
+        int threads) {
         MLModelMetadata metadata(folderpath + "/param.json");
         std::string w_npz_path = folderpath + "/W.npz";
         std::string c_npz_path = folderpath + "/C.npz";
@@ -1396,27 +1732,28 @@ namespace pecos {
         csc_t py_matrix_csc_C;
         csc_t py_matrix_csc_W;
 
-        W.load(w_npz_path);
+        // Map the files so the deep copy below reads straight from the page cache
+        W.load_mmap(w_npz_path);
         if ((cur_depth == 0) && (access(c_npz_path.c_str(), F_OK) != 0)) {
             // this is to handle the case where the root layer does not have code saved.
             C.fill_ones(W.cols(), 1);
         } else {
-            C.load(c_npz_path);
+            C.load_mmap(c_npz_path);
         }
 
         // We perform a deep copy because MLModel assumes ownership of the memory.
         py_matrix_csc_C = csc_npz_to_csc_t_deep_copy(C);
         py_matrix_csc_W = csc_npz_to_csc_t_deep_copy(W);
 
-        model->init(py_matrix_csc_W, py_matrix_csc_C, cur_depth, true, metadata);
+        model->init(py_matrix_csc_W, py_matrix_csc_C, cur_depth, true, metadata, threads);
     }
 
     template <typename index_type, typename value_type>
     IModelLayer<index_type, value_type>* IModelLayer<index_type, value_type>::instantiate(
         const std::string& folderpath,
-        const layer_type_t layer_type, const uint32_t cur_depth) {
+        const layer_type_t layer_type, const uint32_t cur_depth, int threads) {
         IModelLayer* result = IModelLayer::instantiate(layer_type);
-        IModelLayer::load(folderpath, cur_depth, result);
+        IModelLayer::load(folderpath, cur_depth, result, threads);
         return result;
     }
 
@@ -1450,7 +1787,7 @@ namespace pecos {
         value_type bias;
 
         // Initializes this layer data
-        void init(csc_t& W, csc_t& C, bool b_assumes_ownership, value_type bias) {
+        void init(csc_t& W, csc_t& C, bool b_assumes_ownership, value_type bias, int threads=1) {
             this->bias = bias;
             this->b_assumes_ownership = b_assumes_ownership;
             this->W = W;
@@ -1461,6 +1798,13 @@ namespace pecos {
         void reorder_prediction(csr_t& prediction) {
         }
 
+        layer_memory_t get_memory_usage() const {
+            layer_memory_t memory;
+            add_memory_usage(W, memory);
+            memory.codes = csc_bytes(C);
+            return memory;
+        }
+
         // Frees all memory that is owned by this class
         ~LayerData() {
             if (b_assumes_ownership) {
@@ -1532,7 +1876,8 @@ namespace pecos {
             }
 
 
-            csc_t get_rearranged_weight_matrix(const csc_t& mat) {
+            // Columns are copied concurrently by up to `threads` threads
+            csc_t get_rearranged_weight_matrix(const csc_t& mat, int threads=1) {
 
                 typedef typename csc_t::mem_index_type mem_index_type;
                 typedef typename csc_t::value_type value_type;
@@ -1552,11 +1897,14 @@ namespace pecos {
                 result.col_ptr = new mem_index_type[result.cols + 1];
                 result.col_ptr[0] = 0;
 
-                // Copy memory from source
                 for (index_type col = 0; col < result.cols; ++col) {
+                    result.col_ptr[col + 1] = result.col_ptr[col] + mat.nnz_of_col(perm_inv[col]);
+                }
+
+                // Copy memory from source
+                parallel_for<index_type>(0, result.cols, [&](index_type col, int thread_id) {
                     index_type original_col = perm_inv[col];
                     mem_index_type column_size = mat.nnz_of_col(original_col);
-                    result.col_ptr[col + 1] = result.col_ptr[col] + column_size;
 
                     mem_index_type read_addr = mat.col_ptr[original_col];
                     mem_index_type write_addr = result.col_ptr[col];
@@ -1565,7 +1913,7 @@ namespace pecos {
                         sizeof(index_type) * column_size);
                     std::memcpy(&result.val[write_addr], &mat.val[read_addr],
                         sizeof(value_type) * column_size);
-                }
+                }, threads);
                 return result;
             }
 
@@ -1594,7 +1942,7 @@ namespace pecos {
         value_type bias;
 
         // Initializes this layer data
-        void init(csc_t& _W, csc_t& _C, bool b_assumes_ownership, value_type bias) {
+        void init(csc_t& _W, csc_t& _C, bool b_assumes_ownership, value_type bias, int threads=1) {
             bool b_has_bias = bias > 0.0;
             this->bias = bias;
             this->b_assumes_ownership = b_assumes_ownership;
@@ -1607,7 +1955,7 @@ namespace pecos {
 
                 csc_t C_rearranged = children_rearrangement.get_rearranged_codes(_C);
 
-                auto W_rearranged = children_rearrangement.get_rearranged_weight_matrix(_W);
+                auto W_rearranged = children_rearrangement.get_rearranged_weight_matrix(_W, threads);
 
                 if (b_assumes_ownership) {
                     _C.free_underlying_memory();
@@ -1615,13 +1963,13 @@ namespace pecos {
                 }
 
                 this->b_children_reordered = true;
-                this->W = make_chunked_W_from_layer_matrices<chunked_matrix_t>(W_rearranged, C_rearranged, b_has_bias);
+                this->W = make_chunked_W_from_layer_matrices<chunked_matrix_t>(W_rearranged, C_rearranged, b_has_bias, threads);
                 this->C = C_rearranged;
                 W_rearranged.free_underlying_memory();
             }
             else {
                 this->b_children_reordered = false;
-                this->W = make_chunked_W_from_layer_matrices<chunked_matrix_t>(_W, _C, b_has_bias);
+                this->W = make_chunked_W_from_layer_matrices<chunked_matrix_t>(_W, _C, b_has_bias, threads);
                 this->C = _C;
 
                 if (b_assumes_ownership) {
@@ -1637,6 +1985,17 @@ namespace pecos {
             }
         }
 
+        layer_memory_t get_memory_usage() const {
+            layer_memory_t memory;
+            add_memory_usage(W, memory);
+            memory.codes = csc_bytes(C);
+            if (b_children_reordered) {
+                memory.permutation = sizeof(csc_t::index_type) * (children_rearrangement.perm.capacity()
+                    + children_rearrangement.perm_inv.capacity());
+            }
+            return memory;
+        }
+
         // Frees all memory that is owned by this class
         ~LayerData() {
             W.free_underlying_memory();
@@ -1676,10 +2035,11 @@ namespace pecos {
             csc_t& C,
             uint32_t depth,
             bool b_assumes_ownership,
-            MLModelMetadata& metadata
+            MLModelMetadata& metadata,
+            int threads
         ) override {
             statistics = layer_statistics_t::compute(W, C);
-            layer_data.init(W, C, b_assumes_ownership, metadata.bias);
+            layer_data.init(W, C, b_assumes_ownership, metadata.bias, threads);
             cur_depth = depth;
 
             post_processor = PostProcessor<value_type>::get(metadata.post_processor);
@@ -1735,6 +2095,13 @@ namespace pecos {
 
             set_threads(threads);
 
+            perf_counter_snapshot_t counters_start;
+            if (this->counter_group != nullptr) {
+                this->counter_group->read(counters_start);
+            }
+            // Clocks are only read when instrumented, single query predictions pay for nothing else
+            stopwatch_t watch(this->instrumentation != nullptr);
+
             uint32_t only_topk_to_use = (overridden_only_topk > 0) ? overridden_only_topk : only_topk;
             const PostProcessor<value_type>& post_processor_to_use =
                 (overridden_post_processor == nullptr) ? post_processor
@@ -1754,13 +2121,32 @@ namespace pecos {
             if (!is_first_layer) {
                 combine_matrices_csr(post_processor_to_use, curr_layer_pred, labels);
             }
-            labels.free_underlying_memory();
 
             // Narrow the search to the top k results
             sorted_csr(curr_layer_pred, only_topk_to_use);
 
             // Reorder columns of prediction if necessary
             layer_data.reorder_prediction(curr_layer_pred);
+
+            // Counting is done after the clock stops, so it does not inflate the timings
+            if (this->instrumentation != nullptr) {
+                auto& stats = *this->instrumentation;
+                stats.wall_time_ms += watch.wall_ms();
+                stats.cpu_time_ms += watch.cpu_ms();
+                if (this->counter_group != nullptr) {
+                    perf_counter_snapshot_t counters_stop;
+                    this->counter_group->read(counters_stop);
+                    stats.counters += this->counter_group->delta(counters_start, counters_stop);
+                }
+                stats.queries += X.rows;
+                stats.beam_nnz += prev_layer_pred.get_nnz();
+                stats.nodes_evaluated += labels.get_nnz();
+                stopwatch_t counting_watch;
+                count_layer_work(X, W, prev_layer_pred, labels, stats);
+                stats.counting_time_ms += counting_watch.wall_ms();
+                stats.counting_cpu_time_ms += counting_watch.cpu_ms();
+            }
+            labels.free_underlying_memory();
         }
 
         void predict(
@@ -1906,6 +2292,10 @@ namespace pecos {
             return statistics;
         }
 
+        layer_memory_t get_memory_usage() const override {
+            return layer_data.get_memory_usage();
+        }
+
         layer_type_t get_type() const override {
             return WEIGHT_MATRIX_METADATA_<w_matrix_t>::LAYER_TYPE;
         }
@@ -1930,8 +2320,8 @@ namespace pecos {
             return layer_data.bias;
         }
 
-        MLModel(const std::string& folderpath, const uint32_t cur_depth) {
-            ISpecializedModelLayer::load(folderpath, cur_depth, this);
+        MLModel(const std::string& folderpath, const uint32_t cur_depth, int threads=1) {
+            ISpecializedModelLayer::load(folderpath, cur_depth, this, threads);
         }
     };
 
@@ -1962,6 +2352,268 @@ namespace pecos {
         }
     }
 
+    // Approximate replacement of the top `depth` layers of a HierarchicalMLModel.
+    // An HNSW index over the weight vectors of the clusters of layer depth - 1 (bias row included) retrieves
+    // efS candidates per query by inner product. Each candidate is then scored exactly along its path of
+    // ancestors with the layers' post processors, and the best `beam_size` become the beam that the exact
+    // layers below continue from. Scoring every cluster of the wide top layers is thereby replaced by a
+    // graph search, at the price of recall, see HierarchicalMLModel::evaluate_matcher.
+    // Weights are loaded from the model folder; queries are thread safe.
+    class hnsw_matcher_t {
+    public:
+        typedef typename csc_t::index_type index_type;
+        typedef typename csc_t::value_type value_type;
+
+    private:
+        uint32_t depth;
+        // W, bias and post processor of layers 0 to depth - 1
+        std::vector<csc_t> W;
+        std::vector<value_type> bias;
+        std::vector<std::string> post_processor;
+        // parent[l][c] is the cluster of layer l - 1 above cluster c of layer l, parent[0] is empty
+        std::vector<std::vector<index_type>> parent;
+        uint32_t only_topk;
+        index_type efS;
+
+        ann::SparseInnerProductSpace space;
+        std::unique_ptr<ann::HNSW<float>> index;
+
+        // Sorted nonzeros of a query followed by the bias feature, in the index type of the HNSW space
+        template <typename query_vec_t>
+        void query_entries(const query_vec_t& query, std::vector<ann::SparseEntry>& entries) const;
+
+        // Combined score of the path that ends in cluster c of layer depth - 1, as the exact layers compute it
+        template <typename query_vec_t>
+        value_type path_score(const query_vec_t& query, index_type c, value_type leaf_inner_product,
+            const std::vector<PostProcessor<value_type>>& post_processors) const {
+            std::vector<index_type> path(depth);
+            path[depth - 1] = c;
+            for (uint32_t l = depth - 1; l > 0; --l) {
+                path[l - 1] = parent[l][path[l]];
+            }
+            value_type combined = 0;
+            for (uint32_t l = 0; l < depth; ++l) {
+                const PostProcessor<value_type>& pp = post_processors[l];
+                value_type score = (l == depth - 1) ? leaf_inner_product
+                    : vector_ops<query_vec_t, typename csc_t::col_vec_t>::inner_product(
+                        query, W[l].get_col(path[l]), W[l].rows, bias[l], bias[l] > 0);
+                combined = (l == 0) ? pp.transform(score) : pp.combiner(pp.transform(score), combined);
+            }
+            return combined;
+        }
+
+    public:
+        hnsw_matcher_t(
+            const std::string& folderpath,
+            uint32_t depth,
+            index_type M=16,
+            index_type efC=200,
+            index_type efS=100,
+            int threads=-1
+        ) : depth(depth), efS(efS) {
+            HierarchicalMLModelMetadata model_metadata(folderpath + "/param.json");
+            if (depth == 0 || depth > static_cast<uint32_t>(model_metadata.depth)) {
+                throw std::invalid_argument("matcher depth has to be between 1 and the depth of the model");
+            }
+            W.resize(depth);
+            parent.resize(depth);
+            try {
+                for (uint32_t l = 0; l < depth; ++l) {
+                    std::string layer_path = folderpath + "/" + std::to_string(l) + ".model/";
+                    MLModelMetadata metadata(layer_path + "param.json");
+                    bias.push_back(metadata.bias);
+                    post_processor.push_back(metadata.post_processor);
+                    only_topk = metadata.only_topk;
+
+                    ScipyCscF32Npz W_npz;
+                    W_npz.load_mmap(layer_path + "W.npz");
+                    W[l] = csc_npz_to_csc_t_deep_copy(W_npz);
+                    if (l > 0) {
+                        ScipyCscF32Npz C_npz;
+                        C_npz.load_mmap(layer_path + "C.npz");
+                        csc_t C = csc_npz_to_csc_t_view(C_npz);
+                        if (C.rows != W[l].cols || C.cols != W[l - 1].cols) {
+                            throw std::runtime_error("model corrupted, C of layer " + std::to_string(l)
+                                + " does not match its W");
+                        }
+                        parent[l].assign(C.rows, 0);
+                        for (index_type p = 0; p < C.cols; ++p) {
+                            for (auto k = C.col_ptr[p]; k < C.col_ptr[p + 1]; ++k) {
+                                parent[l][C.row_idx[k]] = p;
+                            }
+                        }
+                    }
+                }
+            } catch (...) {
+                for (auto& w : W) {
+                    w.free_underlying_memory();
+                }
+                throw;
+            }
+
+            // The columns of a csc matrix are the rows of its transpose in csr format
+            const csc_t& W_leaf = W[depth - 1];
+            csr_t W_t;
+            W_t.rows = W_leaf.cols;
+            W_t.cols = W_leaf.rows;
+            W_t.row_ptr = W_leaf.col_ptr;
+            W_t.col_idx = W_leaf.row_idx;
+            W_t.val = W_leaf.val;
+            // Level l is reached with probability M^-l, a couple of levels above log_M(n) is enough
+            index_type max_level = static_cast<index_type>(std::ceil(std::log(std::max<double>(W_t.rows, 2.0)) / std::log(M))) + 2;
+            index.reset(new ann::HNSW<float>(&space, W_t.rows, W_t.cols, M, efC));
+            index->train(W_t, max_level, threads);
+            index->reorder(ann::REORDER_BFS);
+        }
+
+        ~hnsw_matcher_t() {
+            for (auto& w : W) {
+                w.free_underlying_memory();
+            }
+        }
+
+        hnsw_matcher_t(const hnsw_matcher_t&) = delete;
+        hnsw_matcher_t& operator=(const hnsw_matcher_t&) = delete;
+
+        inline uint32_t get_depth() const {
+            return depth;
+        }
+
+        inline index_type cluster_count() const {
+            return W[depth - 1].cols;
+        }
+
+        inline index_type feature_count() const {
+            return bias[depth - 1] > 0 ? W[depth - 1].rows - 1 : W[depth - 1].rows;
+        }
+
+        // Beam used when predict is not given one, the only_topk of layer depth - 1
+        inline uint32_t default_beam_size() const {
+            return only_topk;
+        }
+
+        // Size of the candidate list of the graph search, raised to the beam size when smaller
+        void set_efS(index_type efS) {
+            this->efS = efS;
+        }
+
+        // The beam of layer depth - 1 for every query: at most beam_size clusters per row, sorted by decreasing
+        // combined score like the output of an exact layer. The result owns its memory.
+        template <typename query_matrix_t>
+        csr_t predict(
+            const query_matrix_t& X,
+            uint32_t beam_size,
+            const char* overridden_post_processor=nullptr,
+            const int threads=-1
+        ) const {
+            typedef std::pair<value_type, index_type> scored_t;
+            if (beam_size == 0) {
+                beam_size = only_topk;
+            }
+            std::vector<PostProcessor<value_type>> post_processors;
+            for (uint32_t l = 0; l < depth; ++l) {
+                post_processors.push_back(PostProcessor<value_type>::get(
+                    overridden_post_processor ? overridden_post_processor : post_processor[l]));
+            }
+            std::vector<std::vector<scored_t>> beams(X.rows);
+            parallel_for<index_type>(0, X.rows, [&](index_type i, int thread_id) {
+                const auto& query = X.get_row(i);
+                std::vector<ann::SparseEntry> entries;
+                query_entries(query, entries);
+                std::vector<float> query_feat(ann::SparseInnerProductSpace::get_feat_mem_dim(entries.size()));
+                ann::SparseInnerProductSpace::encode(entries.data(), entries.size(), query_feat.data());
+                auto candidates = index->predict_single(query_feat.data(), std::max<index_type>(efS, beam_size),
+                    std::max<index_type>(efS, beam_size));
+
+                auto& beam = beams[i];
+                beam.reserve(candidates.size());
+                while (!candidates.empty()) {
+                    // the distance of the inner product space is 1 - <w, x>
+                    index_type c = candidates.top().second;
+                    value_type inner_product = 1.0 - candidates.top().first;
+                    candidates.pop();
+                    beam.emplace_back(path_score(query, c, inner_product, post_processors), c);
+                }
+                size_t keep = std::min<size_t>(beam.size(), beam_size);
+                std::partial_sort(beam.begin(), beam.begin() + keep, beam.end(),
+                    [](const scored_t& a, const scored_t& b) { return a.first > b.first; });
+                beam.resize(keep);
+            }, resolve_threads(threads));
+
+            csr_t result;
+            typename csr_t::mem_index_type nnz = 0;
+            for (auto& beam : beams) {
+                nnz += beam.size();
+            }
+            result.allocate(X.rows, cluster_count(), nnz);
+            result.row_ptr[0] = 0;
+            for (index_type i = 0; i < X.rows; ++i) {
+                auto offset = result.row_ptr[i];
+                for (size_t k = 0; k < beams[i].size(); ++k) {
+                    result.col_idx[offset + k] = beams[i][k].second;
+                    result.val[offset + k] = beams[i][k].first;
+                }
+                result.row_ptr[i + 1] = offset + beams[i].size();
+            }
+            return result;
+        }
+    };
+
+    template <>
+    inline void hnsw_matcher_t::query_entries(const typename csr_t::row_vec_t& query,
+        std::vector<ann::SparseEntry>& entries) const {
+        entries.clear();
+        entries.reserve(query.nnz + 1);
+        for (index_type s = 0; s < query.nnz; ++s) {
+            entries.push_back({query.idx[s], query.val[s]});
+        }
+        std::sort(entries.begin(), entries.end(),
+            [](const ann::SparseEntry& a, const ann::SparseEntry& b) { return a.idx < b.idx; });
+        if (bias[depth - 1] > 0) {
+            entries.push_back({W[depth - 1].rows - 1, bias[depth - 1]});
+        }
+    }
+
+    template <>
+    inline void hnsw_matcher_t::query_entries(const typename drm_t::row_vec_t& query,
+        std::vector<ann::SparseEntry>& entries) const {
+        entries.clear();
+        for (index_type s = 0; s < query.len; ++s) {
+            if (query.val[s] != 0) {
+                entries.push_back({s, query.val[s]});
+            }
+        }
+        if (bias[depth - 1] > 0) {
+            entries.push_back({W[depth - 1].rows - 1, bias[depth - 1]});
+        }
+    }
+
+    // Recall of the matcher beam against the beam of the exact top layers, see HierarchicalMLModel::evaluate_matcher
+    struct matcher_evaluation_t {
+        uint32_t depth = 0;
+        uint32_t beam_size = 0;
+        uint64_t queries = 0;
+        uint64_t exact_nnz = 0; // Clusters in the exact beams
+        uint64_t matched_nnz = 0; // Of those, clusters also in the matcher beams
+        double exact_wall_ms = 0.0;
+        double matcher_wall_ms = 0.0;
+
+        double recall() const {
+            return exact_nnz ? static_cast<double>(matched_nnz) / exact_nnz : 1.0;
+        }
+
+        nlohmann::json to_json() const {
+            return {
+                {"depth", depth},
+                {"beam_size", beam_size},
+                {"queries", queries},
+                {"recall", recall()},
+                {"exact_wall_ms", exact_wall_ms},
+                {"matcher_wall_ms", matcher_wall_ms}
+            };
+        }
+    };
+
     // A class defining a chain of layers that form a prediction model
     class HierarchicalMLModel {
     public:
@@ -1973,6 +2625,20 @@ namespace pecos {
 
         std::vector<ISpecializedModelLayer*> model_layers;
 
+        // Collected by predict when enabled, see enable_instrumentation
+        std::unique_ptr<prediction_instrumentation_t> instrumentation;
+        // Opened by enable_hardware_counters, counts events of the thread that enabled them
+        std::unique_ptr<perf_counter_group_t> counter_group;
+        // Replaces the top layers in predict when set, see set_matcher
+        std::shared_ptr<const hnsw_matcher_t> matcher;
+
+        void attach_instrumentation() {
+            for (size_t i = 0; i < model_layers.size(); ++i) {
+                model_layers[i]->set_instrumentation(instrumentation ? &instrumentation->layers[i] : nullptr,
+                    counter_group.get());
+            }
+        }
+
     public:
         ISpecializedModelLayer* operator[](const uint32_t i) {
             return model_layers[i];
@@ -2020,10 +2686,132 @@ namespace pecos {
             return result;
         }
 
+        // Exact bytes of the structures of every layer, see layer_memory_t
+        std::vector<layer_memory_t> get_memory_usage() const {
+            std::vector<layer_memory_t> result;
+            result.reserve(depth());
+
+            for (auto layer : model_layers) {
+                result.emplace_back(layer->get_memory_usage());
+            }
+
+            return result;
+        }
+
         inline const std::vector<ISpecializedModelLayer*>& get_model_layers() const {
             return model_layers;
         }
 
+        // Turns on per layer timings and work counters in predict (predict_on_selected_outputs is not covered).
+        // Collection is not thread safe, so keep it disabled while predict is called concurrently.
+        void enable_instrumentation(bool enable=true) {
+            if (enable && !instrumentation) {
+                instrumentation.reset(new prediction_instrumentation_t());
+                instrumentation->reset(depth());
+            } else if (!enable) {
+                instrumentation.reset();
+                counter_group.reset();
+            }
+            attach_instrumentation();
+        }
+
+        // Adds hardware counters (cycles, instructions, L1D/LLC/dTLB read misses, branch misses) to the
+        // instrumentation of every layer and of the whole predict call, enabling instrumentation if needed.
+        // The counters belong to the calling thread, so predict has to be called from it as well.
+        // Returns false if no counter could be opened, in which case only timings and work counters are collected.
+        bool enable_hardware_counters(bool enable=true) {
+            if (enable) {
+                enable_instrumentation(true);
+                counter_group.reset(new perf_counter_group_t());
+                if (!counter_group->available()) {
+                    counter_group.reset();
+                }
+            } else {
+                counter_group.reset();
+            }
+            attach_instrumentation();
+            return counter_group != nullptr;
+        }
+
+        inline bool are_hardware_counters_enabled() const {
+            return counter_group != nullptr;
+        }
+
+        inline bool is_instrumentation_enabled() const {
+            return instrumentation != nullptr;
+        }
+
+        const prediction_instrumentation_t& get_instrumentation() const {
+            if (!instrumentation) {
+                throw std::runtime_error("instrumentation is not enabled for this model");
+            }
+            return *instrumentation;
+        }
+
+        void reset_instrumentation() {
+            if (instrumentation) {
+                instrumentation->reset(depth());
+            }
+        }
+
+        // Makes predict start from the beam of the matcher instead of running the layers it covers, whenever
+        // it predicts deeper than those. Layers replaced by the matcher record no instrumentation.
+        // Pass nullptr to predict exactly again.
+        void set_matcher(std::shared_ptr<const hnsw_matcher_t> matcher) {
+            if (matcher) {
+                auto covered = matcher->get_depth();
+                if (covered > depth() || matcher->cluster_count() != model_layers[covered - 1]->label_count()
+                        || matcher->feature_count() != model_layers[covered - 1]->feature_count()) {
+                    throw std::invalid_argument("the matcher does not match the layers of this model");
+                }
+            }
+            this->matcher = matcher;
+        }
+
+        inline const std::shared_ptr<const hnsw_matcher_t>& get_matcher() const {
+            return matcher;
+        }
+
+        // Compares the beam of the matcher with the beam of the layers it replaces, both of size beam_size
+        // (0 for the defaults of the layer above the cut), on the given queries.
+        template <typename query_matrix_t>
+        matcher_evaluation_t evaluate_matcher(
+            const query_matrix_t& queries,
+            const uint32_t beam_size=0,
+            const char* overridden_post_processor=nullptr,
+            const int threads=-1
+        ) {
+            if (!matcher) {
+                throw std::runtime_error("no matcher is set for this model");
+            }
+            matcher_evaluation_t result;
+            result.depth = matcher->get_depth();
+            result.beam_size = beam_size ? beam_size : matcher->default_beam_size();
+            result.queries = queries.rows;
+
+            // Predicting down to the cut does not use the matcher
+            csr_t exact;
+            stopwatch_t watch;
+            predict(queries, exact, result.beam_size, overridden_post_processor, result.beam_size, threads, result.depth);
+            result.exact_wall_ms = watch.wall_ms();
+
+            watch.restart();
+            csr_t approx = matcher->predict(queries, result.beam_size, overridden_post_processor, threads);
+            result.matcher_wall_ms = watch.wall_ms();
+
+            for (index_type i = 0; i < queries.rows; ++i) {
+                std::vector<index_type> approx_row(approx.col_idx + approx.row_ptr[i], approx.col_idx + approx.row_ptr[i + 1]);
+                std::sort(approx_row.begin(), approx_row.end());
+                for (auto k = exact.row_ptr[i]; k < exact.row_ptr[i + 1]; ++k) {
+                    result.matched_nnz += std::binary_search(approx_row.begin(), approx_row.end(), exact.col_idx[k]);
+                }
+                result.exact_nnz += exact.nnz_of_row(i);
+            }
+            exact.free_underlying_memory();
+            approx.free_underlying_memory();
+            return result;
+        }
+
 
     private:
         void destroy_layers() {
@@ -2042,6 +2830,10 @@ namespace pecos {
             destroy_layers();
 
             model_layers = layers;
+            if (instrumentation) {
+                instrumentation->reset(depth());
+                attach_instrumentation();
+            }
 
         }
 
@@ -2091,14 +2883,26 @@ namespace pecos {
             uint32_t prediction_depth = (depth > 0) ?
                 std::min<uint32_t>(depth, model_layers.size()) : model_layers.size();
 
+            perf_counter_snapshot_t counters_start;
+            if (counter_group) {
+                counter_group->read(counters_start);
+            }
+            stopwatch_t watch(instrumentation != nullptr);
+            double counting_start = instrumentation ? instrumentation->layers_counting_time_ms() : 0.0;
+            double counting_cpu_start = instrumentation ? instrumentation->layers_counting_cpu_time_ms() : 0.0;
 
-            // Create first layer's pred;
+            // Create first layer's pred, or start below the matcher
             prediction_matrix_t prev_layer_pred;
-            prev_layer_pred.fill_ones(queries.rows, 1);
-
+            uint32_t first_layer = 0;
+            if (matcher && matcher->get_depth() < prediction_depth) {
+                first_layer = matcher->get_depth();
+                prev_layer_pred = matcher->predict(queries, overridden_beam_size, overridden_post_processor, threads);
+            } else {
+                prev_layer_pred.fill_ones(queries.rows, 1);
+            }
 
             // Run the prediction loop, passing predictions down through layers of the model
-            for (uint32_t i_layer = 0; i_layer < prediction_depth; ++i_layer) {
+            for (uint32_t i_layer = first_layer; i_layer < prediction_depth; ++i_layer) {
                 ISpecializedModelLayer* layer = model_layers[i_layer];
 
                 // Determine topk for this layer
@@ -2119,6 +2923,21 @@ namespace pecos {
                 prev_layer_pred = curr_layer_pred;
             }
             prediction = prev_layer_pred;
+
+            if (instrumentation) {
+                instrumentation->predict_calls += 1;
+                instrumentation->queries += queries.rows;
+                double counting = instrumentation->layers_counting_time_ms() - counting_start;
+                instrumentation->counting_time_ms += counting;
+                instrumentation->wall_time_ms += watch.wall_ms() - counting;
+                instrumentation->cpu_time_ms += watch.cpu_ms()
+                    - (instrumentation->layers_counting_cpu_time_ms() - counting_cpu_start);
+                if (counter_group) {
+                    perf_counter_snapshot_t counters_stop;
+                    counter_group->read(counters_stop);
+                    instrumentation->counters += counter_group->delta(counters_start, counters_stop);
+                }
+            }
         }
 
         /*
@@ -2204,19 +3023,34 @@ namespace pecos {
             }
         }
 
+        // Loads the layers with up to `threads` threads in total (-1 uses all hardware threads).
+        // The budget is split between loading layers concurrently and building the chunks of each
+        // layer, so at most `threads` threads run at once.
         static void load(
             const std::string& folderpath,
             HierarchicalMLModel* model,
-            layer_type_t layer_type = DEFAULT_LAYER_TYPE
+            layer_type_t layer_type = DEFAULT_LAYER_TYPE,
+            int threads = 1
         ) {
             HierarchicalMLModelMetadata xlinear_metadata(folderpath + "/param.json");
             auto depth = xlinear_metadata.depth;
-            std::vector<ISpecializedModelLayer*> layers(depth);
+            std::vector<ISpecializedModelLayer*> layers(depth, nullptr);
+
+            threads = resolve_threads(threads);
+            int layer_threads = std::max(1, std::min<int>(threads, depth));
+            int chunk_threads = std::max(1, threads / layer_threads);
 
             // Abstractly instantiate every layer
-            for (uint32_t d = 0; d < depth; d++) {
-                std::string layer_path = folderpath + "/" + std::to_string(d) + ".model/";
-                layers[d] = ISpecializedModelLayer::instantiate(layer_path, layer_type, d);
+            try {
+                parallel_for<uint32_t>(0, depth, [&](uint32_t d, int thread_id) {
+                    std::string layer_path = folderpath + "/" + std::to_string(d) + ".model/";
+                    layers[d] = ISpecializedModelLayer::instantiate(layer_path, layer_type, d, chunk_threads);
+                }, layer_threads);
+            } catch (...) {
+                for (auto layer : layers) {
+                    delete layer;
+                }
+                throw;
             }
 
             // Model chain assumes ownership of the memory associated with the matrices above
@@ -2225,9 +3059,10 @@ namespace pecos {
 
         HierarchicalMLModel(
             const std::string& folderpath,
-            layer_type_t layer_type = DEFAULT_LAYER_TYPE
+            layer_type_t layer_type = DEFAULT_LAYER_TYPE,
+            int threads = 1
         ) {
-            HierarchicalMLModel::load(folderpath, this, layer_type);
+            HierarchicalMLModel::load(folderpath, this, layer_type, threads);
         }
     };
 } // end namespace pecos
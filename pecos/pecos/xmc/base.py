@@ -95,6 +95,8 @@ class HierarchicalKMeans(Indexer):
         seed=0,
         max_iter=20,
         threads=-1,
+        sample_size=0,
+        collect_stats=False,
         dtype=np.float32,
         **kwargs,
     ):
@@ -111,6 +113,8 @@ class HierarchicalKMeans(Indexer):
             seed (int, optional): Random seed. Default is `0`.
             max_iter (int, optional): Maximum number of iterations for each k-means problem. Default is `20`.
             threads (int, optional): Number of threads to use. `-1` denotes all CPUs. Default is `-1`.
+            sample_size (int, optional): If positive, each 2-means problem is fitted on at most `sample_size` random labels and all of its labels are then assigned in a single pass. Only used for balanced clustering (`imbalanced_ratio == 0`). Default is `0`, which fits on all labels.
+            collect_stats (bool, optional): If True, log the cluster sizes and the clustering objective of every layer at INFO level. Costs up to two extra scoring passes per node. Only used for balanced clustering (`imbalanced_ratio == 0`). Default is `False`.
             dtype (type, optional): Data type for matrices. Default is `numpy.float32`.
             **kwargs: Ignored.
 
@@ -142,9 +146,36 @@ class HierarchicalKMeans(Indexer):
                 )
 
             codes = np.zeros(py_feat_mat.rows, dtype=np.uint32)
+            layer_stats = None
+            if collect_stats:
+                layer_stats = np.zeros((depth, 6), dtype=np.float64)
             codes = clib.run_clustering(
-                py_feat_mat, depth, algo, seed, codes=codes, max_iter=max_iter, threads=threads
+                py_feat_mat,
+                depth,
+                algo,
+                seed,
+                codes=codes,
+                max_iter=max_iter,
+                threads=threads,
+                sample_size=sample_size,
+                layer_stats=layer_stats,
             )
+            if layer_stats is not None:
+                for d, (min_size, max_size, fit_size, size, fit_obj, full_obj) in enumerate(
+                    layer_stats
+                ):
+                    LOGGER.info(
+                        "Clustering layer {}: cluster size min/avg/max {:.0f}/{:.1f}/{:.0f}, objective {:.4f}{}".format(
+                            d,
+                            min_size,
+                            size / (2 ** (d + 1)),
+                            max_size,
+                            full_obj,
+                            " (sample {:.4f} on {:.0f} labels)".format(fit_obj, fit_size)
+                            if fit_size < size
+                            else "",
+                        )
+                    )
             C = cls.convert_codes_to_csc_matrix(codes, depth)
             cluster_chain = ClusterChain.from_partial_chain(
                 C, min_codes=min_codes, nr_splits=nr_splits